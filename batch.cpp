@@ -0,0 +1,204 @@
+// 批量渲染：从任务文件读取多个渲染任务，在调度器中并发执行，共享模型缓存。
+// 每个任务分成绘制和编码（写 TGA）两个阶段，编码依赖绘制，一个任务的编码和下一个任务的绘制重叠
+//
+// 用法：batch [-j 线程数] [--cache 目录] [--cache-size MB] <任务文件>
+// 指定 --cache 时，输入完全相同的任务直接从磁盘缓存中取出结果
+// 任务文件每行一个任务，# 开头为注释：
+//     模型文件  eye_x eye_y eye_z  target_x target_y target_z  宽 高  输出文件
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include "asset_cache.h"
+#include "my_gl.h"
+#include "render_cache.h"
+#include "shader.h"
+#include "task_scheduler.h"
+#include "transform.h"
+
+using namespace std;
+
+
+struct RenderJob {
+    string model_filename;
+    vec3 eye;
+    vec3 target;
+    int width = 0;
+    int height = 0;
+    string output_filename;
+};
+
+/* 读取任务文件，格式错误的行会被跳过 */
+vector<RenderJob> read_jobs(const string &filename) {
+    vector<RenderJob> jobs;
+    ifstream in(filename);
+    if (!in.is_open()) {
+        cerr << "can't open job file " << filename << endl;
+        return jobs;
+    }
+    string line;
+    int line_no = 0;
+    while (getline(in, line)) {
+        ++line_no;
+        if (line.empty() || line[0] == '#') continue;
+        istringstream iss(line);
+        RenderJob job;
+        iss >> job.model_filename
+            >> job.eye.x >> job.eye.y >> job.eye.z
+            >> job.target.x >> job.target.y >> job.target.z
+            >> job.width >> job.height
+            >> job.output_filename;
+        if (iss.fail() || job.width <= 0 || job.height <= 0) {
+            cerr << filename << ":" << line_no << ": bad job, skipped" << endl;
+            continue;
+        }
+        jobs.push_back(job);
+    }
+    return jobs;
+}
+
+/* 一个任务的中间状态：绘制完成之后 context 持有结果，编码之后释放 */
+struct JobState {
+    std::unique_ptr<RenderContext> context;
+    PhongShader shader;
+    std::uint64_t key = 0;
+    bool ok = false;
+};
+
+/* 布置任务的场景（和 main.cpp 相同）并计算结果缓存的键，在载入模型之前执行：
+ * 模型和贴图按文件的内容哈希，缓存命中时只读取文件，不需要解析模型和解码贴图。
+ * 渲染目标从 frame_pool 中复用；result_cache 可以为空。命中时直接写出结果并返回 true */
+bool prepare_job(const RenderJob &job, JobState &state, FramePool &frame_pool, RenderCache *result_cache) {
+    // 设置模型矩阵
+    auto model_matrix = translation(0, 0, -200) * scaling(80) * rotate_y(0);
+
+    // 调度器的线程已经被各个任务占满，三角形内部不再并行
+    state.context.reset(new RenderContext(job.width, job.height, RenderTarget::TILED, &frame_pool));
+    RenderContext &context = *state.context;
+    context.view_port(0, 0, job.width, job.height);
+    context.parallel = false;
+
+    // 贴图在模型载入之后设置
+    PhongShader &phong_shader = state.shader;
+    phong_shader.light_pos = vec3(0, 0.3, 1);
+    phong_shader.camera_pos = job.eye;
+    phong_shader.model_matrix = model_matrix;
+    phong_shader.normal_matrix = model_matrix.invert_transpose();
+    phong_shader.view_matrix = lookat(job.eye, job.target, vec3(0, 1, 0));
+    phong_shader.projection_matrix = projection(100, 100, 100, 400);
+
+    if (!result_cache) return false;
+    Hasher hasher;
+    hasher << std::string("batch/3");
+    hasher.file(job.model_filename);
+    for (const char *suffix : {"_diffuse.tga", "_nm_tangent.tga", "_spec.tga"})
+        hasher.file(Model::texture_filename(job.model_filename, suffix));
+    phong_shader.hash(hasher);
+    context.hash(hasher);
+    hasher << int(TGAImage::RGB) << std::string("rle");
+    state.key = hasher.value();
+    if (result_cache->fetch(state.key, job.output_filename)) {
+        state.context.reset();
+        state.ok = true;
+        return true;
+    }
+    return false;
+}
+
+/* 绘制一个任务，模型已经载入 */
+void render_job(const RenderJob &job, JobState &state, AssetCache &cache) {
+    shared_ptr<const Model> model = cache.model(job.model_filename);
+    if (model->nfaces() == 0) {
+        cerr << "empty model " << job.model_filename << endl;
+        state.context.reset();
+        return;
+    }
+
+    PhongShader &phong_shader = state.shader;
+    phong_shader.diffuse_texture = &model->diffuse_map();
+    phong_shader.normal_texture = &model->normal_map();
+    phong_shader.specular_texture = &model->specular_map();
+
+    // 绘制模型
+    state.context->draw(phong_shader, *model);
+    state.context->resolve();
+}
+
+/* 编码并写出绘制的结果，渲染目标还回 frame_pool */
+void encode_job(const RenderJob &job, JobState &state, RenderCache *result_cache) {
+    if (!state.context) return;
+    const TGAImage &image = state.context->image();
+    if (result_cache)
+        result_cache->store(state.key, image);
+    state.ok = image.write_tga_file(job.output_filename);
+    state.context.reset();
+}
+
+
+int main(int argc, char **argv) {
+    int n_threads = 0;
+    string cache_dir;
+    std::uint64_t cache_mb = 1024;
+    string job_filename;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "-j" && i + 1 < argc) n_threads = atoi(argv[++i]);
+        else if (arg == "--cache" && i + 1 < argc) cache_dir = argv[++i];
+        else if (arg == "--cache-size" && i + 1 < argc) cache_mb = strtoull(argv[++i], nullptr, 10);
+        else job_filename = arg;
+    }
+    if (job_filename.empty()) {
+        cerr << "usage: " << argv[0] << " [-j threads] [--cache dir] [--cache-size MB] <job file>" << endl;
+        return 1;
+    }
+    vector<RenderJob> jobs = read_jobs(job_filename);
+
+    auto start = chrono::steady_clock::now();
+
+    unique_ptr<RenderCache> result_cache;
+    if (!cache_dir.empty())
+        result_cache.reset(new RenderCache(cache_dir, cache_mb << 20));
+
+    TaskScheduler scheduler(n_threads);
+    AssetCache cache(scheduler);
+    FramePool frame_pool;
+    vector<JobState> states(jobs.size());
+    vector<TaskScheduler::TaskHandle> encoded;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        const RenderJob &job = jobs[i];
+        JobState &state = states[i];
+        RenderCache *rc = result_cache.get();
+        // 缓存命中的任务不载入模型
+        if (prepare_job(job, state, frame_pool, rc)) {
+            encoded.emplace_back();
+            continue;
+        }
+        // 模型和贴图的载入是单独的任务，绘制等它们完成之后才开始，不占着线程等待
+        auto model = cache.model_async(job.model_filename);
+        auto rendered = scheduler.submit([&job, &state, &cache]() { render_job(job, state, cache); },
+                                         {model.task()});
+        encoded.push_back(scheduler.submit([&job, &state, rc]() { encode_job(job, state, rc); }, {rendered}));
+    }
+
+    int n_failed = 0;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        scheduler.wait(encoded[i]);
+        if (!states[i].ok) {
+            ++n_failed;
+            cerr << "job failed: " << jobs[i].output_filename << endl;
+        }
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << jobs.size() << " jobs, " << n_failed << " failed, " << scheduler.size() << " threads, "
+         << seconds << " s, " << (seconds > 0 ? jobs.size() * 3600 / seconds : 0) << " jobs/hour" << endl;
+    vector<TaskScheduler::WorkerStats> stats = scheduler.stats();
+    for (size_t i = 0; i < stats.size(); ++i)
+        cout << "thread " << i << ": " << stats[i].tasks << " tasks, " << stats[i].steals << " stolen, "
+             << stats[i].busy_ms / 10 / seconds << "% busy" << endl;
+    if (result_cache)
+        cout << "render cache: " << result_cache->hits() << " hits, " << result_cache->misses() << " misses, "
+             << (result_cache->size_bytes() >> 10) << " KB" << endl;
+    return n_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,90 @@
+// 实时帧缓冲的参考读者：把 main --live 发布在共享内存中的图像保存为 TGA。
+//
+// 用法：fb_dump <共享内存名> [输出文件] [--wait] [--watch] [--unlink]
+// --wait   等到当前帧的所有块都发布之后再保存
+// --watch  每当有新的块发布时输出时间和已发布的块数，直到一帧完成，用于观察第一批像素的延迟
+// --unlink 保存之后删除共享内存的名字
+// 输出文件默认是 ../live.tga
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "live_framebuffer.h"
+
+using namespace std;
+
+
+int main(int argc, char **argv) {
+    string name;
+    string output = "../live.tga";
+    bool wait = false;
+    bool watch = false;
+    bool unlink = false;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--wait") wait = true;
+        else if (arg == "--watch") watch = true;
+        else if (arg == "--unlink") unlink = true;
+        else if (name.empty()) name = arg;
+        else output = arg;
+    }
+    if (name.empty()) {
+        cerr << "usage: fb_dump <name> [output] [--wait] [--watch] [--unlink]" << endl;
+        return 1;
+    }
+
+    // --watch 时渲染进程可能还没有创建共享内存
+    auto start = chrono::steady_clock::now();
+    while (watch && !SharedMemory::exists(name))
+        this_thread::sleep_for(chrono::milliseconds(1));
+    // 刚创建的段可能还没有写好头部
+    LiveFramebuffer fb;
+    while (!fb.open(name)) {
+        if (!watch) return 1;
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    const LiveFramebufferHeader *h = fb.header();
+
+    TGAImage image;
+    uint64_t frame = 0;
+    bool complete = false;
+    vector<bool> dirty;
+    if (watch || wait) {
+        // 轮询序号，变化之后读取帧号和脏块位图
+        uint32_t last = fb.sequence() + 1;
+        while (true) {
+            uint32_t seq = fb.sequence();
+            if (seq != last && !(seq & 1)) {
+                last = seq;
+                uint32_t s = fb.read_begin();
+                frame = h->frame;
+                complete = h->complete != 0;
+                int n_dirty = 0;
+                for (int ty = 0; ty < h->tiles_y; ++ty)
+                    for (int tx = 0; tx < h->tiles_x; ++tx)
+                        n_dirty += fb.tile_dirty(tx, ty);
+                if (!fb.read_retry(s) && watch)
+                    cout << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count()
+                         << " ms: frame " << frame << ", " << n_dirty << "/" << h->tiles_x * h->tiles_y << " tiles"
+                         << (complete ? ", complete" : "") << endl;
+                if (complete && frame > 0) break;
+            }
+            this_thread::sleep_for(chrono::microseconds(200));
+        }
+    }
+
+    if (!fb.snapshot(image, &frame, &complete, &dirty)) {
+        cerr << "can't get a consistent snapshot of " << name << endl;
+        return 1;
+    }
+    int n_dirty = 0;
+    for (bool d : dirty) n_dirty += d;
+    cout << name << ": " << h->width << "x" << h->height << ", frame " << frame << ", "
+         << n_dirty << "/" << dirty.size() << " tiles" << (complete ? ", complete" : "") << endl;
+    image.write_tga_file(output.c_str());
+    if (unlink)
+        fb.unlink();
+    return 0;
+}
@@ -0,0 +1,17 @@
+
+#ifndef RENDER_ALLOC_COUNTER_H
+#define RENDER_ALLOC_COUNTER_H
+
+#include <cstdint>
+
+
+/* 统计整个进程调用 operator new 的次数和字节数，用来检查稳定状态的帧是否还在分配内存。
+ * 只有用 RENDER_ALLOC_COUNTER 编译时才会替换全局的 operator new，否则都返回 0 */
+bool alloc_counter_enabled();
+
+std::uint64_t alloc_count();
+
+std::uint64_t alloc_bytes();
+
+
+#endif //RENDER_ALLOC_COUNTER_H
@@ -0,0 +1,72 @@
+#ifndef RENDER_ASSET_CACHE_H
+#define RENDER_ASSET_CACHE_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "model.h"
+#include "task_scheduler.h"
+
+
+/* 异步载入的资源：对象在提交时就已经分配，地址不变，可以先交给着色器等；载入任务完成之后内容才有效。
+ * task() 可以作为其他任务的依赖，get() 等待载入完成，等待期间执行调度器中的其他任务 */
+template<typename T>
+class AssetFuture {
+public:
+    AssetFuture() = default;
+
+    AssetFuture(std::shared_ptr<T> object, TaskScheduler *scheduler, const TaskScheduler::TaskHandle &task)
+            : object_(std::move(object)), scheduler_(scheduler), task_(task) {}
+
+    bool valid() const { return object_ != nullptr; }
+
+    bool ready() const { return task_.done(); }
+
+    const TaskScheduler::TaskHandle &task() const { return task_; }
+
+    /* 对象的地址，ready() 之前不能读取内容 */
+    const T *pointer() const { return object_.get(); }
+
+    std::shared_ptr<const T> get() const {
+        if (scheduler_) scheduler_->wait(task_);
+        return object_;
+    }
+
+private:
+    std::shared_ptr<T> object_;
+    TaskScheduler *scheduler_ = nullptr;
+    TaskScheduler::TaskHandle task_;
+};
+
+
+/* 多个渲染任务共享的资源缓存：同一个文件只载入一次，载入后只读。
+ * 载入在调度器上并行执行：模型的网格和三张贴图各是一个任务，互不等待 */
+class AssetCache {
+public:
+    explicit AssetCache(TaskScheduler &scheduler = TaskScheduler::global()) : scheduler_(scheduler) {}
+
+    /* 为 true 时网格载入之后在载入任务中做 Model::optimize（顶点缓存和 overdraw 的排序）。在载入模型之前设置 */
+    bool optimize_models = false;
+
+    /* 开始载入模型，textures 为 false 时不载入模型旁边的贴图；已经在载入或者载入过的直接返回 */
+    AssetFuture<Model> model_async(const std::string &filename, bool textures = true);
+
+    /* 开始载入贴图，载入后已经做过垂直翻转 */
+    AssetFuture<TGAImage> texture_async(const std::string &filename);
+
+    /* 获取模型（连同它的贴图），没有载入完成时等待 */
+    std::shared_ptr<const Model> model(const std::string &filename) { return model_async(filename).get(); }
+
+    /* 获取贴图，载入后已经做过垂直翻转 */
+    std::shared_ptr<const TGAImage> texture(const std::string &filename) { return texture_async(filename).get(); }
+
+private:
+    TaskScheduler &scheduler_;
+    std::mutex mutex_;
+    std::map<std::pair<std::string, bool>, AssetFuture<Model>> models_;
+    std::map<std::string, AssetFuture<TGAImage>> textures_;
+};
+
+
+#endif //RENDER_ASSET_CACHE_H
@@ -0,0 +1,75 @@
+#ifndef RENDER_BENCHMARK_H
+#define RENDER_BENCHMARK_H
+
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+
+/* 防止编译器把只为测时间而计算的值优化掉 */
+template<typename T>
+inline void keep(const T &value) {
+    asm volatile("" : : "r"(&value) : "memory");
+}
+
+/* 一个基准的测量结果，samples 是每个样本中平均每次迭代的时间 */
+struct BenchmarkResult {
+    std::string name;
+    int threads = 1;
+    std::string unit;
+    long iterations = 0;  // 每个样本的迭代次数
+    std::vector<double> samples;
+
+    /* p ∈ [0, 100]，相邻样本之间线性插值 */
+    double percentile(double p) const;
+
+    double median() const { return percentile(50); }
+
+    double mean() const;
+
+    /* 样本方差（除以 n - 1） */
+    double variance() const;
+};
+
+
+/* 基准测试：重复执行被测的代码，直到样本数和总时间都达到下限，每个基准先执行一次预热。
+ * 结果可以输出为 JSON 或者 CSV，包括中位数、百分位数和方差，用来比较不同版本的性能 */
+class Benchmark {
+public:
+    // 每个基准至少的样本数和测量时间
+    int min_samples = 15;
+    double min_time_ms = 300;
+    // 样本数的上限
+    int max_samples = 1000;
+    // 名字中不包含 filter 的基准被跳过
+    std::string filter;
+    // 记录在结果中的线程数
+    int threads = 1;
+
+    /* 微基准：body(n) 执行 n 次被测的操作，迭代次数自动选择，使一个样本至少 1 ms；结果的单位是 ns/次 */
+    void micro(const std::string &name, const std::function<void(long)> &body);
+
+    /* 宏基准：body() 执行一次（例如绘制一帧），每次是一个样本；结果的单位是 ms */
+    void macro(const std::string &name, const std::function<void()> &body);
+
+    bool enabled(const std::string &name) const;
+
+    /* fork 一个子进程，把全局调度器的线程数设为 threads 之后执行 fn(*this)，结果传回并加入 results()。
+     * 全局调度器的线程数只能在创建之前设置，所以必须在本进程使用全局调度器之前调用；子进程失败时返回 false */
+    bool run_isolated(int threads, const std::function<void(Benchmark &)> &fn);
+
+    const std::vector<BenchmarkResult> &results() const { return results_; }
+
+    void write_json(std::ostream &out) const;
+
+    void write_csv(std::ostream &out) const;
+
+private:
+    void add(BenchmarkResult result);
+
+    std::vector<BenchmarkResult> results_;
+};
+
+
+#endif //RENDER_BENCHMARK_H
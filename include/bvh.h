@@ -0,0 +1,72 @@
+
+#ifndef RENDER_BVH_H
+#define RENDER_BVH_H
+
+#include <cstdint>
+#include <vector>
+#include "geometry.h"
+#include "model.h"
+
+
+/* 4 条光线组成的光线包，按分量分开存放（SoA），便于 SIMD 同时求交 */
+struct RayPacket4 {
+    float ox[4], oy[4], oz[4];
+    float dx[4], dy[4], dz[4];
+    float tmin[4], tmax[4];
+
+    /* 设置第 i 条光线，dir 不需要归一化，t 以 dir 的长度为单位 */
+    void set(int i, const vec3 &origin, const vec3 &dir, double t_min, double t_max);
+};
+
+
+/* 世界坐标系中三角形的包围体层次结构，用于光线追踪的阴影和环境光遮蔽。
+ * 用分桶的 SAH 构建，较大的子树并行构建；节点按深度优先顺序存放在连续数组中，左孩子紧跟在父节点之后 */
+class BVH {
+public:
+    /* 用模型变换到世界坐标系之后的三角形构建 */
+    BVH(const Model &model, const mat<4, 4> &model_matrix, bool parallel = true);
+
+    /* 线段 origin + t * dir, t in (t_min, t_max) 是否与任何三角形相交 */
+    bool occluded(const vec3 &origin, const vec3 &dir, double t_min, double t_max) const;
+
+    /* 光线包中 active 掩码指定的光线，返回被遮挡的光线的掩码 */
+    int occluded4(const RayPacket4 &packet, int active = 0xf) const;
+
+    /* 法线方向半球上 n_samples 条长度为 radius 的光线中未被遮挡的比例，1 表示完全没有遮蔽 */
+    double ambient_occlusion(const vec3 &pos, const vec3 &normal, int n_samples, double radius,
+                             double t_min) const;
+
+    int node_count() const { return int(nodes_.size()); }
+
+    int triangle_count() const { return int(tris_.size()); }
+
+    /* 世界坐标系中所有三角形的哈希，和构建时用的模型、模型矩阵对应 */
+    std::uint64_t content_hash() const { return hash_; }
+
+private:
+    /* 32 字节：count > 0 为叶子，first 是第一个三角形；否则是内部节点，first 是右孩子，-count-1 是划分的轴 */
+    struct Node {
+        float bmin[3];
+        std::int32_t first;
+        float bmax[3];
+        std::int32_t count;
+    };
+
+    /* 求交用的三角形：顶点和两条边 */
+    struct Tri {
+        float v0[3];
+        float e1[3];
+        float e2[3];
+    };
+
+    struct BuildPrim;
+
+    static std::vector<Node> build(std::vector<BuildPrim> &prims, int begin, int end, int depth, bool parallel);
+
+    std::vector<Node> nodes_;
+    std::vector<Tri> tris_;
+    std::uint64_t hash_ = 0;
+};
+
+
+#endif //RENDER_BVH_H
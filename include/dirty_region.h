@@ -0,0 +1,45 @@
+
+#ifndef RENDER_DIRTY_REGION_H
+#define RENDER_DIRTY_REGION_H
+
+#include <vector>
+#include "render_target.h"
+
+
+/* 增量绘制的脏区域：记录每个实例上一次绘制时在屏幕上的边界，边界变化（移动、出现、消失）时
+ * 新旧边界都需要重新绘制。相交的矩形合并成一个，结果是互不相交的矩形。
+ * 只跟踪实例自己覆盖的像素，影响到边界之外的效果（阴影、后处理）需要另外 invalidate */
+class DirtyRegion {
+public:
+    /* 实例 instance 这一帧的边界，空矩形表示不可见 */
+    void update(int instance, const ScreenRect &bounds);
+
+    /* 实例的内容变化（材质、动画）但边界不变时调用 */
+    void touch(int instance);
+
+    /* 删除实例，它上一次的边界需要重新绘制 */
+    void remove(int instance);
+
+    /* 直接标记一块区域，例如相机移动之后的整个屏幕 */
+    void invalidate(const ScreenRect &rect);
+
+    /* 实例上一次记录的边界 */
+    ScreenRect bounds(int instance) const;
+
+    const std::vector<ScreenRect> &rects() const { return dirty_; }
+
+    bool empty() const { return dirty_.empty(); }
+
+    /* 所有脏矩形的面积之和 */
+    long area() const;
+
+    /* 重新绘制完成之后调用 */
+    void clear() { dirty_.clear(); }
+
+private:
+    std::vector<ScreenRect> bounds_;
+    std::vector<ScreenRect> dirty_;
+};
+
+
+#endif //RENDER_DIRTY_REGION_H
@@ -0,0 +1,52 @@
+
+#ifndef RENDER_FRAME_ARENA_H
+#define RENDER_FRAME_ARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+
+/* 每帧的线性分配器：分配只是移动指针，reset() 一次性释放本帧的全部内存。
+ * 内存块在 reset() 之后保留，稳定状态下的帧不会再向系统申请内存。
+ * 只能存放不需要析构的数据，不是线程安全的 */
+class FrameArena {
+public:
+    explicit FrameArena(std::size_t block_size = 1 << 20) : block_size_(block_size) {}
+
+    void *allocate(std::size_t bytes, std::size_t align = alignof(std::max_align_t));
+
+    /* 分配 n 个 T，不做初始化 */
+    template<typename T>
+    T *alloc(std::size_t n) { return static_cast<T *>(allocate(n * sizeof(T), alignof(T))); }
+
+    /* 在 arena 中构造一个 T */
+    template<typename T, typename... Args>
+    T *make(Args &&... args) { return new(alloc<T>(1)) T(std::forward<Args>(args)...); }
+
+    /* 释放本帧的分配，保留内存块；上一帧用过多个块时合并成一个足够大的块，下一帧就不用再申请 */
+    void reset();
+
+    /* 当前已经分配的字节数 */
+    std::size_t used() const;
+
+    /* 持有的内存块的总大小 */
+    std::size_t capacity() const;
+
+private:
+    struct Block {
+        std::unique_ptr<unsigned char[]> data;
+        std::size_t size;
+    };
+
+    std::size_t block_size_;
+    std::vector<Block> blocks_;
+    // 当前块的下标和块内的偏移
+    std::size_t current_ = 0;
+    std::size_t offset_ = 0;
+};
+
+
+#endif //RENDER_FRAME_ARENA_H
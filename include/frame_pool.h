@@ -0,0 +1,40 @@
+
+#ifndef RENDER_FRAME_POOL_H
+#define RENDER_FRAME_POOL_H
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "frame_arena.h"
+#include "render_target.h"
+#include "tgaimage.h"
+
+
+/* 跨帧回收渲染目标、输出图像和帧内存，多个渲染上下文可以在不同的线程中共用一个池。
+ * 取出的对象尺寸和格式与请求一致，没有合适的对象时才新建 */
+class FramePool {
+public:
+    /* 取出的渲染目标已经清空 */
+    std::unique_ptr<RenderTarget> acquire_target(int width, int height, int samples, RenderTarget::Layout layout);
+
+    void release(std::unique_ptr<RenderTarget> target);
+
+    /* 取出的图像内容是上一次使用留下的 */
+    TGAImage acquire_image(int width, int height, int bytespp);
+
+    void release(TGAImage &&image);
+
+    /* 取出的 arena 已经 reset */
+    std::unique_ptr<FrameArena> acquire_arena();
+
+    void release(std::unique_ptr<FrameArena> arena);
+
+private:
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<RenderTarget>> targets_;
+    std::vector<TGAImage> images_;
+    std::vector<std::unique_ptr<FrameArena>> arenas_;
+};
+
+
+#endif //RENDER_FRAME_POOL_H
@@ -0,0 +1,106 @@
+
+#ifndef RENDER_HASH_H
+#define RENDER_HASH_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include "geometry.h"
+
+
+/* 64 位的非加密哈希，按 8 字节为单位处理，用于计算渲染输入的内容哈希。
+ * 结果只依赖于输入的字节序列，同一台机器（小端序）上跨进程、跨版本保持稳定 */
+class Hasher {
+public:
+    Hasher &bytes(const void *data, size_t n) {
+        auto p = static_cast<const std::uint8_t *>(data);
+        for (; n >= 8; n -= 8, p += 8) {
+            std::uint64_t w;
+            std::memcpy(&w, p, 8);
+            mix(w);
+        }
+        if (n > 0) {
+            std::uint64_t w = 0;
+            std::memcpy(&w, p, n);
+            mix(w ^ (std::uint64_t(n) << 56));
+        }
+        return *this;
+    }
+
+    Hasher &operator<<(std::uint64_t v) { return bytes(&v, sizeof(v)); }
+
+    Hasher &operator<<(int v) { return *this << std::uint64_t(std::int64_t(v)); }
+
+    Hasher &operator<<(double v) { return bytes(&v, sizeof(v)); }
+
+    Hasher &operator<<(const std::string &s) {
+        *this << std::uint64_t(s.size());
+        return bytes(s.data(), s.size());
+    }
+
+    template<int n>
+    Hasher &operator<<(const vec<n> &v) {
+        for (int i = 0; i < n; ++i) *this << v[i];
+        return *this;
+    }
+
+    template<int nrows, int ncols>
+    Hasher &operator<<(const mat<nrows, ncols> &m) {
+        for (int i = 0; i < nrows; ++i) *this << m[i];
+        return *this;
+    }
+
+    /* 文件的内容和长度，不包括路径和修改时间：复制或者 touch 过的文件哈希不变；文件不存在时也有确定的值。
+     * 只读取原始的字节，比解析模型、解码贴图快得多 */
+    Hasher &file(const std::string &filename) {
+        std::FILE *f = std::fopen(filename.c_str(), "rb");
+        if (!f) return *this << -1;
+        // 每次读满整个缓冲区（8 的倍数），结果只取决于内容，和读取的分段无关
+        std::uint8_t buffer[1 << 14];
+        std::uint64_t total = 0;
+        std::size_t n;
+        while ((n = std::fread(buffer, 1, sizeof(buffer), f)) > 0) {
+            bytes(buffer, n);
+            total += n;
+        }
+        std::fclose(f);
+        return *this << total;
+    }
+
+    std::uint64_t value() const {
+        std::uint64_t h = state_ ^ length_;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    /* 16 位十六进制字符串，用作文件名 */
+    std::string hex() const {
+        static const char digits[] = "0123456789abcdef";
+        std::uint64_t h = value();
+        std::string s(16, '0');
+        for (int i = 15; i >= 0; --i, h >>= 4)
+            s[i] = digits[h & 0xf];
+        return s;
+    }
+
+private:
+    void mix(std::uint64_t w) {
+        w *= 0x87c37b91114253d5ULL;
+        w = (w << 31) | (w >> 33);
+        w *= 0x4cf5ad432745937fULL;
+        state_ ^= w;
+        state_ = ((state_ << 27) | (state_ >> 37)) * 5 + 0x52dce729;
+        length_ += 8;
+    }
+
+    std::uint64_t state_ = 0x9e3779b97f4a7c15ULL;
+    std::uint64_t length_ = 0;
+};
+
+
+#endif //RENDER_HASH_H
@@ -0,0 +1,69 @@
+
+#ifndef RENDER_LIGHT_GRID_H
+#define RENDER_LIGHT_GRID_H
+
+#include <algorithm>
+#include <vector>
+#include "geometry.h"
+#include "hash.h"
+
+class RenderContext;
+
+
+/* 点光源，强度随距离平滑衰减，到 radius 处为 0 */
+struct PointLight {
+    vec3 pos;
+    vec3 color;  // 每个通道的强度，1 表示和主光源的漫反射相同
+    double radius;
+
+    /* 距离为 dist 处的衰减系数 */
+    double attenuation(double dist) const {
+        double x = dist / radius;
+        double w = std::max(0., 1 - x * x);
+        return w * w;
+    }
+};
+
+
+/* 分块的光源列表：按渲染目标的块划分屏幕，每个块只保留可能照亮它的光源。
+ * 先对场景做 depth_prepass，再由每个块的深度范围和光源的包围球剔除，着色时只需要遍历所在块的光源 */
+class LightGrid {
+public:
+    void set_lights(const std::vector<PointLight> &lights) { lights_ = lights; }
+
+    const std::vector<PointLight> &lights() const { return lights_; }
+
+    /* 用 context 的深度缓冲和视口构建每个块的光源列表，view、projection 是绘制时使用的矩阵 */
+    void build(const RenderContext &context, const mat<4, 4> &view, const mat<4, 4> &projection);
+
+    /* 像素 (x, y) 所在的块的光源下标，按下标升序 */
+    const int *tile_lights(int x, int y, int &count) const {
+        int tile = (y >> tile_shift_) * tiles_x_ + (x >> tile_shift_);
+        count = offsets_[tile + 1] - offsets_[tile];
+        return indices_.data() + offsets_[tile];
+    }
+
+    /* 所有块的光源列表的平均长度 */
+    double average_lights_per_tile() const;
+
+    void hash(Hasher &h) const;
+
+private:
+    std::vector<PointLight> lights_;
+
+    int tile_shift_ = 0;
+    int tiles_x_ = 0;
+    int tiles_y_ = 0;
+    // 第 i 个块的光源是 indices_[offsets_[i], offsets_[i + 1])
+    std::vector<int> offsets_;
+    std::vector<int> indices_;
+
+    // 构建时的临时数据，跨帧复用
+    std::vector<double> tile_z_min_;
+    std::vector<double> tile_z_max_;
+    std::vector<int> light_rect_;
+    std::vector<int> cursor_;
+};
+
+
+#endif //RENDER_LIGHT_GRID_H
@@ -0,0 +1,117 @@
+
+#ifndef RENDER_LIVE_FRAMEBUFFER_H
+#define RENDER_LIVE_FRAMEBUFFER_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "render_target.h"
+#include "shared_memory.h"
+#include "tgaimage.h"
+
+
+/* 共享内存开头的头部，后面依次是脏块位图 uint64_t[(tiles_x * tiles_y + 63) / 64] 和
+ * BGRA 像素（按行存放，行的顺序和 TGAImage 相同），像素从 pixels_offset 开始。
+ * sequence 是顺序锁：写入时为奇数，读者读之前和读之后的值相同并且为偶数时读到的内容是一致的 */
+struct LiveFramebufferHeader {
+    char magic[4];            // "LFB1"
+    std::uint32_t pixels_offset;
+    std::int32_t width;
+    std::int32_t height;
+    std::int32_t tile_size;
+    std::int32_t tiles_x;
+    std::int32_t tiles_y;
+    std::uint32_t complete;   // 当前帧的所有块都已发布
+    std::uint64_t frame;      // 当前帧号，从 1 开始，0 表示还没有开始过
+    std::atomic<std::uint32_t> sequence;
+};
+
+
+/* 实时帧缓冲：渲染进程把颜色按块发布到共享内存，同一台机器上的查看器随时映射读取，
+ * 不经过文件。脏块位图标记当前帧已经发布过的块，每一帧开始时清空；
+ * 查看器轮询 sequence，变化之后重新读取位图，只显示新完成的块 */
+class LiveFramebuffer {
+public:
+    static const int TILE_SIZE = RenderTarget::TILE_SIZE;
+
+    /* 渲染进程创建，name 以 / 开头 */
+    bool create(const std::string &name, int width, int height);
+
+    /* 查看器只读打开 */
+    bool open(const std::string &name);
+
+    void close() { shm_.close(); }
+
+    /* 删除名字，已经打开的查看器不受影响 */
+    void unlink() { shm_.unlink(); }
+
+    bool is_open() const { return shm_.is_open(); }
+
+    // ---- 写入，只能有一个写者 ----
+
+    /* 帧号加一，清空脏块位图 */
+    void begin_frame();
+
+    /* 把渲染目标中和 rect 相交的块（整块）复制到共享内存，标记为脏 */
+    void publish(const RenderTarget &target, const ScreenRect &rect);
+
+    /* 同上，数据来自已经转换好的图像（例如后处理的结果），RGB 图像的 alpha 填 255 */
+    void publish(const TGAImage &image, const ScreenRect &rect);
+
+    /* 当前帧的所有块都已发布 */
+    void end_frame();
+
+    // ---- 读取 ----
+
+    /* 顺序锁的读：read_begin 等到没有写入时返回序号，读完之后 read_retry 返回 true 表示期间有写入，需要重读 */
+    std::uint32_t read_begin() const;
+
+    bool read_retry(std::uint32_t seq) const;
+
+    /* 不加锁的序号，用于轮询是否有新的内容 */
+    std::uint32_t sequence() const { return header()->sequence.load(std::memory_order_acquire); }
+
+    /* 一致地复制整幅图像（RGB 或 RGBA，格式不对时重新分配为 RGB）、帧号、是否完成和脏块位图，重试 max_retries 次仍然失败时返回 false */
+    bool snapshot(TGAImage &image, std::uint64_t *frame = nullptr, bool *complete = nullptr,
+                  std::vector<bool> *dirty = nullptr, int max_retries = 1000) const;
+
+    const LiveFramebufferHeader *header() const { return static_cast<const LiveFramebufferHeader *>(shm_.data()); }
+
+    /* 像素 (x, y) 的地址，4 字节 BGRA，需要在 read_begin / read_retry 之间读取 */
+    const std::uint8_t *pixel(int x, int y) const {
+        return pixels() + (std::size_t(y) * header()->width + x) * 4;
+    }
+
+    bool tile_dirty(int tx, int ty) const {
+        std::size_t i = std::size_t(ty) * header()->tiles_x + tx;
+        return (bitmap()[i / 64] >> (i % 64) & 1) != 0;
+    }
+
+private:
+    LiveFramebufferHeader *writable_header() { return static_cast<LiveFramebufferHeader *>(shm_.data()); }
+
+    const std::uint64_t *bitmap() const {
+        return reinterpret_cast<const std::uint64_t *>(static_cast<const char *>(shm_.data()) + sizeof(LiveFramebufferHeader));
+    }
+
+    std::uint64_t *bitmap() { return const_cast<std::uint64_t *>(static_cast<const LiveFramebuffer *>(this)->bitmap()); }
+
+    const std::uint8_t *pixels() const {
+        return static_cast<const std::uint8_t *>(shm_.data()) + header()->pixels_offset;
+    }
+
+    std::uint8_t *pixels() { return const_cast<std::uint8_t *>(static_cast<const LiveFramebuffer *>(this)->pixels()); }
+
+    /* 和 rect 相交的整块，标记为脏之后返回 */
+    ScreenRect tile_rect(const ScreenRect &rect);
+
+    void write_begin();
+
+    void write_end();
+
+    SharedMemory shm_;
+};
+
+
+#endif //RENDER_LIVE_FRAMEBUFFER_H
@@ -0,0 +1,30 @@
+
+#ifndef RENDER_MIPMAP_H
+#define RENDER_MIPMAP_H
+
+#include <vector>
+#include "geometry.h"
+#include "tgaimage.h"
+
+
+/* 纹理的 mipmap 链：第 0 层是原图，之后每层宽高减半，用 2x2 的盒式滤波生成 */
+class Mipmap {
+public:
+    explicit Mipmap(const TGAImage &image);
+
+    int levels() const { return int(levels_.size()); }
+
+    const TGAImage &level(int i) const { return levels_[i]; }
+
+    /* 由 uv 在屏幕空间 x、y 方向上的导数计算层级 */
+    double lod(const vec2 &duv_dx, const vec2 &duv_dy) const;
+
+    /* 在最接近 lod 的层级上做最近点采样 */
+    TGAColor sample(const vec2 &uv, double lod) const;
+
+private:
+    std::vector<TGAImage> levels_;
+};
+
+
+#endif //RENDER_MIPMAP_H
@@ -1,6 +1,7 @@
 #ifndef __MODEL_H__
 #define __MODEL_H__
 #include <vector>
+#include <memory>
 #include <string>
 #include "geometry.h"
 #include "tgaimage.h"
@@ -13,22 +14,57 @@ private:
     std::vector<int> facet_vrt_; 
     std::vector<int> facet_tex_;  // indices in the above arrays per triangle
     std::vector<int> facet_nrm_;
+    std::vector<vec4> tangents_;  // per vertex tangent xyz, bitangent sign in w
+    std::vector<int> facet_tan_;  // index in tangents_ per triangle corner
     TGAImage diffusemap_;         // diffuse color texture
     TGAImage normalmap_;          // normal map texture
     TGAImage specularmap_;        // specular map texture
+    std::uint64_t hash_ = 0;      // content hash of geometry and textures
+    vec3 bounds_min_, bounds_max_; // axis aligned bounding box of the vertices
+    std::vector<std::shared_ptr<const Model>> lods_; // simplified levels, lods_[i] is level i+1
+    std::vector<double> lod_errors_;                 // geometric error of each level in model space
+    int lod_max_levels_ = 0;                         // build_lods parameters, optimize rebuilds the levels with them
+    double lod_ratio_ = 0.5;
     void load_texture(const std::string filename, const std::string suffix, TGAImage &img);
+    void compute_tangents();
+    void compute_bounds();
+    void compute_hash();
 public:
     Model() noexcept {}
-    explicit Model(const std::string filename);
+    explicit Model(const std::string filename, const bool textures = true); // textures: also load the _diffuse, _nm_tangent and _spec maps next to the obj
+    Model(std::vector<vec3> verts, std::vector<vec2> uv, std::vector<vec3> norms, std::vector<int> facet_vrt,
+          std::vector<int> facet_tex, std::vector<int> facet_nrm); // geometry built in memory, e.g. by SceneGenerator; three indices per triangle
+    bool write_obj(const std::string &filename) const; // geometry only, the maps are written separately next to it
+    void set_textures(TGAImage diffuse, TGAImage normal, TGAImage specular); // maps loaded separately, e.g. concurrently by AssetCache
+    static std::string texture_filename(const std::string &filename, const std::string &suffix); // empty if filename has no extension
     int nverts() const;
     int nfaces() const;
     vec3 normal(const int iface, const int nthvert) const;  // per triangle corner normal vertex
     vec3 normal(const vec2 &uv) const;                      // fetch the normal vector from the normal map texture
     vec3 vert(const int i) const;
     vec3 vert(const int iface, const int nthvert) const;
+    int facet_vert(const int iface, const int nthvert) const;  // index of the corner in the vertex array
     vec2 uv(const int iface, const int nthvert) const;
+    vec4 tangent(const int iface, const int nthvert) const; // per triangle corner tangent, w is the bitangent sign
     TGAColor diffuse(const vec2 &uv) const;
     double specular(const vec2 &uv) const;
+    const TGAImage &diffuse_map() const { return diffusemap_; }
+    const TGAImage &normal_map() const { return normalmap_; }
+    const TGAImage &specular_map() const { return specularmap_; }
+    std::uint64_t content_hash() const { return hash_; }
+    vec3 bounds_min() const { return bounds_min_; }
+    vec3 bounds_max() const { return bounds_max_; }
+    // simplified levels of detail by quadric error edge collapse, each level has about ratio times the faces
+    // of the previous one; uv seams, hard normal edges and open borders are kept in place
+    void build_lods(int max_levels = 4, double ratio = 0.5);
+    // reorder the triangles for the post-transform vertex cache (tipsify), then sort the resulting clusters
+    // from the center outwards to reduce overdraw, and renumber vertices, uvs and normals by first use;
+    // existing levels of detail are rebuilt from the reordered mesh so that they inherit the order
+    void optimize(int cache_size = 16);
+    double acmr(int cache_size = 16) const; // average cache miss ratio: transformed vertices per triangle with a FIFO cache
+    int nlods() const { return 1 + int(lods_.size()); }
+    const Model &lod(const int level) const { return level == 0 ? *this : *lods_[level-1]; } // geometry only, no textures
+    double lod_error(const int level) const { return level == 0 ? 0 : lod_errors_[level-1]; } // max distance to the original surface, approximately
 };
 #endif //__MODEL_H__
 
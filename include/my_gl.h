@@ -5,18 +5,227 @@
 #include "geometry.h"
 #include "shader.h"
 #include "tgaimage.h"
-
-typedef uint8_t z_buffer_t;
-const z_buffer_t Z_BUFFER_MAX = 255;
-const z_buffer_t Z_BUFFER_MIN = 0;
+#include "hash.h"
+#include "render_target.h"
+#include "frame_arena.h"
+#include "frame_pool.h"
+#include "model.h"
+#include <functional>
+#include <memory>
 
 mat<4, 4> lookat(const vec3 &eye, const vec3 &target, const vec3 &up);
 
 mat<4, 4> projection(int width, int height, int near, int far);
 
-void view_port(int x_offset, int y_offset, int width, int height);
 
-void triangle(TGAImage &image, std::vector<std::vector<z_buffer_t>> &z_buffer, Shader &shader, const std::vector<Location> &locations);
+/* 渲染上下文：持有视口、渲染目标和管线状态，不同的上下文之间互不影响，可以在多个线程中同时渲染。
+ * 给定 pool 时渲染目标、输出图像和帧内存从池中取出，析构时还回去 */
+class RenderContext {
+public:
+    RenderContext(int width, int height, RenderTarget::Layout layout = RenderTarget::TILED,
+                  FramePool *pool = nullptr);
+
+    /* 只渲染 width x height 的屏幕中的 region：渲染目标和 image() 只分配 region 的大小，
+     * 屏幕坐标和视口仍然是整个屏幕的，和 region 不相交的三角形在设置之前跳过，
+     * 结果和整帧渲染的同一区域逐像素相同。get_width()/get_height() 是整个屏幕的尺寸，
+     * target() 的坐标相对 target_origin()；后处理、LightGrid 等按整帧处理 target() 的模块不支持 */
+    RenderContext(int width, int height, const ScreenRect &region,
+                  RenderTarget::Layout layout = RenderTarget::TILED, FramePool *pool = nullptr);
+
+    ~RenderContext();
+
+    RenderContext(const RenderContext &) = delete;
+
+    RenderContext &operator=(const RenderContext &) = delete;
+
+    /* 着色率（宽 x 高）：一次片段着色器调用的结果广播到块内被覆盖的所有像素，深度和覆盖仍然逐像素计算 */
+    enum ShadingRate { RATE_1X1, RATE_1X2, RATE_2X2, RATE_4X4 };
+
+    void view_port(int x_offset, int y_offset, int width, int height);
+
+    /* 开始新的一帧：清空颜色和深度，释放 arena 中上一帧的数据 */
+    void clear();
+
+    /* 开始新的一帧，只清空 rects 内的颜色和深度，其余的像素保留上一帧的结果 */
+    void clear(const std::vector<ScreenRect> &rects);
+
+    /* 之后的绘制只写入 rect 内的像素（和 region 求交），不和 rect 相交的三角形在顶点着色之后直接跳过 */
+    void set_scissor(const ScreenRect &rect);
+
+    /* 之后的绘制只写入 rects（互不相交）内的像素，例如增量绘制的所有脏矩形：一次 draw 中每个三角形只做一次顶点着色，
+     * 不和任何矩形相交的跳过，其余的只光栅化和矩形相交的部分。get_scissor() 是它们的外接矩形 */
+    void set_scissor(const std::vector<ScreenRect> &rects);
+
+    void clear_scissor();
+
+    const ScreenRect &get_scissor() const { return scissor_; }
+
+    /* 模型经过 mvp 变换之后在屏幕上的包围矩形（已经和屏幕求交），顶点在相机平面上或者后面时返回整个屏幕 */
+    ScreenRect screen_bounds(const Model &model, const mat<4, 4> &mvp) const;
+
+    /* 按模型包围盒在屏幕上的大小选择细节层次：返回误差投影到屏幕上不超过 pixel_error 个像素的最粗的一级，
+     * 包围盒跨过相机平面时返回 0。没有调用过 Model::build_lods 时总是 0 */
+    int select_lod(const Model &model, const mat<4, 4> &mvp, double pixel_error) const;
+
+    /* 把渲染目标的尺寸、视口等管线状态加入哈希 */
+    void hash(Hasher &h) const;
+
+    /* 绘制三角形，接受模型坐标系的点 */
+    void triangle(Shader &shader, const std::vector<Location> &locations);
+
+    void triangle(Shader &shader, const Location *locations);
+
+    /* 绘制模型的所有三角形，顶点数据放在本帧的 arena 中 */
+    void draw(Shader &shader, const Model &model);
+
+    /* 只写深度，不调用片段着色器。之后用同样的几何体 draw() 时每个像素只有最前面的片段通过深度测试，
+     * 也可以在着色之前由深度得到每个块的深度范围，见 LightGrid */
+    void depth_prepass(Shader &shader, const Model &model);
+
+    /* 裁剪坐标经过透视除法和视口变换得到屏幕坐标，z 是深度缓冲中的值 */
+    vec3 to_screen(const vec4 &clip) const;
+
+    /* to_screen 的逆变换：屏幕坐标还原为视图坐标系中的点，inv_projection 是投影矩阵的逆 */
+    vec3 to_view(const vec3 &screen, const mat<4, 4> &inv_projection) const;
+
+    /* 设置每个像素的采样数：1（不做多重采样）, 2, 4, 8，会清空渲染目标 */
+    void set_samples(int samples);
+
+    int get_samples() const { return samples_; }
+
+    /* 之后绘制使用的着色率，只对没有多重采样的绘制有效 */
+    void set_shading_rate(ShadingRate rate) { shading_rate_ = rate; }
+
+    ShadingRate get_shading_rate() const { return shading_rate_; }
+
+    /* 渲染目标的块 (tx, ty) 的着色率，和 set_shading_rate 的着色率取较粗的一个 */
+    void set_tile_shading_rate(int tx, int ty, ShadingRate rate);
+
+    /* 块 (tx, ty) 实际使用的着色率 */
+    ShadingRate tile_shading_rate(int tx, int ty) const {
+        if (tile_rates_.empty()) return shading_rate_;
+        return std::max(shading_rate_, ShadingRate(tile_rates_[std::size_t(ty) * target_->tiles_x() + tx]));
+    }
+
+    /* 不再使用逐块的着色率 */
+    void clear_tile_shading_rates() { tile_rates_.clear(); }
+
+    /* 由渲染目标中现有的图像（上一帧）为每个块选择着色率：把块分成着色率大小的小块，
+     * 取小块内亮度方差的平均值不超过 max_variance 的最粗的着色率，亮度的范围是 [0, 255]。
+     * 在 clear() 之前调用 */
+    void auto_shading_rates(double max_variance) { auto_shading_rates(max_variance, *target_); }
+
+    /* 同上，由另一个尺寸相同的渲染目标（例如流水线中上一帧的上下文）中的图像选择，可以在 clear() 之后调用 */
+    void auto_shading_rates(double max_variance, const RenderTarget &previous);
+
+    static int rate_width(ShadingRate rate) { return rate == RATE_1X1 || rate == RATE_1X2 ? 1 : rate == RATE_2X2 ? 2 : 4; }
+
+    static int rate_height(ShadingRate rate) { return rate == RATE_1X1 ? 1 : rate == RATE_4X4 ? 4 : 2; }
+
+    /* 把渲染目标转换到 image()，多重采样时合并采样点，绘制完成后调用。image() 是 region 大小的图像 */
+    void resolve();
+
+    /* 只转换 rect（屏幕坐标）内的像素，image() 的其余部分保持不变 */
+    void resolve(const ScreenRect &rect);
+
+    RenderTarget &target() { return *target_; }
+
+    const RenderTarget &target() const { return *target_; }
+
+    /* 本帧的临时内存，clear() 时释放 */
+    FrameArena &arena() { return *arena_; }
+
+    TGAImage &image() { return image_; }
+
+    const TGAImage &image() const { return image_; }
+
+    int get_width() const { return width_; }
+
+    int get_height() const { return height_; }
+
+    /* 渲染的屏幕区域，image() 的左上角是 region 的左上角 */
+    const ScreenRect &get_region() const { return region_; }
+
+    /* target() 的像素 (0, 0) 在屏幕上的位置：region 的左上角向下对齐到渲染目标的块，
+     * 2x2 quad 和逐块的着色率因此和整帧渲染时对齐 */
+    int target_origin_x() const { return origin_x_; }
+
+    int target_origin_y() const { return origin_y_; }
+
+    // 是否在 draw 的分块、三角形内部、resolve 等循环中使用全局调度器并行；批量渲染时由外部的调度器负责并行
+    bool parallel = true;
+
+    // 不为空时 draw 每画完渲染目标的一个块就调用一次，参数是块在屏幕上的矩形（和 region 求交）。
+    // 分块绘制时在画这个块的线程中调用，可能同时被多个线程调用；逐个三角形绘制时在 draw 的最后依次调用。
+    // 可以在这里读取这个块的颜色，例如发布到实时帧缓冲；只写深度的绘制不调用
+    std::function<void(const ScreenRect &)> tile_done;
+
+private:
+    struct TriangleSetup;
+    struct BinnedTriangle;
+
+    /* 顶点着色，求屏幕上的边界（和 scissor 求交）并设置三角形；不填充清空的块，绘制之前要 prepare 边界。
+     * 三角形退化或者和 scissor 不相交时返回 false */
+    bool setup_triangle(Shader &shader, const Location *locations, TriangleSetup &setup,
+                        int border_min[2], int border_max[2]);
+
+    /* 分块绘制：把三角形分成连续的几批，每批并行做顶点着色和设置，varyings 存进 arena，并统计每个块中的三角形；
+     * 再按块并行光栅化和着色，恢复 varyings 而不再调用 vertex。每个块内仍然按提交的顺序，结果和逐个三角形绘制相同。
+     * 着色器不能复制时返回 false，什么也不画 */
+    bool draw_binned(Shader &shader, const Location *locations, int n_faces);
+
+    /* 按采样数和着色率绘制 [x0, x1] x [y0, y1]，区域在渲染目标的一个块内；有 scissor 矩形列表时只绘制和矩形相交的部分 */
+    void tile_raster(Shader &shader, const TriangleSetup &setup, int x0, int y0, int x1, int y1);
+
+    void tile_raster_rect(Shader &shader, const TriangleSetup &setup, int x0, int y0, int x1, int y1);
+
+    void triangle_msaa(Shader &shader, const TriangleSetup &setup, const int border_min[2], const int border_max[2]);
+
+    void msaa_pixels(Shader &shader, const TriangleSetup &setup, int x0, int y0, int x1, int y1);
+
+    void pixel_quads(Shader &shader, const TriangleSetup &setup, int x0, int y0, int x1, int y1);
+
+    /* 可以绘制的屏幕区域：region 扩展到最大的着色率块（4x4）的边界，边缘的块和整帧渲染时一样由完整的块决定着色点 */
+    ScreenRect screen() const { return bounds_; }
+
+    /* 屏幕坐标的像素在渲染目标中的下标 */
+    std::size_t target_index(int x, int y) const { return target_->index(x - origin_x_, y - origin_y_); }
+
+    /* 按渲染目标的块并行绘制，每个块使用自己的着色率；逐块的着色率、粗粒度着色和 scissor 矩形列表使用 */
+    void triangle_tiles(Shader &shader, const TriangleSetup &setup, const int border_min[2], const int border_max[2]);
+
+    /* 块 (tx, ty) 画完了，调用 tile_done */
+    void finish_tile(int tx, int ty);
+
+    /* 以 RW x RH 的着色率绘制 [x0, x1] x [y0, y1]，区域在渲染目标的一个块内；只写入区域内的像素 */
+    template<int RW, int RH>
+    void coarse_quads(Shader &shader, const TriangleSetup &setup, int x0, int y0, int x1, int y1);
+
+    int width_;
+    int height_;
+    ScreenRect region_;
+    ScreenRect bounds_;
+    int origin_x_;
+    int origin_y_;
+
+    int view_port_x_offset;
+    int view_port_y_offset;
+    int view_port_width;
+    int view_port_height;
+
+    int samples_ = 1;
+    bool depth_only_ = false;
+    ShadingRate shading_rate_ = RATE_1X1;
+    ScreenRect scissor_;
+    // set_scissor 的矩形列表，已经和 screen() 求交；空表示只有 scissor_
+    std::vector<ScreenRect> scissor_rects_;
+    // 每个块的着色率，空表示不使用
+    std::vector<std::uint8_t> tile_rates_;
+    FramePool *pool_;
+    std::unique_ptr<RenderTarget> target_;
+    std::unique_ptr<FrameArena> arena_;
+    TGAImage image_;
+};
 
 
 #endif //MY_TINY_RENDER_MY_GL_H
@@ -0,0 +1,90 @@
+
+#ifndef RENDER_POST_PROCESS_H
+#define RENDER_POST_PROCESS_H
+
+#include <cstdint>
+#include <vector>
+#include "geometry.h"
+#include "tgaimage.h"
+
+class RenderContext;
+
+
+/* 后处理：在内存中的渲染目标上依次执行一串操作，渲染目标只读一次，输出图像只写一次。
+ * 屏幕按 TILE_SIZE 的块并行处理：每个块连同后面的邻域操作需要的边缘（halo）一起读入线程自己的缓冲，
+ * 在缓冲中执行所有操作，每经过一个邻域操作有效区域缩小它的半径，最后只剩下块本身写入输出。
+ * 相邻的逐像素操作（曝光、色调映射、gamma、调色）融合成对缓冲的一次遍历。
+ * 颜色在缓冲中是 [0, 1] 的 RGB 浮点数，按线性值处理 */
+class PostProcess {
+public:
+    static const int TILE_SIZE = 64;
+
+    /* 逐像素的操作 */
+    void add_exposure(double exposure);
+
+    void add_tone_map_reinhard();
+
+    void add_tone_map_aces();
+
+    void add_gamma(double gamma);
+
+    /* RGB 颜色先乘 matrix 再加 offset，然后以亮度为中心按 saturation 调整饱和度 */
+    void add_color_grade(const mat<3, 3> &matrix, const vec3 &offset, double saturation);
+
+    /* 屏幕空间的环境光遮蔽：在视图坐标系中朝向相机的半球内取 samples 个点，半径 radius，
+     * 被深度缓冲遮挡的比例乘以 strength 之后变暗；只读深度，颜色不需要 halo */
+    void add_ssao(int samples, double radius, double strength);
+
+    /* 可分离的高斯模糊，sigma = radius / 2 */
+    void add_blur(int radius);
+
+    /* 用 3x3 十字邻域的拉普拉斯锐化 */
+    void add_sharpen(double amount);
+
+    void clear() { stages_.clear(); }
+
+    bool empty() const { return stages_.empty(); }
+
+    /* 对 context 的渲染目标执行所有操作，结果写入 image；projection 是绘制时的投影矩阵，SSAO 用它还原视图坐标 */
+    void run(const RenderContext &context, const mat<4, 4> &projection, TGAImage &image);
+
+private:
+    enum Kind { EXPOSURE, REINHARD, ACES, GAMMA, COLOR_GRADE, SSAO, BLUR, SHARPEN };
+
+    struct Stage {
+        Kind kind;
+        double a = 0, b = 0;
+        int n = 0;
+        mat<3, 3> matrix;
+        vec3 offset;
+
+        bool per_pixel() const { return kind < SSAO; }
+
+        /* 读取颜色的邻域半径 */
+        int radius() const { return kind == BLUR ? n : kind == SHARPEN ? 1 : 0; }
+    };
+
+    struct Tile;
+
+    /* 在当前有效区域上融合执行 stages_[first, last) 的逐像素操作 */
+    void pixel_ops(int first, int last, const Tile &tile, float *buf) const;
+
+    void ssao(const Stage &stage, const Tile &tile, const float *src, float *dst) const;
+
+    std::vector<Stage> stages_;
+
+    // 每个线程的缓冲，跨帧复用
+    std::vector<std::vector<float>> scratch_;
+    std::vector<std::vector<std::uint8_t>> rows_;
+
+    // 本次 run 的参数
+    const RenderContext *context_ = nullptr;
+    mat<4, 4> projection_;
+    mat<4, 4> inv_projection_;
+    double view_z_[256] = {};
+    std::vector<vec3> kernel_;
+    std::vector<vec4> kernel_clip_;
+};
+
+
+#endif //RENDER_POST_PROCESS_H
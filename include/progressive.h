@@ -0,0 +1,67 @@
+#ifndef RENDER_PROGRESSIVE_H
+#define RENDER_PROGRESSIVE_H
+
+#include <functional>
+#include <memory>
+#include <vector>
+#include "my_gl.h"
+
+
+/* 渐进式渲染：先在低分辨率下画出整幅的粗略图像，再按优先级逐个区域在全分辨率下重新绘制，
+ * 直到截止时间或者所有需要细化的区域都完成。每次更新的区域交给输出，返回时 context.image() 是截止时间内最好的图像。
+ * 预览的延迟由 budget_ms 决定，和场景的大小无关：粗略的一遍总是完成，之后的区域只在预计能在截止时间之前完成时才绘制。
+ * 全部细化之后的结果和直接在 context 上绘制的结果相同 */
+class ProgressiveRenderer {
+public:
+    enum Order {
+        CENTER_FIRST,    // 离屏幕中心近的区域先细化
+        VARIANCE_FIRST,  // 粗略图像中亮度方差大（边缘、纹理细节多）的区域先细化
+    };
+
+    /* 在给定的上下文中绘制整个场景：先是低分辨率的上下文，之后是设置了剪裁矩形的 context */
+    typedef std::function<void(RenderContext &)> Draw;
+
+    /* 图像中 rect 的部分已经更新 */
+    typedef std::function<void(const TGAImage &, const ScreenRect &)> Sink;
+
+    double budget_ms = 100;     // 从调用 render 开始计算的截止时间
+    int coarse_scale = 4;       // 粗略的一遍的分辨率是 1/coarse_scale
+    int block_size = 128;       // 每次细化的区域的边长，取整到渲染目标的块
+    Order order = CENTER_FIRST;
+    double max_variance = -1;   // 亮度方差不超过它的区域认为粗略的结果已经足够，不再细化；小于 0 时全部细化
+
+    /* bounds 是 draw 绘制的内容在 context 屏幕上的包围矩形（例如各个模型的 RenderContext::screen_bounds 的并集），
+     * 和它不相交的区域不需要细化。所有需要细化的区域都已完成时返回 true */
+    bool render(RenderContext &context, const Draw &draw, const ScreenRect &bounds, const Sink &sink = Sink());
+
+    // ---- 上一次 render 的统计 ----
+
+    double coarse_ms() const { return coarse_ms_; }
+
+    double elapsed_ms() const { return elapsed_ms_; }
+
+    int refined() const { return refined_; }
+
+    /* 和 bounds 不相交或者方差足够小而跳过的区域 */
+    int skipped() const { return skipped_; }
+
+    /* 截止时间到了还没有细化的区域 */
+    int remaining() const { return remaining_; }
+
+private:
+    struct Block {
+        ScreenRect rect;
+        double key;
+    };
+
+    std::unique_ptr<RenderContext> coarse_;
+    std::vector<Block> blocks_;
+    double coarse_ms_ = 0;
+    double elapsed_ms_ = 0;
+    int refined_ = 0;
+    int skipped_ = 0;
+    int remaining_ = 0;
+};
+
+
+#endif //RENDER_PROGRESSIVE_H
@@ -0,0 +1,63 @@
+
+#ifndef RENDER_RENDER_CACHE_H
+#define RENDER_RENDER_CACHE_H
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include "tgaimage.h"
+
+
+/* 以渲染输入的内容哈希为键的磁盘缓存。
+ * 每个结果保存为 <目录>/<哈希>.tga，命中时更新文件的修改时间，
+ * 总大小超过上限时按最近使用时间淘汰，因此 LRU 顺序在进程之间也能保持 */
+class RenderCache {
+public:
+    /* 目录不存在时会创建，max_bytes 为缓存文件总大小的上限 */
+    RenderCache(const std::string &dir, std::uint64_t max_bytes);
+
+    /* 命中时读取缓存的图像 */
+    bool lookup(std::uint64_t key, TGAImage &image);
+
+    /* 命中时直接把缓存文件复制到 filename，省去解码和编码 */
+    bool fetch(std::uint64_t key, const std::string &filename);
+
+    /* 保存渲染结果，按 write_tga_file 的默认格式写入，必要时淘汰旧的结果 */
+    void store(std::uint64_t key, const TGAImage &image);
+
+    std::uint64_t size_bytes() const { return total_bytes_; }
+
+    int hits() const { return hits_; }
+
+    int misses() const { return misses_; }
+
+private:
+    struct Entry {
+        std::uint64_t key;
+        std::uint64_t bytes;
+    };
+
+    std::string path(std::uint64_t key) const;
+
+    /* 查找并把条目移动到最近使用的位置，调用时需要持有锁 */
+    bool touch(std::uint64_t key);
+
+    /* 淘汰最久未使用的条目直到总大小不超过上限，调用时需要持有锁 */
+    void evict();
+
+    std::string dir_;
+    std::uint64_t max_bytes_;
+    std::uint64_t total_bytes_ = 0;
+    int hits_ = 0;
+    int misses_ = 0;
+
+    // 链表头部是最近使用的条目
+    std::list<Entry> lru_;
+    std::map<std::uint64_t, std::list<Entry>::iterator> index_;
+    std::mutex mutex_;
+};
+
+
+#endif //RENDER_RENDER_CACHE_H
@@ -0,0 +1,155 @@
+
+#ifndef RENDER_RENDER_TARGET_H
+#define RENDER_RENDER_TARGET_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include "tgaimage.h"
+
+typedef uint8_t z_buffer_t;
+const z_buffer_t Z_BUFFER_MAX = 255;
+const z_buffer_t Z_BUFFER_MIN = 0;
+
+
+/* 屏幕上的矩形 [x0, x1] x [y0, y1]，x0 > x1 或者 y0 > y1 时为空 */
+struct ScreenRect {
+    int x0 = 0, y0 = 0, x1 = -1, y1 = -1;
+
+    ScreenRect() = default;
+
+    ScreenRect(int x0, int y0, int x1, int y1) : x0(x0), y0(y0), x1(x1), y1(y1) {}
+
+    bool empty() const { return x0 > x1 || y0 > y1; }
+
+    long area() const { return empty() ? 0 : long(x1 - x0 + 1) * (y1 - y0 + 1); }
+
+    bool intersects(const ScreenRect &r) const {
+        return !empty() && !r.empty() && x0 <= r.x1 && r.x0 <= x1 && y0 <= r.y1 && r.y0 <= y1;
+    }
+
+    ScreenRect intersected(const ScreenRect &r) const {
+        return {std::max(x0, r.x0), std::max(y0, r.y0), std::min(x1, r.x1), std::min(y1, r.y1)};
+    }
+
+    ScreenRect translated(int dx, int dy) const { return {x0 + dx, y0 + dy, x1 + dx, y1 + dy}; }
+
+    /* 包含两个矩形的最小矩形 */
+    ScreenRect united(const ScreenRect &r) const {
+        if (empty()) return r;
+        if (r.empty()) return *this;
+        return {std::min(x0, r.x0), std::min(y0, r.y0), std::max(x1, r.x1), std::max(y1, r.y1)};
+    }
+
+    bool operator==(const ScreenRect &r) const {
+        return (empty() && r.empty()) || (x0 == r.x0 && y0 == r.y0 && x1 == r.x1 && y1 == r.y1);
+    }
+
+    bool operator!=(const ScreenRect &r) const { return !(*this == r); }
+};
+
+
+/* 渲染目标：颜色（BGRA，每个采样点 4 字节）和深度分别存放在 64 字节对齐的连续内存中，
+ * 可以按行存放，也可以按 TILE_SIZE x TILE_SIZE 的块存放，使一个块的像素在内存中连续。
+ * 清空只是给每个块打上标记，块第一次被绘制之前（prepare）或者输出时才真正填充清空值 */
+class RenderTarget {
+public:
+    enum Layout { LINEAR, TILED };
+
+    static const int TILE_SHIFT = 4;
+    static const int TILE_SIZE = 1 << TILE_SHIFT;
+
+    RenderTarget(int width, int height, int samples = 1, Layout layout = TILED);
+
+    /* 所有块标记为已清空，不写内存 */
+    void clear();
+
+    /* 只清空矩形内的像素：完全在矩形内的块标记为已清空，其余的块直接填充重叠的部分 */
+    void clear(const ScreenRect &rect);
+
+    /* 绘制区域 [x0, x1] x [y0, y1] 之前调用，填充其中被标记为清空的块；不能和绘制并行调用 */
+    void prepare(int x0, int y0, int x1, int y1);
+
+    /* 像素 (x, y) 的第一个采样点在平面中的下标，同一个像素的采样点连续存放 */
+    std::size_t index(int x, int y) const {
+        std::size_t pixel;
+        if (layout_ == TILED) {
+            std::size_t tile = std::size_t(y >> TILE_SHIFT) * tiles_x_ + (x >> TILE_SHIFT);
+            pixel = tile << (2 * TILE_SHIFT) | (y & (TILE_SIZE - 1)) << TILE_SHIFT | (x & (TILE_SIZE - 1));
+        } else {
+            pixel = std::size_t(y) * stride_ + x;
+        }
+        return pixel * samples_;
+    }
+
+    z_buffer_t &depth(std::size_t i) { return depth_[i]; }
+
+    z_buffer_t depth(std::size_t i) const { return depth_[i]; }
+
+    void set_color(std::size_t i, const TGAColor &c) { std::memcpy(color_.get() + i * 4, c.bgra, 4); }
+
+    const std::uint8_t *color(std::size_t i) const { return color_.get() + i * 4; }
+
+    /* 第 y 行的像素按 TGAImage 的格式（BGR 或 BGRA）写入 dst，多重采样时取平均，可以作为任意输出的数据源 */
+    void resolve_row(int y, std::uint8_t *dst, int bytespp) const;
+
+    /* 第 y 行的 [x0, x1] 部分，格式和 resolve_row 相同 */
+    void resolve_span(int y, int x0, int x1, std::uint8_t *dst, int bytespp) const;
+
+    /* 像素第一个采样点的深度，没有绘制过的块返回清空值 */
+    z_buffer_t pixel_depth(int x, int y) const {
+        return tile_cleared(x >> TILE_SHIFT, y >> TILE_SHIFT) ? Z_BUFFER_MAX : depth_[index(x, y)];
+    }
+
+    /* 转换为 TGAImage，尺寸和格式不同时重新分配 */
+    void resolve(TGAImage &image, bool parallel = true) const;
+
+    int get_width() const { return width_; }
+
+    int get_height() const { return height_; }
+
+    int get_samples() const { return samples_; }
+
+    Layout get_layout() const { return layout_; }
+
+    int tiles_x() const { return tiles_x_; }
+
+    int tiles_y() const { return tiles_y_; }
+
+    /* 块是否处于清空状态，即 clear() 之后还没有被绘制过 */
+    bool tile_cleared(int tx, int ty) const { return tile_cleared_[std::size_t(ty) * tiles_x_ + tx] != 0; }
+
+private:
+    struct AlignedFree {
+        void operator()(void *p) const;
+    };
+
+    template<typename T>
+    using AlignedPtr = std::unique_ptr<T[], AlignedFree>;
+
+    template<typename T>
+    static AlignedPtr<T> allocate(std::size_t n);
+
+    /* 把一个块填充为清空值 */
+    void fill_tile(int tx, int ty);
+
+    int width_;
+    int height_;
+    int samples_;
+    Layout layout_;
+
+    int tiles_x_;
+    int tiles_y_;
+    // 按行存放时一行的像素数，向上取整到块的宽度
+    int stride_;
+
+    AlignedPtr<std::uint8_t> color_;
+    AlignedPtr<z_buffer_t> depth_;
+    // 每个块是否处于清空状态
+    std::vector<std::uint8_t> tile_cleared_;
+};
+
+
+#endif //RENDER_RENDER_TARGET_H
@@ -0,0 +1,135 @@
+
+#ifndef RENDER_REPROJECTION_CACHE_H
+#define RENDER_REPROJECTION_CACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "my_gl.h"
+
+
+/* 时间上的重投影缓存：保存上一帧每个像素的颜色、深度、表面编号（物体和三角形的编号）以及颜色着色之后经过的帧数。
+ * 绘制新的一帧时 CachedShader 把每个可见的片段用上一帧的矩阵投影回上一帧的屏幕，那里是同一个表面、深度一致
+ * 并且颜色没有过期时直接复用，否则调用原来的着色器。适用于相机和模型缓慢运动的序列，
+ * 光照、材质改变时调用 invalidate()。只支持不做多重采样、着色率为 1x1 的绘制 */
+class ReprojectionCache {
+public:
+    ReprojectionCache(int width, int height);
+
+    ReprojectionCache(const ReprojectionCache &) = delete;
+
+    ReprojectionCache &operator=(const ReprojectionCache &) = delete;
+
+    /* 缓存的颜色最多连续复用的帧数（小于 256），之后重新着色；0 表示每一帧都重新着色，结果和不使用缓存相同 */
+    int max_age = 8;
+
+    /* 重投影得到的深度和缓存的深度之差的上限，单位是深度缓冲的值；
+     * 取最近的像素带来的误差由三角形的深度梯度另外估计，加在这个值上 */
+    double depth_tolerance = 0.05;
+
+    /* 为 true 时只复用同一个三角形的颜色；否则同一个物体上深度一致的点都可以复用，三角形很小时复用的比例高得多 */
+    bool strict = false;
+
+    /* context.clear() 之后、绘制之前调用 */
+    void begin_frame(const RenderContext &context);
+
+    /* 一帧绘制完成之后调用，保存这一帧作为下一帧的缓存 */
+    void end_frame(const RenderContext &context);
+
+    /* 丢弃缓存，下一帧全部重新着色 */
+    void invalidate() { valid_ = false; }
+
+    /* 本帧复用和重新着色的片段数 */
+    std::uint64_t reused() const { return reused_; }
+
+    std::uint64_t shaded() const { return shaded_; }
+
+    double reuse_ratio() const;
+
+private:
+    friend class CachedShader;
+
+    static const std::uint32_t NO_SURFACE = 0;
+
+    /* 物体 object 的第 face 个三角形的编号 */
+    static std::uint32_t surface_id(int object, int face);
+
+    int width_;
+    int height_;
+    const RenderContext *context_ = nullptr;
+    bool valid_ = false;
+
+    // 上一帧，颜色是 BGRA；深度是没有量化的屏幕坐标 z，比深度缓冲精确
+    std::vector<std::uint8_t> prev_color_;
+    std::vector<float> prev_depth_;
+    std::vector<std::uint32_t> prev_id_;
+    std::vector<std::uint8_t> prev_age_;
+
+    // 本帧由 CachedShader 写入
+    std::vector<std::uint32_t> id_;
+    std::vector<float> depth_;
+    std::vector<std::uint8_t> age_;
+
+    // 每个物体上一帧和本帧的 MVP 矩阵，has 表示这一帧绘制过
+    std::vector<mat<4, 4>> prev_mvp_;
+    std::vector<char> prev_has_mvp_;
+    std::vector<mat<4, 4>> mvp_;
+    std::vector<char> has_mvp_;
+
+    std::atomic<std::uint64_t> reused_{0};
+    std::atomic<std::uint64_t> shaded_{0};
+};
+
+
+/* 包装另一个着色器，可见的片段先查询重投影缓存。每一帧的每个物体使用一个新的 CachedShader，只 draw 一次：
+ * 三角形按绘制的顺序编号，同一个物体每一帧的三角形顺序必须相同。mvp 是物体这一帧的投影、视图、模型矩阵之积。
+ * 原来的着色器可以复制时这个着色器也可以复制，副本共享缓存，分块绘制。
+ * 深度预渲染直接使用原来的着色器；逐像素的 fragment() 和 fragment_at()（多重采样）不经过缓存 */
+class CachedShader : public Shader {
+public:
+    CachedShader(Shader &inner, ReprojectionCache &cache, int object_id, const mat<4, 4> &mvp);
+
+    vec4 vertex(const Location &location, int ivert) override;
+
+    TGAColor fragment(const vec3 &barycent) override { return inner_.fragment(barycent); }
+
+    TGAColor fragment_at(int x, int y, const vec3 &barycent) override { return inner_.fragment_at(x, y, barycent); }
+
+    void fragment_quad(const FragmentQuad &quad, TGAColor colors[4]) override;
+
+    Shader *clone(FrameArena &arena) const override;
+
+    std::size_t varying_size() const override;
+
+    void save_varyings(void *dst) const override;
+
+    void load_varyings(const void *src) override;
+
+    void begin_faces(int first_face) override { face_ = first_face - 1; }
+
+private:
+    /* 副本：包装 inner（原来的着色器的副本），其余的状态和 other 相同 */
+    CachedShader(const CachedShader &other, Shader &inner);
+
+    struct Varyings;
+
+    /* save_varyings 中原来的着色器的 varyings 的偏移 */
+    static std::size_t inner_offset();
+
+    Shader &inner_;
+    ReprojectionCache &cache_;
+    int object_id_;
+    mat<4, 4> prev_mvp_;
+    bool has_prev_;
+
+    // 当前三角形的编号，顶点在这一帧和上一帧的屏幕坐标
+    int face_ = -1;
+    vec3 screen_[3];
+    vec3 prev_screen_[3];
+    bool prev_valid_ = false;
+    // 上一帧的屏幕上深度沿 x、y 方向变化一个像素的绝对值之和的一半，即取最近的像素时深度的最大误差
+    double prev_slope_ = 0;
+};
+
+
+#endif //RENDER_REPROJECTION_CACHE_H
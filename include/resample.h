@@ -0,0 +1,70 @@
+#ifndef RENDER_RESAMPLE_H
+#define RENDER_RESAMPLE_H
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "tgaimage.h"
+
+
+/* 图像缩放：可分离的滤波，水平和垂直各一遍，中间结果是 8 位的。每个输出像素的权重预先算成 14 位定点数；
+ * 垂直的一遍是对整行连续字节的整数乘加，编译器可以向量化，缩小时先做这一遍；两遍都按行块在全局调度器上并行。
+ * 缩小时滤波器按比例展宽，每个输出像素覆盖它在原图中对应的整个区域，不会像最近点采样那样走样 */
+class Resampler {
+public:
+    enum Filter {
+        BOX,       // 区域平均，放大时等于最近点
+        BILINEAR,  // 三角形滤波，半径 1
+        MITCHELL,  // Mitchell-Netravali（B = C = 1/3），半径 2
+        LANCZOS3   // 半径 3，最锐利，边缘可能有轻微的振铃
+    };
+
+    explicit Resampler(Filter filter = MITCHELL) : filter(filter) {}
+
+    /* 把 src 缩放到 w x h 写入 dst，格式和 src 相同；dst 不能是 src */
+    void resample(const TGAImage &src, TGAImage &dst, int w, int h);
+
+    /* 一次生成多个尺寸（例如不同大小的缩略图）：先用 2x2 平均把 src 逐级减半，建立到最小的输出需要的层级，
+     * 每个尺寸再从宽高都不小于它的最小一级用 filter 缩放，缩放比例不超过 2，和层级尺寸相同时直接复制。
+     * 每个输出读的像素数和它自己的大小成正比，代价是比直接缩放多一次盒式滤波，图像稍微柔和一些。
+     * outputs[i] 的尺寸是 sizes[i] */
+    void pyramid(const TGAImage &src, const std::vector<std::pair<int, int>> &sizes, std::vector<TGAImage> &outputs);
+
+    Filter filter;
+
+    // 是否在全局调度器上并行
+    bool parallel = true;
+
+private:
+    /* 一个方向的权重表：输出坐标 i 读输入的 [first[i], first[i] + count[i])，权重在 weights[i * stride] 开始 */
+    struct Weights {
+        int stride = 0;
+        std::vector<int> first;
+        std::vector<int> count;
+        std::vector<std::int16_t> weights;
+    };
+
+    void compute_weights(Filter filter, int in_size, int out_size, Weights &w) const;
+
+    void resample(Filter filter, const TGAImage &src, TGAImage &dst, int w, int h);
+
+    /* 用 horizontal_ 把 rows 行从 src_width 缩放到 dst_width */
+    void horizontal_pass(const std::uint8_t *src, int src_width, int rows, std::uint8_t *dst, int dst_width,
+                         int bytespp);
+
+    /* 用 vertical_ 生成 rows 行，每行 row_bytes 个字节 */
+    void vertical_pass(const std::uint8_t *src, int row_bytes, int rows, std::uint8_t *dst);
+
+    /* 宽高各减半的 2x2 平均，src 的宽高都是偶数 */
+    void halve(const TGAImage &src, TGAImage &dst);
+
+    // 第一遍的结果，跨调用复用
+    std::vector<std::uint8_t> temp_;
+    Weights horizontal_;
+    Weights vertical_;
+    // pyramid 的中间层级
+    std::vector<TGAImage> levels_;
+};
+
+
+#endif //RENDER_RESAMPLE_H
@@ -0,0 +1,31 @@
+#ifndef RENDER_SCENE_H
+#define RENDER_SCENE_H
+
+#include "geometry.h"
+#include "model.h"
+#include "shader.h"
+
+
+/* 示例程序共用的场景布置：主光源在 (0, 0.3, 1)，相机在原点看向 -z，
+ * 模型平移到 z = -200 并放大 80 倍，投影的视野高 100、宽按宽高比放大，近远平面为 100 和 400 */
+
+const char *const DIABLO_FILENAME = "../obj/diablo3_pose/diablo3_pose.obj";
+
+vec3 scene_light_pos();
+
+mat<4, 4> scene_model_matrix();
+
+mat<4, 4> scene_view_matrix();
+
+mat<4, 4> scene_projection(int width = 1, int height = 1);
+
+/* 设置模型矩阵和对应的法线矩阵 */
+void set_model_matrix(PhongShader &shader, const mat<4, 4> &model_matrix);
+
+void set_textures(PhongShader &shader, const Model &model);
+
+/* 按上面的场景设置光源、相机和矩阵，贴图另外用 set_textures 设置；width、height 决定投影的宽高比 */
+PhongShader make_phong_shader(const mat<4, 4> &model_matrix = scene_model_matrix(), int width = 1, int height = 1);
+
+
+#endif //RENDER_SCENE_H
@@ -0,0 +1,52 @@
+#ifndef RENDER_SCENE_GENERATOR_H
+#define RENDER_SCENE_GENERATOR_H
+
+#include <random>
+#include <string>
+#include <vector>
+#include "model.h"
+
+
+/* 程序生成的压力测试场景：每种场景由一个规模参数控制，可以远远超过自带模型的几千个三角形，
+ * 用来找出光栅化、分块和着色在负载增加时性能突然下降的位置。
+ * 坐标和自带的模型一样以原点为中心、大致在 [-1, 1] 中，+z 朝向相机，可以直接用 main 中的相机绘制；
+ * 在 1024x1024 的画面中，z = 0 处 1 个单位约为 400 像素。同一个种子生成的场景完全相同 */
+class SceneGenerator {
+public:
+    explicit SceneGenerator(unsigned seed = 1) : rng_(seed) {}
+
+    /* 经纬度划分的单位球，大约 triangles 个三角形 */
+    Model sphere(int triangles);
+
+    /* instances 个小球排成正方形网格，每个 528 个三角形，相当于大量实例化的小物体 */
+    Model grid(int instances);
+
+    /* layers 个比视口大的平面从后向前叠放，每个像素被绘制 layers 次，深度测试总是通过 */
+    Model planes(int layers);
+
+    /* 随机方向的细长三角形，长 1 到 2.8，宽 0.002：包围盒很大而覆盖的像素很少 */
+    Model slivers(int triangles);
+
+    /* 随机分布在立方体中的亚像素三角形，边长约 0.002，大部分不覆盖任何采样点 */
+    Model cloud(int triangles);
+
+    /* 从后向前的大三角形，顶点远在视口之外，每个都覆盖整个视口 */
+    Model fullscreen(int triangles);
+
+    /* 按名字生成，size 是对应函数的参数；名字不在 names() 中时返回 false */
+    bool generate(const std::string &name, int size, Model &model);
+
+    static const std::vector<std::string> &names();
+
+    /* 棋盘格的漫反射贴图、平坦的法线贴图和常数高光贴图，生成的场景也走完整的着色路径 */
+    static void set_default_textures(Model &model);
+
+    /* 写入 OBJ 和 Model 加载时读取的 _diffuse、_nm_tangent、_spec 贴图 */
+    static bool write(const Model &model, const std::string &filename);
+
+private:
+    std::mt19937 rng_;
+};
+
+
+#endif //RENDER_SCENE_GENERATOR_H
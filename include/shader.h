@@ -5,24 +5,76 @@
 #include "geometry.h"
 #include "tgaimage.h"
 #include "model.h"
+#include "frame_arena.h"
+#include "hash.h"
+#include "shadow.h"
+#include "bvh.h"
+#include "mipmap.h"
+#include "light_grid.h"
 #include <cmath>
 #include <utility>
 #include <random>
+#include <typeinfo>
 
 
 struct Location {
     const vec3 local_pos;
     const vec3 local_normal;
     const vec2 uv;
+    // 切线，w 是副切线的方向，见 Model::tangent
+    const vec4 local_tangent;
 
-    explicit Location(const vec3 &local_pos, const vec3 &local_normal, const vec2 &uv)
-            : local_pos(local_pos), local_normal(local_normal), uv(uv) {}
+    explicit Location(const vec3 &local_pos, const vec3 &local_normal, const vec2 &uv,
+                      const vec4 &local_tangent = vec4())
+            : local_pos(local_pos), local_normal(local_normal), uv(uv), local_tangent(local_tangent) {}
+};
+
+/* 2x2 像素组成的 quad，lane 的顺序为 (x, y) (x+1, y) (x, y+1) (x+1, y+1)。
+ * mask 之外的 lane 是辅助像素：重心坐标可能在三角形外面，只用于计算导数，结果不会写入。
+ * 粗粒度着色时每个 lane 是一个像素块，(x, y) 是第一个块的左上角，导数也相应地变大 */
+struct FragmentQuad {
+    int x, y;
+    int mask;
+    vec3 bary[4];
+
+    /* 由 quad 中相邻像素的差得到屏幕空间的导数 */
+    template<typename T>
+    static T ddx(const T v[4]) { return v[1] - v[0]; }
+
+    template<typename T>
+    static T ddy(const T v[4]) { return v[2] - v[0]; }
 };
 
 struct Shader {
     virtual vec4 vertex(const Location &location, int ivert) = 0;
 
     virtual TGAColor fragment(const vec3 &barycent) = 0;
+
+    /* 已知所在的像素 (x, y) 时着色一个片段（多重采样时），默认和 fragment 相同 */
+    virtual TGAColor fragment_at(int x, int y, const vec3 &barycent) { return fragment(barycent); }
+
+    /* 一次着色一个 quad，默认逐个调用 fragment；mask 之外的 lane 不需要写 colors */
+    virtual void fragment_quad(const FragmentQuad &quad, TGAColor colors[4]) {
+        for (int i = 0; i < 4; ++i)
+            if (quad.mask >> i & 1) colors[i] = fragment(quad.bary[i]);
+    }
+
+    /* 在 arena 中复制一份，分块绘制时每个任务用自己的副本调用 vertex，顶点着色器写入的成员互不影响。
+     * 返回空时（默认）RenderContext::draw 逐个三角形绘制，只在三角形内部并行 */
+    virtual Shader *clone(FrameArena &arena) const { return nullptr; }
+
+    /* 顶点着色器写入、片段着色器读取的成员（varyings）。分块绘制时每个三角形只做一次顶点着色，
+     * save_varyings 把三个顶点之后的成员存进 varying_size() 字节的内存，光栅化之前用 load_varyings 恢复。
+     * 可以复制的着色器都要实现；没有这样的成员时返回 0 */
+    virtual std::size_t varying_size() const { return 0; }
+
+    virtual void save_varyings(void *dst) const {}
+
+    virtual void load_varyings(const void *src) {}
+
+    /* 分块绘制时，每批三角形开始之前在这一批使用的副本上调用，first_face 是这一批的第一个三角形在本次 draw 中的下标。
+     * 按绘制的顺序给三角形编号的着色器由它得到编号 */
+    virtual void begin_faces(int first_face) {}
 };
 
 inline TGAColor get_diffuse(const TGAImage &image, const vec2 &uv) {
@@ -46,18 +98,37 @@ struct PhongShader : public Shader {
     vec3 light_pos;
     vec3 camera_pos;
     mat<4, 4> model_matrix;
-    mat<4, 4> model_iv_matrix;
+    mat<4, 4> normal_matrix;  // 模型矩阵的逆的转置
     mat<4, 4> view_matrix;
     mat<4, 4> projection_matrix;
-    TGAImage diffuse_texture;
-    TGAImage normal_texture;
-    TGAImage specular_texture;
+    const TGAImage *diffuse_texture = nullptr;
+    const TGAImage *normal_texture = nullptr;
+    const TGAImage *specular_texture = nullptr;
+
+    // 漫反射贴图的 mipmap，按 quad 求得的 uv 导数选择层级；为空时总是采样原图
+    const Mipmap *diffuse_mipmap = nullptr;
+
+    // 阴影，shadow_map 为空时不计算阴影
+    const ShadowMap *shadow_map = nullptr;
+    int shadow_pcf_radius = 0;
+    double shadow_bias = 0.005;
+
+    // 光线追踪的阴影和环境光遮蔽，bvh 为空时不计算；设置了 bvh 时不再使用 shadow_map
+    const BVH *bvh = nullptr;
+    int ao_samples = 0;
+    double ao_radius = 20;
+    double ray_bias = 0.05;
+
+    // 点光源，为空时只有主光源；片段只遍历所在块的光源，需要在绘制之前 build
+    const LightGrid *light_grid = nullptr;
 
     // 传递给片段着色器的
     mat<3, 3> world_ps;
     mat<3, 3> world_ns;
     mat<2, 3> uvs;
-    mat<3, 3> TBN;
+    mat<3, 3> world_ts;
+    // 每个顶点的副切线方向 (±1)，镜像 uv 的接缝处三个顶点可能不同
+    vec3 tangent_signs{1, 1, 1};
 
     vec4 vertex(const Location &location, const int ivert) override {
         // 世界系中的坐标
@@ -68,24 +139,14 @@ struct PhongShader : public Shader {
 
         world_ps.set_col(ivert, proj<3>(world_p));
 
-        // 世界系中的法线坐标
-        vec4 world_n = model_iv_matrix * embed<4>(location.local_normal);
+        // 世界系中的法线坐标，方向向量不受平移的影响
+        vec4 world_n = normal_matrix * embed<4>(location.local_normal, 0.);
         world_ns.set_col(ivert, proj<3>(world_n).normalize());
 
-        // TBN矩阵
-        if (ivert == 2) {
-            vec3 e1 = world_ps.col(1) - world_ps.col(0);
-            vec3 e2 = world_ps.col(2) - world_ps.col(0);
-            double delta_u1 = uvs.col(1)[0] - uvs.col(0)[0];
-            double delta_u2 = uvs.col(2)[0] - uvs.col(0)[0];
-            double delta_v1 = uvs.col(1)[1] - uvs.col(0)[1];
-            double delta_v2 = uvs.col(2)[1] - uvs.col(0)[1];
-            double base = delta_u1 * delta_v2 - delta_u2 * delta_v1;
-            vec3 T = (delta_v2 * e1 - delta_v1 * e2) / base;
-            vec3 B = (delta_u1 * e2 - delta_u2 * e1) / base;
-            TBN.set_col(0, T.normalize());
-            TBN.set_col(1, B.normalize());
-        }
+        // 切线在模型载入时已经算好，只需要变换到世界系；在片段着色器中和法线正交化
+        vec4 world_t = model_matrix * embed<4>(proj<3>(location.local_tangent), 0.);
+        world_ts.set_col(ivert, proj<3>(world_t));
+        tangent_signs[ivert] = location.local_tangent[3];
 
         // 裁剪空间的坐标
         vec4 pos = projection_matrix * view_matrix * world_p;
@@ -93,17 +154,62 @@ struct PhongShader : public Shader {
     }
 
     TGAColor fragment(const vec3 &barycent) override {
+        return shade(barycent, -1, -1);
+    }
+
+    /* 派生类没有覆盖时返回空，不把它复制成 PhongShader */
+    Shader *clone(FrameArena &arena) const override {
+        if (typeid(*this) != typeid(PhongShader)) return nullptr;
+        return arena.make<PhongShader>(*this);
+    }
+
+    struct Varyings {
+        mat<3, 3> world_ps;
+        mat<3, 3> world_ns;
+        mat<2, 3> uvs;
+        mat<3, 3> world_ts;
+        vec3 tangent_signs;
+    };
+
+    std::size_t varying_size() const override { return sizeof(Varyings); }
+
+    void save_varyings(void *dst) const override {
+        new(dst) Varyings{world_ps, world_ns, uvs, world_ts, tangent_signs};
+    }
+
+    void load_varyings(const void *src) override {
+        const Varyings &v = *static_cast<const Varyings *>(src);
+        world_ps = v.world_ps;
+        world_ns = v.world_ns;
+        uvs = v.uvs;
+        world_ts = v.world_ts;
+        tangent_signs = v.tangent_signs;
+    }
+
+    /* 点光源只遍历像素所在块的光源，和 fragment_quad 相同 */
+    TGAColor fragment_at(int x, int y, const vec3 &barycent) override {
+        return shade(barycent, x, y);
+    }
+
+    /* 像素 (x, y) 处的颜色，x < 0 表示不知道所在的像素 */
+    TGAColor shade(const vec3 &barycent, int x, int y) const {
         // 插值 uv
         vec2 uv = uvs * barycent;
 
         // 计算法向量
-        vec3 n_inter = world_ns * barycent;
-        TBN.set_col(2, n_inter.normalize());
-        vec3 n_tangent = get_normal(normal_texture, uv);
-        vec3 n = (TBN * n_tangent).normalize();
+        // 片段着色器可能被并行调用，不能修改成员变量
+        vec3 n_inter = (world_ns * barycent).normalize();
+        vec3 t_inter = world_ts * barycent;
+        t_inter = (t_inter - n_inter * (n_inter * t_inter)).normalize();
+        mat<3, 3> tbn;
+        tbn.set_col(0, t_inter);
+        tbn.set_col(1, cross(n_inter, t_inter) * (tangent_signs * barycent < 0 ? -1. : 1.));
+        tbn.set_col(2, n_inter);
+        vec3 n_tangent = get_normal(*normal_texture, uv);
+        vec3 n = (tbn * n_tangent).normalize();
 
         // 获得颜色
-        TGAColor color = get_diffuse(diffuse_texture, uv);
+        TGAColor color = get_diffuse(*diffuse_texture, uv);
 
         // 光照方向
         vec3 pos = world_ps * barycent;
@@ -113,20 +219,91 @@ struct PhongShader : public Shader {
         double diffuse = std::max(0., -1 * n * light_dir);
 
         // 高光强度
-        double spec_intens = get_specular(specular_texture, uv);
+        double spec_intens = get_specular(*specular_texture, uv);
         vec3 r_light_dir = light_dir - 2 * n * (n * light_dir);
         vec3 pos2camera = (camera_pos - pos).normalize();
         double specular = pow(std::max(0., pos2camera * r_light_dir), spec_intens);
 
+        // 阴影中只保留一部分漫反射和高光
+        double shadow_coeff, occlusion;
+        shadowing(pos, shadow_coeff, occlusion);
+
+        // 点光源：不知道所在的像素时遍历所有光源，范围之外的光源贡献为 0，结果和分块的相同
+        double point[3] = {0, 0, 0};
+        if (light_grid && x >= 0) {
+            int n_lights;
+            const int *lights = light_grid->tile_lights(x, y, n_lights);
+            for (int k = 0; k < n_lights; ++k)
+                add_point_light(light_grid->lights()[lights[k]], pos, n, pos2camera, spec_intens, point);
+        } else if (light_grid) {
+            for (const PointLight &light : light_grid->lights())
+                add_point_light(light, pos, n, pos2camera, spec_intens, point);
+        }
+
         // phong 光照的参数
         double ambient = 5.;
         double diffuse_coeff = 1.0;
         double spec_coeff = 0.2;
         for (int i = 0; i < 3; ++i)
-            color[i] = std::min(255., ambient + color[i] * (diffuse_coeff * diffuse + spec_coeff * specular));
+            color[i] = std::min(255., occlusion * (ambient + color[i] * shadow_coeff
+                                                               * (diffuse_coeff * diffuse + spec_coeff * specular)
+                                                   + color[i] * point[i]));
 
         return color;
     }
+
+    /* 一个点光源的漫反射和高光，按 BGR 的顺序累加到 sum；pos2camera 是归一化的 */
+    static void add_point_light(const PointLight &light, const vec3 &pos, const vec3 &n, const vec3 &pos2camera,
+                                double spec_intens, double sum[3]) {
+        vec3 d = pos - light.pos;
+        double dist2 = d * d;
+        if (dist2 >= light.radius * light.radius || dist2 == 0) return;
+        double dist = std::sqrt(dist2);
+        vec3 light_dir = d / dist;
+        double diffuse = std::max(0., -1 * n * light_dir);
+        vec3 r_light_dir = light_dir - 2 * n * (n * light_dir);
+        double specular = pow(std::max(0., pos2camera * r_light_dir), spec_intens);
+        double k = light.attenuation(dist) * (1.0 * diffuse + 0.2 * specular);
+        for (int i = 0; i < 3; ++i)
+            sum[i] += light.color[2 - i] * k;
+    }
+
+    /* 4 个 lane 按分量分开存放，逐 lane 的循环交给编译器向量化，见 shader.cpp */
+    void fragment_quad(const FragmentQuad &quad, TGAColor colors[4]) override;
+
+    /* 计算阴影系数和环境光遮蔽 */
+    void shadowing(const vec3 &pos, double &shadow_coeff, double &occlusion) const {
+        shadow_coeff = 1.;
+        occlusion = 1.;
+        if (bvh) {
+            vec3 to_light = light_pos - pos;
+            shadow_coeff = bvh->occluded(pos, to_light, ray_bias / to_light.norm(), 1.) ? 0.3 : 1.;
+            // 环境光遮蔽使用朝向相机的几何法线
+            vec3 face_n = cross(world_ps.col(1) - world_ps.col(0), world_ps.col(2) - world_ps.col(0)).normalize();
+            if (face_n * (camera_pos - pos) < 0) face_n = -1 * face_n;
+            occlusion = bvh->ambient_occlusion(pos, face_n, ao_samples, ao_radius, ray_bias);
+        } else if (shadow_map) {
+            shadow_coeff = 0.3 + 0.7 * shadow_map->lit(pos, shadow_pcf_radius, shadow_bias);
+        }
+    }
+
+    /* 把所有影响渲染结果的参数加入哈希，修改光照模型时需要修改版本号。
+     * 阴影贴图和 BVH 按内容哈希，投射阴影的几何不是被绘制的模型时也能区分 */
+    void hash(Hasher &h) const {
+        h << std::string("PhongShader/5");
+        h << light_pos << camera_pos;
+        h << model_matrix << normal_matrix << view_matrix << projection_matrix;
+        for (const TGAImage *texture : {diffuse_texture, normal_texture, specular_texture})
+            h << (texture ? texture->content_hash() : 0);
+        if (diffuse_mipmap)
+            h << std::string("mipmap");
+        if (light_grid)
+            light_grid->hash(h);
+        if (bvh)
+            h << std::string("bvh") << bvh->content_hash() << ao_samples << ao_radius << ray_bias;
+        else if (shadow_map)
+            h << std::string("shadow_map") << shadow_map->content_hash() << shadow_pcf_radius << shadow_bias;
+    }
 };
 
 
@@ -151,166 +328,5 @@ struct RandomShader: public Shader {
     }
 };
 
-//
-///* 着色器的格式定义 */
-//struct IShader {
-//
-//    /* 顶点着色器，返回false表示要剔除 */
-//    virtual bool vertex(int iface, int ivert, vec3 &vert) = 0;
-//
-//    /* 片段着色器，返回false表示要剔除 */
-//    virtual bool fragment(const vec3 &barycentric, TGAColor &color) = 0;
-//
-//    /* 计算屏幕坐标 */
-//    static bool calcu_screen_coord(vec3 &screen_coor_out, const vec4 &world_vert,
-//                                   const mat<4, 4> &view_m, const mat<4, 4> &proj_m, const mat<4, 4> &view_port_t) {
-//        vec4 after_proj = proj_m * view_m * world_vert;
-//        if (after_proj[3] == 0) return false;
-//        after_proj = after_proj / after_proj[3];
-//        after_proj[3] = 1;
-//        screen_coor_out = proj<3>(view_port_t * after_proj);
-//        return true;
-//    }
-//};
-//
-//struct MyShader : public IShader {
-//    const Model &model;             // 模型
-//    vec3 light_dir;                 // 光照方向
-//    vec3 camera;                    // 相机的坐标
-//    mat<4, 4> model_matrix;         // 模型矩阵
-//    mat<4, 4> shadow_view_matrix;   // 渲染阴影时使用的 view 矩阵
-//    const std::vector<std::vector<uint32_t>> shadow_buffer;
-//    mat<4, 4> model_iv_matrix;      // 模型矩阵的逆转置矩阵
-//
-//    MyShader(const Model &model, vec3 &light_dir, const vec3 &camera, const mat<4, 4> &model_matrix,
-//             const mat<4, 4> &shadow_view_matrix, std::vector<std::vector<uint32_t>> shadow_buffer)
-//            : model(model), light_dir(light_dir.normalize()), camera(camera), model_matrix(model_matrix),
-//              shadow_view_matrix(shadow_view_matrix), shadow_buffer(std::move(shadow_buffer)) {
-//        this->model_iv_matrix = this->model_matrix.invert_transpose();
-//    }
-//
-//    mat<3, 3> ns;                   // 三个顶点在世界坐标系中的法线
-//    mat<2, 3> uvs;                  // 三个顶点的 UV
-//    mat<3, 3> vs;                   // 三个顶点在世界坐标系中的坐标值
-//
-//    bool vertex(int iface, int ivert, vec3 &vert) override {
-//        vec4 vert_local = embed<4>(this->model.vert(iface, ivert));
-//        vec4 vert_world = model_matrix * vert_local;
-//
-//        // 计算屏幕坐标系的值
-//        if (!calcu_screen_coord(vert, vert_world, view_matrix, projection_matrix, view_port_matrix))
-//            return false;
-//
-//        // 为 fragment 着色器提供值
-//        vec4 normal = this->model_iv_matrix * embed<4>(this->model.normal(iface, ivert));
-//        this->ns.set_col(ivert, proj<3>(normal));
-//        this->uvs.set_col(ivert, this->model.uv(iface, ivert));
-//        this->vs.set_col(ivert, proj<3>(vert_world));
-//
-//        return true;
-//    }
-//
-//    /* 计算TBN矩阵中的TB分量 */
-//    mat<3, 3> calcuTB() const {
-//        vec2 uv_A = this->uvs.col(0);
-//        vec2 uv_B = this->uvs.col(1);
-//        vec2 uv_C = this->uvs.col(2);
-//        mat<2, 2> delta_uv;
-//        delta_uv.set_col(0, vec2(uv_B[0] - uv_A[0], uv_C[0] - uv_A[0]));
-//        delta_uv.set_col(1, vec2(uv_B[1] - uv_A[1], uv_C[1] - uv_A[1]));
-//        mat<2, 2> delta_uv_inv = delta_uv.invert();
-//        vec3 AB = this->vs.col(1) - this->vs.col(0);
-//        vec3 AC = this->vs.col(2) - this->vs.col(0);
-//        vec3 T = (delta_uv_inv[0][0] * AB + delta_uv_inv[0][1] * AC).normalize();
-//        vec3 B = (delta_uv_inv[1][0] * AB + delta_uv_inv[1][1] * AC).normalize();
-//        mat<3, 3> TBN;
-//        TBN.set_col(0, T);
-//        TBN.set_col(1, B);
-//
-//        return TBN;
-//    }
-//
-//    bool fragment(const vec3 &barycentric, TGAColor &color) override {
-//        // 插值得到 uv
-//        vec2 uv = this->uvs * barycentric;
-//        vec3 v = this->vs * barycentric;
-//
-//        // 读取当前点的颜色值
-//        color = this->model.diffuse(uv);
-//
-//        // 计算当前点是否在阴影中
-//        vec3 v_shadow_screen;
-//        if (!calcu_screen_coord(v_shadow_screen, embed<4>(v), shadow_view_matrix, projection_matrix, view_port_matrix))
-//            return false;
-//        bool in_shadow = shadow_buffer[v_shadow_screen[1]][v_shadow_screen[0]] < v_shadow_screen[2] - 0.5;
-//        double shadow_coeff = 0.3 + 0.7 * !in_shadow;
-//
-//        // 通过法线贴图计算法线
-//        mat<3, 3> TBN = calcuTB();
-//        vec3 n_interpolation = (this->ns * barycentric).normalize();
-//        TBN.set_col(2, n_interpolation);
-//        vec3 n_tangent = this->model.normal(uv);
-//        vec3 n = (TBN * n_tangent).normalize();
-//
-//        // 通过法线得到的漫反射强度
-//        double diff_intensity = std::max(0., n * this->light_dir);
-//
-//        // 得到高光强度
-//        double specular = this->model.specular(uv);
-//        vec3 r = 2 * n * (n * this->light_dir) - this->light_dir;
-//        vec3 v2camera = (this->camera - v).normalize();
-//        double spec_intensity;
-//        if (specular < 1)
-//            spec_intensity = 0;
-//        else
-//            spec_intensity = pow(std::max(0., v2camera * r), specular);
-//
-//        // phony ：环境光 + 漫反射强度 + 高光强度
-//        double ambient = 1;
-//        double diffuse_coeff = 0.9;
-//        double spec_coeff = 0.6;
-//
-//        for (int i = 0; i < 3; ++i) {
-//            color[i] = std::min(255., ambient + color[i] * shadow_coeff
-//                                                * (diffuse_coeff * diff_intensity + spec_coeff * spec_intensity));
-//        }
-//
-//        return true;
-//    }
-//};
-//
-//
-///* 用于渲染阴影贴图的 */
-//struct ShadowShader : public IShader {
-//
-//    const Model &model;
-//    mat<4, 4> model_matrix;         // 模型矩阵
-//
-//    explicit ShadowShader(const Model &model, const mat<4, 4> &model_matrix)
-//            : model(model), model_matrix(model_matrix) {}
-//
-//    mat<3, 3> vs;                   // 三个顶点在世界坐标系中的坐标值
-//
-//    bool vertex(int iface, int ivert, vec3 &vert) override {
-//        vec4 vert_local = embed<4>(this->model.vert(iface, ivert));
-//        vec4 vert_world = model_matrix * vert_local;
-//
-//        // 透视除法
-//        if (!calcu_screen_coord(vert, vert_world, view_matrix, projection_matrix, view_port_matrix))
-//            return false;
-//
-//        // 为片段着色器提供值
-//        this->vs.set_col(ivert, proj<3>(vert_world));
-//
-//        return true;
-//    }
-//
-//    bool fragment(const vec3 &barycentric, TGAColor &color) override {
-//        vec3 vert = this->vs * barycentric;
-//        color = TGAColor(vert[2], vert[2], vert[2], 255);
-//        return true;
-//    }
-//};
-
 
 #endif //RENDER_SHADER_H
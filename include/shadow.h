@@ -0,0 +1,42 @@
+
+#ifndef RENDER_SHADOW_H
+#define RENDER_SHADOW_H
+
+#include <cstdint>
+#include <vector>
+#include "geometry.h"
+#include "model.h"
+#include "frame_arena.h"
+
+
+/* 阴影贴图：从光源视角渲染得到的深度，深度范围 [0, 1]，越小越靠近光源 */
+struct ShadowMap {
+    ShadowMap(int width, int height);
+
+    /* 设置光源的 view、projection 矩阵，计算世界坐标到阴影贴图屏幕坐标的变换 */
+    void set_light(const mat<4, 4> &view_matrix, const mat<4, 4> &projection_matrix);
+
+    void clear();
+
+    float get(int x, int y) const { return depth[y * width + x]; }
+
+    /* 世界坐标中的点被照亮的比例：pcf_radius 为 0 时是硬阴影，否则在 (2r+1)^2 的邻域内做 PCF 滤波 */
+    double lit(const vec3 &world_pos, int pcf_radius, double bias) const;
+
+    /* 尺寸、光源矩阵和深度的哈希，深度包含了所有投射阴影的几何 */
+    std::uint64_t content_hash() const;
+
+    int width;
+    int height;
+    mat<4, 4> light_matrix;
+    std::vector<float> depth;
+};
+
+
+/* 只写深度的光栅化，用于渲染阴影贴图：
+ * 每个顶点只变换一次，不调用着色器，不插值 varyings，也不写颜色；给定 arena 时变换后的顶点放在其中 */
+void render_depth(ShadowMap &shadow_map, const Model &model, const mat<4, 4> &model_matrix,
+                  FrameArena *arena = nullptr);
+
+
+#endif //RENDER_SHADOW_H
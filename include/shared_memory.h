@@ -0,0 +1,51 @@
+
+#ifndef RENDER_SHARED_MEMORY_H
+#define RENDER_SHARED_MEMORY_H
+
+#include <cstddef>
+#include <string>
+
+
+/* POSIX 共享内存段（shm_open + mmap），同一台机器上的进程按名字打开同一段内存。
+ * 名字以 / 开头，例如 "/render_fb"；创建者负责 unlink，已经映射的进程不受 unlink 影响 */
+class SharedMemory {
+public:
+    SharedMemory() = default;
+
+    ~SharedMemory() { close(); }
+
+    SharedMemory(const SharedMemory &) = delete;
+
+    SharedMemory &operator=(const SharedMemory &) = delete;
+
+    /* 创建大小为 size 的段，内容全部为 0；同名的段已经存在时先删除 */
+    bool create(const std::string &name, std::size_t size);
+
+    /* 打开已有的段，大小由段本身决定；writable 为 false 时只读映射 */
+    bool open(const std::string &name, bool writable = true);
+
+    /* 这个名字的段是否存在，不输出错误 */
+    static bool exists(const std::string &name);
+
+    /* 解除映射 */
+    void close();
+
+    /* 删除名字 */
+    void unlink();
+
+    void *data() const { return data_; }
+
+    std::size_t size() const { return size_; }
+
+    const std::string &name() const { return name_; }
+
+    bool is_open() const { return data_ != nullptr; }
+
+private:
+    std::string name_;
+    void *data_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+
+#endif //RENDER_SHARED_MEMORY_H
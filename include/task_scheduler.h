@@ -0,0 +1,193 @@
+#ifndef RENDER_TASK_SCHEDULER_H
+#define RENDER_TASK_SCHEDULER_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+/* 工作窃取的任务调度器：每个线程有自己的双端队列，新任务放在队尾，自己从队尾取（后进先出，
+ * 刚提交的任务数据还在缓存中），空闲的线程从其他队列的队头窃取（最早提交的、通常是最大的任务）。
+ * 任务可以依赖其他任务，依赖全部完成之后才进入队列，多个阶段因此可以按依赖关系重叠执行。
+ * 线程数包括调用 wait 的线程：等待时它也执行队列中的任务，所以嵌套的 parallel_for 不会死锁；
+ * 线程数为 1 时没有后台线程，所有任务都在 wait 中顺序执行。
+ * 任务对象复用，稳定状态下提交任务不分配内存（std::function 能放下的小闭包） */
+class TaskScheduler {
+public:
+    struct Task;
+
+    /* 已提交任务的引用，可以作为其他任务的依赖，也可以等待它完成 */
+    class TaskHandle {
+    public:
+        TaskHandle() = default;
+
+        TaskHandle(const TaskHandle &other);
+
+        TaskHandle &operator=(const TaskHandle &other);
+
+        ~TaskHandle();
+
+        bool valid() const { return task_ != nullptr; }
+
+        bool done() const;
+
+    private:
+        friend class TaskScheduler;
+
+        explicit TaskHandle(Task *task);
+
+        Task *task_ = nullptr;
+    };
+
+    /* 每个线程的统计，下标 0 是调用 wait 的外部线程（可能有多个，合在一起统计） */
+    struct WorkerStats {
+        std::uint64_t tasks = 0;   // 执行的任务数
+        std::uint64_t steals = 0;  // 其中从其他线程的队列窃取的个数
+        double busy_ms = 0;        // 执行任务的时间
+    };
+
+    /* n_threads <= 0 时使用硬件线程数 */
+    explicit TaskScheduler(int n_threads = 0);
+
+    ~TaskScheduler();
+
+    TaskScheduler(const TaskScheduler &) = delete;
+
+    TaskScheduler &operator=(const TaskScheduler &) = delete;
+
+    /* 提交任务，deps 中的任务全部完成之后才会执行；无效的 handle 被忽略 */
+    TaskHandle submit(std::function<void()> fn, std::initializer_list<TaskHandle> deps = {}) {
+        return submit(std::move(fn), deps.begin(), deps.size());
+    }
+
+    TaskHandle submit(std::function<void()> fn, const std::vector<TaskHandle> &deps) {
+        return submit(std::move(fn), deps.data(), deps.size());
+    }
+
+    TaskHandle submit(std::function<void()> fn, const TaskHandle *deps, std::size_t n_deps);
+
+    /* 等待任务完成，等待期间执行队列中的其他任务 */
+    void wait(const TaskHandle &task);
+
+    /* 并行执行 body(i)，i ∈ [begin, end)，每个任务至少 grain 个；调用的线程也参与，返回时全部完成 */
+    template<typename F>
+    void parallel_for(int begin, int end, const F &body, int grain = 1) {
+        int n = end - begin;
+        if (n <= 0) return;
+        grain = std::max(1, grain);
+        if (n_threads_ == 1 || n <= grain) {
+            for (int i = begin; i < end; ++i) body(i);
+            return;
+        }
+
+        // 每个线程平均分到几个任务，给窃取留出余地
+        int n_chunks = std::min((n + grain - 1) / grain, n_threads_ * 4);
+        int step = (n + n_chunks - 1) / n_chunks;
+        n_chunks = (n + step - 1) / step;
+        // 闭包只带一个指针和一个整数，放得进 std::function 的内部缓冲，不分配内存
+        struct Loop {
+            const F *body;
+            int begin, end, step;
+            std::atomic<int> remaining;
+        } loop{&body, begin, end, step, {n_chunks - 1}};
+        Loop *l = &loop;
+        for (int c = 1; c < n_chunks; ++c) {
+            spawn([l, c]() {
+                int lo = l->begin + c * l->step, hi = std::min(l->end, lo + l->step);
+                for (int i = lo; i < hi; ++i) (*l->body)(i);
+                l->remaining.fetch_sub(1);
+            });
+        }
+        for (int i = begin; i < begin + step; ++i) body(i);
+        help_until([l]() { return l->remaining.load() == 0; });
+    }
+
+    /* 线程数，包括调用 wait 的线程 */
+    int size() const { return n_threads_; }
+
+    /* 当前线程在本调度器中的下标：后台线程是 [1, size())，其他线程都是 0 */
+    int thread_index() const;
+
+    std::vector<WorkerStats> stats() const;
+
+    void reset_stats();
+
+    /* 渲染管线使用的调度器，第一次调用时创建 */
+    static TaskScheduler &global();
+
+    /* 设置全局调度器的线程数，只在第一次调用 global() 之前有效 */
+    static void set_global_threads(int n_threads);
+
+private:
+    struct Queue;
+
+    /* 提交没有依赖、也不需要 handle 的任务 */
+    void spawn(std::function<void()> fn);
+
+    Task *acquire_task();
+
+    static void release(Task *task);
+
+    void schedule(Task *task);
+
+    void finish(Task *task);
+
+    /* 从自己的队尾或者其他队列的队头取一个任务 */
+    Task *find_task(int index, bool &stolen);
+
+    void run(Task *task, int index, bool stolen);
+
+    /* 执行任务直到 done() 返回 true，没有任务时睡眠 */
+    void help_until(const std::function<bool()> &done);
+
+    void worker_loop(int index);
+
+    void wake(bool all);
+
+    int n_threads_;
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+
+    // 队列中的任务数和睡眠的线程数，用于决定是否需要唤醒
+    std::atomic<int> pending_;
+    std::atomic<int> sleeping_;
+    std::mutex sleep_mutex_;
+    std::condition_variable sleep_cond_;
+    bool stop_ = false;
+
+    // 空闲的任务对象
+    std::mutex free_mutex_;
+    std::vector<Task *> free_;
+    std::vector<std::unique_ptr<Task>> all_;
+
+    // 每个线程一组计数器，补齐到缓存行，不同线程的计数器不共享缓存行
+    struct Counters {
+        std::atomic<std::uint64_t> tasks;
+        std::atomic<std::uint64_t> steals;
+        std::atomic<std::uint64_t> busy_ns;
+        char padding[64 - 3 * sizeof(std::atomic<std::uint64_t>)];
+    };
+    std::unique_ptr<Counters[]> counters_;
+};
+
+
+/* 在全局调度器上并行执行 body(i)；parallel 为 false 时在当前线程中顺序执行 */
+template<typename F>
+void parallel_for(int begin, int end, const F &body, bool parallel = true) {
+    if (parallel) {
+        TaskScheduler::global().parallel_for(begin, end, body);
+    } else {
+        for (int i = begin; i < end; ++i) body(i);
+    }
+}
+
+
+#endif //RENDER_TASK_SCHEDULER_H
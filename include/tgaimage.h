@@ -68,8 +68,10 @@ public:
     void set(const int x, const int y, const TGAColor &c);
     int get_width() const;
     int get_height() const;
-    int get_bytespp();
+    int get_bytespp() const;
     std::uint8_t *buffer();
+    const std::uint8_t *buffer() const;
+    std::uint64_t content_hash() const;
     void clear();
 };
 
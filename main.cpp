@@ -1,15 +1,44 @@
 
+#include <atomic>
+#include <mutex>
 #include <random>
 #include <iostream>
+#include <memory>
+#include <chrono>
+#include <cstring>
+#include <cmath>
+#include <vector>
 #include "model.h"
 #include "my_gl.h"
 #include "shader.h"
 #include "transform.h"
+#include "shadow.h"
+#include "bvh.h"
+#include "mipmap.h"
+#include "alloc_counter.h"
+#include "light_grid.h"
+#include "post_process.h"
+#include "reprojection_cache.h"
+#include "dirty_region.h"
+#include "scene.h"
+#include "live_framebuffer.h"
+#include "task_scheduler.h"
+#include "asset_cache.h"
+#include "progressive.h"
+#include "resample.h"
 
 using namespace std;
 
 
-void render_obj() {
+/* ray_traced 为 true 时用 BVH 计算阴影和环境光遮蔽，否则使用阴影贴图；samples 为多重采样数；
+ * frames 大于 1 时重复渲染，相邻的两帧在流水线中重叠，每一帧都编码写出；输出第一帧之后每一帧的完成间隔和内存分配次数；n_lights 是模型周围随机放置的点光源数；
+ * post 为 true 时在内存中做后处理（锐化、SSAO、调色、色调映射）之后直接写出；
+ * vrs 是着色率 "1x1" "1x2" "2x2" "4x4"，"auto" 表示每一帧由上一帧的亮度方差为每个块选择着色率；
+ * spin 是模型每一帧绕 y 轴旋转的角度；max_age 大于等于 0 时使用重投影缓存，缓存的颜色最多复用 max_age 帧；
+ * live 不为空时把颜色发布到这个名字的共享内存，绘制时每画完一个块就发布，查看器不用等整帧完成；
+ * optimize 为 true 时网格在载入任务中按顶点缓存和 overdraw 重新排序 */
+void render_obj(bool ray_traced, int samples, int frames, int n_lights, bool post, const string &vrs,
+                double spin, int max_age, const string &live, bool optimize) {
     int width = 1024;
     int height = 1024;
 
@@ -19,40 +48,22 @@ void render_obj() {
     const char *normal_filename = "../obj/diablo3_pose/diablo3_pose_nm_tangent.tga";
     const char *spec_filename = "../obj/diablo3_pose/diablo3_pose_spec.tga";
     const char *tga_filename = "../render.tga";
-    Model model = Model(model_filename);
-    TGAImage diffuse_texture;
-    diffuse_texture.read_tga_file(diffuse_filename);
-    diffuse_texture.flip_vertically();
-    TGAImage normal_texture;
-    normal_texture.read_tga_file(normal_filename);
-    normal_texture.flip_vertically();
-    TGAImage spec_texture;
-    spec_texture.read_tga_file(spec_filename);
-    spec_texture.flip_vertically();
-
-    // 设置模型矩阵
-    auto rotate = rotate_y(0);
+    // 网格和三张贴图在调度器上同时载入，下面的准备工作（矩阵、渲染目标、阴影贴图等）和载入重叠进行；
+    // 着色器先拿到对象的地址，每一帧的阶段只等待自己用到的资源
+    auto load_start = chrono::steady_clock::now();
+    TaskScheduler &scheduler = TaskScheduler::global();
+    AssetCache assets(scheduler);
+    assets.optimize_models = optimize;
+    AssetFuture<Model> model_asset = assets.model_async(model_filename, false);
+    AssetFuture<TGAImage> diffuse_texture = assets.texture_async(diffuse_filename);
+    AssetFuture<TGAImage> normal_texture = assets.texture_async(normal_filename);
+    AssetFuture<TGAImage> spec_texture = assets.texture_async(spec_filename);
+    const Model &model = *model_asset.pointer();
+
+    // 设置模型矩阵，旋转的部分每一帧更新
     auto translate = translation(0, 0, -200);
     auto scale = scaling(80);
-    auto model_matrix = translate * scale * rotate;
-
-    // image, view_port
-    TGAImage out_image(width, height, TGAImage::RGB);
-    auto z_buffer = vector<vector<z_buffer_t>>(height, vector<z_buffer_t>(width, Z_BUFFER_MAX));
-    view_port(0, 0, width, height);
-
-    // 构造 locations
-    vector<vector<Location>> location_model;
-    for (int i = 0; i < model.nfaces(); ++i) {
-        vector<Location> location_face;
-        for (int j = 0; j < 3; ++j) {
-            vec3 pos = model.vert(i, j);
-            vec3 normal = model.normal(i, j);
-            vec2 uv = model.uv(i, j);
-            location_face.emplace_back(pos, normal, uv);
-        }
-        location_model.push_back(location_face);
-    }
+    auto model_matrix = translate * scale * rotate_y(0);
 
     // 摄像机和光照方向
     vec3 camera_pos(0, 0, 0);
@@ -64,29 +75,681 @@ void render_obj() {
     mat<4, 4> view_matrix = lookat(camera_pos, camera_target, y_up);
     mat<4, 4> projection_matrix = projection(100, 100, 100, 400);
 
-    // shader
+    // 流水线中同时进行的两帧各自的状态：帧 N 还在 resolve 和编码时，帧 N + 1 已经开始绘制阴影和深度。
+    // 阶段的闭包只设置一次，提交时只捕获 slot 的指针，不分配内存
+    struct FrameSlot {
+        FrameSlot(int width, int height) : context(width, height), shadow_map(width, height) {}
+
+        int frame = 0;
+        mat<4, 4> model_matrix;
+        RenderContext context;
+        // 从光源看向模型的阴影贴图，每一帧重新渲染，使用自己的 arena
+        ShadowMap shadow_map;
+        FrameArena shadow_arena;
+        PhongShader shader;
+        LightGrid light_grid;
+        // 模型旋转时这一帧的 BVH
+        unique_ptr<BVH> bvh;
+        chrono::steady_clock::time_point start, done;
+        uint64_t encode_allocs = 0;
+        double reuse_ratio = 0;
+
+        function<void()> begin_pass, shadow_pass, bvh_pass, depth_pass, shade_pass, resolve_pass, encode_pass;
+        TaskScheduler::TaskHandle begin, shadow, bvh_built, depth, shade, resolve, encode;
+    };
+    unique_ptr<FrameSlot> slots[2];
+    for (unique_ptr<FrameSlot> &slot : slots) {
+        slot.reset(new FrameSlot(width, height));
+        RenderContext &context = slot->context;
+        context.view_port(0, 0, width, height);
+        context.set_samples(samples);
+        if (vrs == "1x2") context.set_shading_rate(RenderContext::RATE_1X2);
+        else if (vrs == "2x2") context.set_shading_rate(RenderContext::RATE_2X2);
+        else if (vrs == "4x4") context.set_shading_rate(RenderContext::RATE_4X4);
+        slot->shadow_map.set_light(lookat(light_pos, vec3(0, 0, -200), y_up), projection_matrix);
+    }
+    unique_ptr<BVH> bvh;
+
+    // 所有帧共用的着色器参数，每一帧复制一份再设置自己的模型矩阵、阴影贴图等
     PhongShader phong_shader;
     phong_shader.light_pos = light_pos;
     phong_shader.camera_pos = camera_pos;
-    phong_shader.model_matrix = model_matrix;
-    phong_shader.model_iv_matrix = model_matrix.invert();
     phong_shader.view_matrix = view_matrix;
     phong_shader.projection_matrix = projection_matrix;
-    phong_shader.diffuse_texture = diffuse_texture;
-    phong_shader.normal_texture = normal_texture;
-    phong_shader.specular_texture = spec_texture;
+    phong_shader.diffuse_texture = diffuse_texture.pointer();
+    phong_shader.normal_texture = normal_texture.pointer();
+    phong_shader.specular_texture = spec_texture.pointer();
+    phong_shader.shadow_pcf_radius = 1;
+    phong_shader.ao_samples = 8;
+
+    // 由资源生成的数据也是任务，跟在各自的资源后面；着色阶段依赖它们，再把指针交给这一帧的着色器
+    unique_ptr<Mipmap> diffuse_mipmap;
+    auto mipmap_ready = scheduler.submit([&]() {
+        diffuse_mipmap.reset(new Mipmap(*diffuse_texture.get()));
+    }, {diffuse_texture.task()});
+    TaskScheduler::TaskHandle bvh_ready;
+    if (ray_traced) {
+        bvh_ready = scheduler.submit([&]() {
+            bvh.reset(new BVH(model, model_matrix));
+        }, {model_asset.task()});
+    }
+
+    // 点光源随机分布在模型周围，固定种子保证每次的结果相同
+    if (n_lights > 0) {
+        std::mt19937 rng(1);
+        std::uniform_real_distribution<double> u(0, 1);
+        vector<PointLight> lights;
+        for (int i = 0; i < n_lights; ++i) {
+            PointLight light;
+            light.pos = vec3(160 * u(rng) - 80, 160 * u(rng) - 80, -150 - 90 * u(rng));
+            light.color = vec3(u(rng), u(rng), u(rng));
+            light.radius = 20 + 30 * u(rng);
+            lights.push_back(light);
+        }
+        for (unique_ptr<FrameSlot> &slot : slots)
+            slot->light_grid.set_lights(lights);
+    }
+
+    PostProcess post_process;
+    if (post) {
+        post_process.add_sharpen(0.25);
+        post_process.add_ssao(16, 12, 0.8);
+        post_process.add_color_grade(mat<3, 3>::identity(), vec3(0, 0, 0), 1.15);
+        post_process.add_exposure(1.2);
+        post_process.add_tone_map_aces();
+    }
+
+    ReprojectionCache reprojection(width, height);
+    reprojection.max_age = max(0, max_age);
+
+    LiveFramebuffer live_fb;
+    if (!live.empty() && !live_fb.create(live, width, height))
+        return;
+    // 后处理需要整帧的结果，这时整帧完成之后再发布；否则绘制时每画完一个块就从渲染目标发布这个块。
+    // 多个线程同时画完不同的块，共享内存只能有一个写者，发布时加锁
+    bool per_tile = live_fb.is_open() && !post;
+    mutex publish_mutex;
+    atomic<bool> first_published{false};
+
+    // 每一帧的阶段按依赖关系提交给调度器：阴影贴图和相机的深度（以及点光源的分块）互不依赖，
+    // 着色需要两者，然后 resolve 或者后处理，最后编码写出；阶段内部的循环再由调度器并行
+    for (unique_ptr<FrameSlot> &slot : slots) {
+        FrameSlot *f = slot.get();
+        if (per_tile) {
+            f->context.tile_done = [&, f](const ScreenRect &tile) {
+                {
+                    lock_guard<mutex> lock(publish_mutex);
+                    live_fb.publish(f->context.target(), tile);
+                }
+                if (f->frame == 0 && !first_published.exchange(true))
+                    cout << "first tiles published after "
+                         << chrono::duration<double, milli>(chrono::steady_clock::now() - f->start).count()
+                         << " ms" << endl;
+            };
+        }
+        // 第一帧还没有上一帧的图像，全部逐像素着色；上一帧的图像在另一个 slot 中
+        f->begin_pass = [&, f]() {
+            if (vrs == "auto" && f->frame > 0)
+                f->context.auto_shading_rates(4, slots[(f->frame - 1) % 2]->context.target());
+            f->context.clear();
+        };
+        f->shadow_pass = [&, f]() {
+            if (ray_traced) return;
+            f->shadow_arena.reset();
+            f->shadow_map.clear();
+            render_depth(f->shadow_map, model, f->model_matrix, &f->shadow_arena);
+        };
+        f->bvh_pass = [&, f]() {
+            f->bvh.reset(new BVH(model, f->model_matrix));
+        };
+        // 有点光源时先写深度，由每个块的深度范围剔除光源，着色时每个像素也只有最前面的片段；
+        // 重投影缓存只保存可见的表面，被遮挡的片段总是无法复用，同样先写深度
+        f->depth_pass = [&, f]() {
+            if (n_lights > 0 || max_age >= 0)
+                f->context.depth_prepass(f->shader, model);
+            if (n_lights > 0)
+                f->light_grid.build(f->context, view_matrix, projection_matrix);
+        };
+        f->shade_pass = [&, f]() {
+            RenderContext &context = f->context;
+            PhongShader &shader = f->shader;
+            shader.diffuse_mipmap = diffuse_mipmap.get();
+            if (ray_traced)
+                shader.bvh = spin != 0 && f->frame > 0 ? f->bvh.get() : bvh.get();
+            if (live_fb.is_open())
+                live_fb.begin_frame();
+
+            if (max_age >= 0) {
+                reprojection.begin_frame(context);
+                CachedShader cached(shader, reprojection, 0, projection_matrix * view_matrix * f->model_matrix);
+                context.draw(cached, model);
+                reprojection.end_frame(context);
+                f->reuse_ratio = reprojection.reuse_ratio();
+            } else {
+                context.draw(shader, model);
+            }
+        };
+        f->resolve_pass = [&, f]() {
+            if (post)
+                post_process.run(f->context, projection_matrix, f->context.image());
+            else
+                f->context.resolve();
+            if (live_fb.is_open()) {
+                if (!per_tile)
+                    live_fb.publish(f->context.image(), ScreenRect(0, 0, width - 1, height - 1));
+                live_fb.end_frame();
+            }
+        };
+        // 每一帧都写出，文件中留下的是最后一帧；ofstream 自己的分配记下来，不算在渲染的分配里
+        f->encode_pass = [&, f]() {
+            uint64_t allocs = alloc_count();
+            f->context.image().write_tga_file(tga_filename);
+            f->encode_allocs = alloc_count() - allocs;
+            f->done = chrono::steady_clock::now();
+        };
+    }
+
+    scheduler.reset_stats();
+    auto frames_start = chrono::steady_clock::now();
+    uint64_t allocs = alloc_count();
+
+    // 帧 N 完成之后输出它的统计：和上一帧完成的间隔，以及这段时间内（编码之外）的内存分配
+    auto report = [&](int frame) {
+        FrameSlot &f = *slots[frame % 2];
+        if (frame == 0) {
+            cout << "first frame finished "
+                 << chrono::duration<double, milli>(f.done - load_start).count()
+                 << " ms after loading started" << endl;
+            allocs = alloc_count();
+            return;
+        }
+        // 第一帧之后的稳定状态不应该再分配内存
+        double ms = chrono::duration<double, milli>(f.done - slots[(frame - 1) % 2]->done).count();
+        cout << "frame " << frame << ": " << ms << " ms";
+        if (alloc_counter_enabled())
+            cout << ", " << alloc_count() - allocs - f.encode_allocs << " allocations";
+        allocs = alloc_count();
+        if (max_age >= 0)
+            cout << ", " << f.reuse_ratio * 100 << "% reused";
+        cout << endl;
+    };
+
+    for (int frame = 0; frame < frames; ++frame) {
+        // 同一个 slot 的上一次使用（帧 N - 2）已经在上一轮等待过了
+        FrameSlot *f = slots[frame % 2].get();
+        FrameSlot *prev = frame > 0 ? slots[(frame - 1) % 2].get() : nullptr;
+        f->frame = frame;
+        f->start = chrono::steady_clock::now();
+
+        // 第一帧的角度是 0，和初始的模型矩阵相同
+        f->model_matrix = frame > 0 ? translate * scale * rotate_y(spin * frame) : model_matrix;
+        f->shader = phong_shader;
+        f->shader.model_matrix = f->model_matrix;
+        f->shader.normal_matrix = f->model_matrix.invert_transpose();
+        f->shader.shadow_map = &f->shadow_map;
+        f->shader.light_grid = n_lights > 0 ? &f->light_grid : nullptr;
+
+        // 开始阶段读取上一帧的渲染目标选择着色率，下一帧清空这个目标之前要等它完成；着色按帧的顺序（重投影缓存），
+        // 发布到共享内存时还要等上一帧结束；resolve 和编码也按顺序（后处理的缓冲、写出的文件）
+        TaskScheduler::TaskHandle none;
+        f->begin = scheduler.submit([f]() { f->begin_pass(); },
+                                    {prev && vrs == "auto" ? prev->shade : none, prev ? prev->begin : none});
+        f->shadow = scheduler.submit([f]() { f->shadow_pass(); }, {model_asset.task()});
+        f->bvh_built = bvh_ready;
+        if (ray_traced && spin != 0 && frame > 0)
+            f->bvh_built = scheduler.submit([f]() { f->bvh_pass(); }, {model_asset.task()});
+        // 深度只需要网格，着色还需要贴图、mipmap 和 BVH；已经完成的依赖直接跳过
+        f->depth = scheduler.submit([f]() { f->depth_pass(); }, {model_asset.task(), f->begin});
+        TaskScheduler::TaskHandle shade_deps[] = {f->shadow, f->depth, diffuse_texture.task(), normal_texture.task(),
+                                                  spec_texture.task(), mipmap_ready, f->bvh_built,
+                                                  prev ? prev->shade : none,
+                                                  prev && live_fb.is_open() ? prev->resolve : none};
+        f->shade = scheduler.submit([f]() { f->shade_pass(); }, shade_deps, 9);
+        f->resolve = scheduler.submit([f]() { f->resolve_pass(); }, {f->shade, prev ? prev->resolve : none});
+        f->encode = scheduler.submit([f]() { f->encode_pass(); }, {f->resolve, prev ? prev->encode : none});
+
+        // 保持一帧在流水线中：等待的是上一帧，不是刚提交的这一帧
+        if (prev) {
+            scheduler.wait(prev->encode);
+            report(frame - 1);
+        }
+    }
+    scheduler.wait(slots[(frames - 1) % 2]->encode);
+    report(frames - 1);
 
-    // 绘制模型
-    for (const auto &f: location_model) {
-        triangle(out_image, z_buffer, phong_shader, f);
+    // 每个线程执行的任务数、窃取的任务数和忙碌的比例
+    double total_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - frames_start).count();
+    vector<TaskScheduler::WorkerStats> stats = scheduler.stats();
+    double busy_ms = 0;
+    for (size_t i = 0; i < stats.size(); ++i) {
+        busy_ms += stats[i].busy_ms;
+        if (stats.size() > 1)
+            cout << "thread " << i << ": " << stats[i].tasks << " tasks, " << stats[i].steals << " stolen, "
+                 << stats[i].busy_ms * 100 / total_ms << "% busy" << endl;
     }
+    cout << scheduler.size() << " threads, " << busy_ms * 100 / (total_ms * scheduler.size()) << "% utilisation" << endl;
 
-    out_image.write_tga_file(tga_filename);
+    if (n_lights > 0)
+        cout << n_lights << " point lights, " << slots[(frames - 1) % 2]->light_grid.average_lights_per_tile()
+             << " per tile on average" << endl;
+}
+
+
+/* 交互预览：大模型静止，小模型每一帧水平移动，只重新绘制脏区域。
+ * 最后和完整绘制的结果比较，输出每一帧重新绘制的面积和时间 */
+void render_preview(int frames) {
+    int width = 1024;
+    int height = 1024;
+
+    Model model(DIABLO_FILENAME);
+    mat<4, 4> view_matrix = scene_view_matrix();
+    mat<4, 4> projection_matrix = scene_projection();
+
+    // 两个实例，阴影会影响到实例的边界之外，这里不使用
+    const int n_instances = 2;
+    PhongShader shaders[n_instances];
+    mat<4, 4> model_matrices[n_instances];
+    model_matrices[0] = scene_model_matrix();
+    for (PhongShader &shader : shaders) {
+        shader = make_phong_shader();
+        set_textures(shader, model);
+    }
+
+    RenderContext context(width, height);
+    DirtyRegion dirty;
+    dirty.invalidate(ScreenRect(0, 0, width - 1, height - 1));
+
+    for (int frame = 0; frame < frames; ++frame) {
+        auto start = chrono::steady_clock::now();
+
+        model_matrices[1] = translation(-60 + 2 * frame, -45, -150) * scaling(20) * rotate_y(30);
+        for (int i = 0; i < n_instances; ++i) {
+            set_model_matrix(shaders[i], model_matrices[i]);
+            dirty.update(i, context.screen_bounds(model, projection_matrix * view_matrix * model_matrices[i]));
+        }
+
+        // 和任何脏矩形相交的实例按原来的顺序重新绘制一次，只写入脏矩形内的像素
+        long area = dirty.area();
+        context.clear(dirty.rects());
+        context.set_scissor(dirty.rects());
+        for (int i = 0; i < n_instances; ++i) {
+            const ScreenRect bounds = dirty.bounds(i);
+            if (any_of(dirty.rects().begin(), dirty.rects().end(),
+                       [&](const ScreenRect &rect) { return bounds.intersects(rect); }))
+                context.draw(shaders[i], model);
+        }
+        context.clear_scissor();
+        for (const ScreenRect &rect : dirty.rects())
+            context.resolve(rect);
+        dirty.clear();
+
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cout << "frame " << frame << ": " << area << " pixels, " << ms << " ms" << endl;
+    }
+
+    // 完整绘制最后一帧作为对照
+    RenderContext full(width, height);
+    auto start = chrono::steady_clock::now();
+    full.clear();
+    for (int i = 0; i < n_instances; ++i)
+        full.draw(shaders[i], model);
+    full.resolve();
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    bool same = memcmp(full.image().buffer(), context.image().buffer(), size_t(width) * height * 3) == 0;
+    cout << "full render: " << ms << " ms, " << (same ? "identical" : "DIFFERENT") << endl;
+    context.image().write_tga_file("../render.tga");
+}
+
+
+
+/* 人群：n 个小模型排成由近到远的网格。先全部用原始网格绘制，再按屏幕上的大小为每个实例选择细节层次绘制，
+ * 误差不超过 pixel_error 个像素；输出两次的时间、三角形数和不同的像素数 */
+void render_crowd(int n, double pixel_error) {
+    int width = 1024;
+    int height = 1024;
+
+    Model model(DIABLO_FILENAME);
+
+    auto start = chrono::steady_clock::now();
+    model.build_lods();
+    double build_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    cout << "build lods: " << build_ms << " ms" << endl;
+    for (int level = 0; level < model.nlods(); ++level)
+        cout << "  lod " << level << ": " << model.lod(level).nfaces() << " faces, error " << model.lod_error(level) << endl;
+
+    mat<4, 4> view_matrix = scene_view_matrix();
+    mat<4, 4> projection_matrix = scene_projection();
+
+    // 每一行比前一行远，越远的行放得越多
+    vector<PhongShader> shaders(n);
+    vector<mat<4, 4>> mvps(n);
+    int columns = max(1, int(ceil(sqrt(double(n)))));
+    int rows = (n + columns - 1) / columns;
+    for (int i = 0; i < n; ++i) {
+        int row = i / columns, column = i % columns;
+        double z = -120 - 260. * row / max(1, rows - 1);
+        double x = (column - (columns - 1) / 2.) * (-z) * 0.9 / columns;
+        mat<4, 4> model_matrix = translation(x, -30, z) * scaling(5) * rotate_y(15 * i);
+        shaders[i] = make_phong_shader(model_matrix);
+        set_textures(shaders[i], model);
+        mvps[i] = projection_matrix * view_matrix * model_matrix;
+    }
+
+    RenderContext full(width, height);
+    start = chrono::steady_clock::now();
+    full.clear();
+    long full_faces = 0;
+    for (int i = 0; i < n; ++i) {
+        full.draw(shaders[i], model);
+        full_faces += model.nfaces();
+    }
+    full.resolve();
+    double full_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    RenderContext context(width, height);
+    vector<int> counts(model.nlods(), 0);
+    start = chrono::steady_clock::now();
+    context.clear();
+    long lod_faces = 0;
+    for (int i = 0; i < n; ++i) {
+        int level = context.select_lod(model, mvps[i], pixel_error);
+        counts[level]++;
+        context.draw(shaders[i], model.lod(level));
+        lod_faces += model.lod(level).nfaces();
+    }
+    context.resolve();
+    double lod_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    long different = 0;
+    const uint8_t *a = full.image().buffer(), *b = context.image().buffer();
+    for (size_t i = 0; i < size_t(width) * height; ++i)
+        different += memcmp(a + i * 3, b + i * 3, 3) != 0;
+    cout << "full: " << full_faces << " faces, " << full_ms << " ms" << endl;
+    cout << "lod:  " << lod_faces << " faces, " << lod_ms << " ms, instances per level";
+    for (int c : counts) cout << " " << c;
+    cout << endl;
+    cout << different << " pixels differ (" << different * 100. / (width * height) << "%)" << endl;
+    context.image().write_tga_file("../render.tga");
+}
+
+
+
+/* 统计实际着色的片段数的 Phong 着色器，用于计算 overdraw */
+struct CountingShader : public PhongShader {
+    atomic<long> fragments{0};
+    // 分块绘制的副本都累加到原来的着色器
+    atomic<long> *total = &fragments;
+
+    explicit CountingShader(const PhongShader &shader) : PhongShader(shader) {}
+
+    CountingShader(const CountingShader &other) : PhongShader(other), total(other.total) {}
+
+    void fragment_quad(const FragmentQuad &quad, TGAColor colors[4]) override {
+        *total += __builtin_popcount(quad.mask);
+        PhongShader::fragment_quad(quad, colors);
+    }
+
+    Shader *clone(FrameArena &arena) const override { return arena.make<CountingShader>(*this); }
+};
+
+/* 网格优化前后的对比：每个自带的模型输出 FIFO 顶点缓存的 ACMR，以及绕 y 轴的 8 个方向绘制时的
+ * overdraw（着色的片段数 / 覆盖的像素数）和绘制时间 */
+void render_mesh_stats() {
+    int width = 1024;
+    int height = 1024;
+    const char *filenames[] = {"../obj/diablo3_pose/diablo3_pose.obj", "../obj/african_head/african_head.obj",
+                               "../obj/boggie/body.obj", "../obj/boggie/head.obj"};
+    const int n_views = 8;
+
+    RenderContext context(width, height);
+    for (const char *filename : filenames) {
+        Model models[2] = {Model(filename), Model()};
+        auto start = chrono::steady_clock::now();
+        models[1] = models[0];
+        models[1].optimize();
+        double optimize_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cout << filename << ": " << models[0].nfaces() << " faces, optimize " << optimize_ms << " ms" << endl;
+
+        for (int k = 0; k < 2; ++k) {
+            const Model &model = models[k];
+            long fragments = 0, covered = 0;
+            double ms = 0;
+            for (int view = 0; view < n_views; ++view) {
+                CountingShader shader(make_phong_shader(scene_model_matrix() * rotate_y(360. * view / n_views)));
+                set_textures(shader, model);
+
+                context.clear();
+                start = chrono::steady_clock::now();
+                context.draw(shader, model);
+                ms += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+                fragments += shader.fragments;
+                for (int y = 0; y < height; ++y)
+                    for (int x = 0; x < width; ++x)
+                        covered += context.target().pixel_depth(x, y) < Z_BUFFER_MAX;
+            }
+            cout << (k == 0 ? "  original:  " : "  optimized: ") << "acmr " << model.acmr() << ", overdraw "
+                 << double(fragments) / max(1L, covered) << ", " << ms / n_views << " ms per view" << endl;
+        }
+    }
+}
+
+
+/* 渐进式预览：在 budget_ms 之内先画出粗略的图像，再按中心优先或者方差优先的顺序细化，
+ * live 不为空时每次更新都发布到共享内存。最后和完整绘制的结果比较 */
+void render_progressive(double budget_ms, bool variance_first, const string &live) {
+    int width = 1024;
+    int height = 1024;
+
+    AssetCache assets;
+    shared_ptr<const Model> model = assets.model(DIABLO_FILENAME);
+    PhongShader shader = make_phong_shader();
+    set_textures(shader, *model);
+
+    LiveFramebuffer live_fb;
+    if (!live.empty() && !live_fb.create(live, width, height))
+        return;
+    if (live_fb.is_open())
+        live_fb.begin_frame();
+
+    RenderContext context(width, height);
+    ProgressiveRenderer progressive;
+    progressive.budget_ms = budget_ms;
+    progressive.order = variance_first ? ProgressiveRenderer::VARIANCE_FIRST : ProgressiveRenderer::CENTER_FIRST;
+    auto start = chrono::steady_clock::now();
+    int updates = 0;
+    ScreenRect bounds =
+            context.screen_bounds(*model, shader.projection_matrix * shader.view_matrix * shader.model_matrix);
+    bool complete = progressive.render(context, [&](RenderContext &c) { c.draw(shader, *model); }, bounds,
+                                       [&](const TGAImage &image, const ScreenRect &rect) {
+        ++updates;
+        if (updates == 1)
+            cout << "coarse image after "
+                 << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+        if (live_fb.is_open())
+            live_fb.publish(image, rect);
+    });
+    if (live_fb.is_open())
+        live_fb.end_frame();
+    cout << "returned after " << progressive.elapsed_ms() << " ms (budget " << budget_ms << " ms): "
+         << progressive.refined() << " regions refined, " << progressive.skipped() << " skipped, "
+         << progressive.remaining() << " remaining, " << updates << " updates" << endl;
+
+    RenderContext full(width, height);
+    start = chrono::steady_clock::now();
+    full.clear();
+    full.draw(shader, *model);
+    full.resolve();
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    long different = 0;
+    const uint8_t *a = full.image().buffer(), *b = context.image().buffer();
+    for (size_t i = 0; i < size_t(width) * height; ++i)
+        different += memcmp(a + i * 3, b + i * 3, 3) != 0;
+    cout << "full render: " << ms << " ms, " << different << " pixels differ"
+         << (complete ? " (all regions refined)" : "") << endl;
+    context.image().write_tga_file("../render.tga");
+}
+
+
+/* 区域渲染：只渲染屏幕中的 rect，输出 rect 大小的图像，和整帧渲染的同一区域比较，并比较两者的时间。
+ * samples 和 vrs 同 render_obj（vrs 不支持 "auto"） */
+void render_crop(const ScreenRect &rect, int samples, const string &vrs) {
+    int width = 1024;
+    int height = 1024;
+
+    AssetCache assets;
+    shared_ptr<const Model> model = assets.model(DIABLO_FILENAME);
+    PhongShader shader = make_phong_shader();
+    set_textures(shader, *model);
+
+    RenderContext full(width, height);
+    RenderContext crop(width, height, rect);
+    ScreenRect region = crop.get_region();
+    double ms[2];
+    RenderContext *contexts[2] = {&full, &crop};
+    for (int k = 0; k < 2; ++k) {
+        RenderContext &context = *contexts[k];
+        if (samples > 1) context.set_samples(samples);
+        if (vrs == "1x2") context.set_shading_rate(RenderContext::RATE_1X2);
+        else if (vrs == "2x2") context.set_shading_rate(RenderContext::RATE_2X2);
+        else if (vrs == "4x4") context.set_shading_rate(RenderContext::RATE_4X4);
+        // 第一次绘制预热缓存，取第二次的时间
+        for (int pass = 0; pass < 2; ++pass) {
+            auto start = chrono::steady_clock::now();
+            context.clear();
+            context.draw(shader, *model);
+            context.resolve();
+            ms[k] = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        }
+    }
+
+    long different = 0;
+    const int crop_width = region.x1 - region.x0 + 1;
+    for (int y = region.y0; y <= region.y1; ++y)
+        for (int x = region.x0; x <= region.x1; ++x)
+            different += memcmp(full.image().buffer() + (size_t(y) * width + x) * 3,
+                                crop.image().buffer() + (size_t(y - region.y0) * crop_width + x - region.x0) * 3,
+                                3) != 0;
+    cout << "region [" << region.x0 << ", " << region.x1 << "] x [" << region.y0 << ", " << region.y1 << "], "
+         << region.area() << " pixels (" << 100. * region.area() / (long(width) * height) << "% of the frame)" << endl;
+    cout << "full render: " << ms[0] << " ms, region render: " << ms[1] << " ms, "
+         << different << " pixels differ" << endl;
+    crop.image().write_tga_file("../render.tga");
+}
+
+
+/* 缩略图：渲染一帧 3840x2160 的图像，用每种滤波由金字塔一次生成多个尺寸的缩略图，
+ * 和每个尺寸单独从原图缩放比较时间，最后写出 480x270 的 Mitchell 缩略图 */
+void render_thumbnails() {
+    int width = 3840;
+    int height = 2160;
+
+    AssetCache assets;
+    shared_ptr<const Model> model = assets.model(DIABLO_FILENAME);
+    PhongShader shader = make_phong_shader(scene_model_matrix(), width, height);
+    set_textures(shader, *model);
+
+    RenderContext context(width, height);
+    context.clear();
+    context.draw(shader, *model);
+    context.resolve();
+    const TGAImage &frame = context.image();
+
+    const vector<pair<int, int>> sizes = {{1920, 1080}, {960, 540}, {480, 270}, {320, 180}, {160, 90}};
+    const char *names[] = {"box", "bilinear", "mitchell", "lanczos3"};
+    vector<TGAImage> thumbnails;
+    for (int f = Resampler::BOX; f <= Resampler::LANCZOS3; ++f) {
+        Resampler resampler(static_cast<Resampler::Filter>(f));
+        double ms[2];
+        // 第一次预热（分配缓冲），取第二次的时间
+        for (int pass = 0; pass < 2; ++pass) {
+            auto start = chrono::steady_clock::now();
+            resampler.pyramid(frame, sizes, thumbnails);
+            ms[0] = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        }
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < sizes.size(); ++i)
+            resampler.resample(frame, thumbnails[i], sizes[i].first, sizes[i].second);
+        ms[1] = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cout << names[f] << ": pyramid " << ms[0] << " ms, separately " << ms[1] << " ms for "
+             << sizes.size() << " sizes" << endl;
+    }
+
+    Resampler().pyramid(frame, sizes, thumbnails);
+    thumbnails[2].write_tga_file("../render.tga");
 }
 
 
 // ============================================================================
-int main() {
-    render_obj();
+int main(int argc, char **argv) {
+    bool ray_traced = false;
+    int samples = 1;
+    int frames = 1;
+    int n_lights = 0;
+    bool post = false;
+    string vrs = "1x1";
+    double spin = 0;
+    int max_age = -1;
+    int preview = 0;
+    string live;
+    int n_threads = 0;
+    int crowd = 0;
+    bool mesh_stats = false;
+    bool optimize = false;
+    double progressive_ms = 0;
+    bool variance_first = false;
+    double lod_pixels = 1;
+    ScreenRect crop;
+    bool thumbnails = false;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--rt") ray_traced = true;
+        else if (arg == "--msaa" && i + 1 < argc) samples = atoi(argv[++i]);
+        else if (arg == "--frames" && i + 1 < argc) frames = max(1, atoi(argv[++i]));
+        else if (arg == "--lights" && i + 1 < argc) n_lights = max(0, atoi(argv[++i]));
+        else if (arg == "--post") post = true;
+        else if (arg == "--vrs" && i + 1 < argc) vrs = argv[++i];
+        else if (arg == "--spin" && i + 1 < argc) spin = atof(argv[++i]);
+        else if (arg == "--reproject" && i + 1 < argc) max_age = max(0, atoi(argv[++i]));
+        else if (arg == "--preview" && i + 1 < argc) preview = max(1, atoi(argv[++i]));
+        else if (arg == "--live" && i + 1 < argc) live = argv[++i];
+        else if (arg == "--threads" && i + 1 < argc) n_threads = atoi(argv[++i]);
+        else if (arg == "--crowd" && i + 1 < argc) crowd = max(1, atoi(argv[++i]));
+        else if (arg == "--lod" && i + 1 < argc) lod_pixels = atof(argv[++i]);
+        else if (arg == "--mesh-stats") mesh_stats = true;
+        else if (arg == "--optimize") optimize = true;
+        else if (arg == "--progressive" && i + 1 < argc) progressive_ms = atof(argv[++i]);
+        else if (arg == "--variance-first") variance_first = true;
+        else if (arg == "--thumbnails") thumbnails = true;
+        else if (arg == "--crop" && i + 4 < argc) {
+            crop = ScreenRect(atoi(argv[i + 1]), atoi(argv[i + 2]), atoi(argv[i + 3]), atoi(argv[i + 4]));
+            i += 4;
+        }
+    }
+    TaskScheduler::set_global_threads(n_threads);
+    if (preview > 0) {
+        render_preview(preview);
+        return 0;
+    }
+    if (progressive_ms > 0) {
+        render_progressive(progressive_ms, variance_first, live);
+        return 0;
+    }
+    if (thumbnails) {
+        render_thumbnails();
+        return 0;
+    }
+    if (!crop.empty()) {
+        render_crop(crop, samples, vrs);
+        return 0;
+    }
+    if (mesh_stats) {
+        render_mesh_stats();
+        return 0;
+    }
+    if (crowd > 0) {
+        render_crowd(crowd, lod_pixels);
+        return 0;
+    }
+    render_obj(ray_traced, samples, frames, n_lights, post, vrs, spin, max_age, live, optimize);
     cout << "wirte to file objk." << endl;
 }
@@ -0,0 +1,413 @@
+// 基准测试：各个阶段的微基准，以及自带模型和程序生成的场景在不同分辨率和线程数下绘制整帧的宏基准。
+//
+// 用法：render_bench [--format json|csv] [--output 文件] [--filter 文本] [--threads 1,4,...]
+//                    [--sizes 512,1024,...] [--scenes 场景:规模,...] [--samples N] [--min-time MS] [--quick]
+//                    [--micro] [--macro]
+// --filter   只执行名字中包含这段文本的基准，例如 micro/io 或者 diablo3_pose/1024
+// --threads  宏基准的线程数，默认是 1 和硬件线程数；微基准总是单线程
+// --sizes    宏基准的分辨率（正方形），默认 512,1024,2048
+// --scenes   宏基准中程序生成的场景，例如 sphere:1048576,cloud:262144，见 scene_generator.h；空字符串表示不用
+// --samples  每个基准至少的样本数，--min-time 至少的测量时间
+// --quick    少量样本和较小的分辨率，用于检查能否运行
+// --micro / --macro 只执行一类
+// 结果默认以 JSON 输出到标准输出，进度输出到标准错误
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "benchmark.h"
+#include "model.h"
+#include "my_gl.h"
+#include "scene.h"
+#include "shader.h"
+#include "transform.h"
+#include "mipmap.h"
+#include "scene_generator.h"
+#include "task_scheduler.h"
+
+using namespace std;
+
+
+namespace {
+    /* 宏基准的场景：一个或几个模型，使用同一个模型矩阵 */
+    struct Scene {
+        const char *name;
+        vector<const char *> files;
+    };
+
+    const Scene SCENES[] = {
+            {"diablo3_pose", {DIABLO_FILENAME}},
+            {"african_head", {"../obj/african_head/african_head.obj", "../obj/african_head/african_head_eye_inner.obj",
+                              "../obj/african_head/african_head_eye_outer.obj"}},
+            {"boggie", {"../obj/boggie/body.obj", "../obj/boggie/head.obj", "../obj/boggie/eyes.obj"}},
+    };
+
+    /* 顶点直接给出标准化设备坐标，片段是常数颜色，只测光栅化和深度测试 */
+    struct FlatShader : public Shader {
+        vec4 vertex(const Location &location, int) override {
+            return embed<4>(location.local_pos);
+        }
+
+        TGAColor fragment(const vec3 &) override {
+            return TGAColor(200, 200, 200);
+        }
+    };
+
+    vector<Location> model_locations(const Model &model) {
+        vector<Location> locations;
+        for (int i = 0; i < model.nfaces(); ++i)
+            for (int j = 0; j < 3; ++j)
+                locations.emplace_back(model.vert(i, j), model.normal(i, j), model.uv(i, j), model.tangent(i, j));
+        return locations;
+    }
+}
+
+
+void geometry_benchmarks(Benchmark &bench) {
+    mt19937 rng(1);
+    uniform_real_distribution<double> angle(0, 360), offset(-10, 10);
+    const int n = 64;
+    vector<mat<4, 4>> matrices;
+    vector<vec4> vectors;
+    vector<vec3> directions;
+    for (int i = 0; i < n; ++i) {
+        matrices.push_back(translation(offset(rng), offset(rng), offset(rng)) * rotate_y(angle(rng)) *
+                           rotate_x(angle(rng)) * scaling(1 + abs(offset(rng))));
+        vectors.push_back(embed<4>(vec3(offset(rng), offset(rng), offset(rng))));
+        directions.emplace_back(offset(rng), offset(rng), offset(rng));
+    }
+
+    bench.micro("micro/geometry/mat4_mul", [&](long iterations) {
+        for (long i = 0; i < iterations; ++i) {
+            mat<4, 4> m = matrices[i % n] * matrices[(i + 1) % n];
+            keep(m);
+        }
+    });
+    bench.micro("micro/geometry/mat4_vec4", [&](long iterations) {
+        for (long i = 0; i < iterations; ++i) {
+            vec4 v = matrices[i % n] * vectors[(i + 1) % n];
+            keep(v);
+        }
+    });
+    bench.micro("micro/geometry/mat4_invert_transpose", [&](long iterations) {
+        for (long i = 0; i < iterations; ++i) {
+            mat<4, 4> m = matrices[i % n].invert_transpose();
+            keep(m);
+        }
+    });
+    bench.micro("micro/geometry/vec3_cross_normalize", [&](long iterations) {
+        for (long i = 0; i < iterations; ++i) {
+            vec3 v = cross(directions[i % n], directions[(i + 1) % n]).normalize();
+            keep(v);
+        }
+    });
+}
+
+void raster_benchmarks(Benchmark &bench) {
+    // 不同大小的三角形随机放在 256x256 的屏幕中，结果是每个三角形的时间
+    const int size = 256;
+    RenderContext context(size, size);
+    context.parallel = false;
+    context.clear();
+    FlatShader shader;
+    mt19937 rng(2);
+    const struct {
+        const char *name;
+        double pixels;
+    } sizes[] = {{"micro/raster/triangle_8px", 8}, {"micro/raster/triangle_512px", 512},
+                 {"micro/raster/triangle_32kpx", 32768}};
+    for (const auto &s : sizes) {
+        // 直角边为 d 像素的直角三角形，面积 d * d / 2
+        double d = sqrt(2 * s.pixels) * 2 / size;
+        uniform_real_distribution<double> pos(-1, 1 - d);
+        vector<Location> locations;
+        for (int i = 0; i < 64; ++i) {
+            double x = pos(rng), y = pos(rng);
+            for (const vec2 &corner : {vec2(x, y), vec2(x + d, y), vec2(x, y + d)})
+                locations.emplace_back(vec3(corner.x, corner.y, 0), vec3(0, 0, 1), vec2(0, 0));
+        }
+        bench.micro(s.name, [&](long iterations) {
+            for (long i = 0; i < iterations; ++i)
+                context.triangle(shader, &locations[(i % 64) * 3]);
+        });
+    }
+}
+
+void shader_benchmarks(Benchmark &bench, const Model &model) {
+    PhongShader shader = make_phong_shader();
+    set_textures(shader, model);
+    vector<Location> locations = model_locations(model);
+    const long n_locations = long(locations.size());
+
+    bench.micro("micro/shader/phong_vertex", [&](long iterations) {
+        for (long i = 0; i < iterations; ++i) {
+            vec4 clip = shader.vertex(locations[i % n_locations], int(i % 3));
+            keep(clip);
+        }
+    });
+
+    // 片段着色器在模型中间的一个三角形上，随机的重心坐标
+    int face = model.nfaces() / 2;
+    for (int j = 0; j < 3; ++j)
+        shader.vertex(locations[face * 3 + j], j);
+    mt19937 rng(3);
+    uniform_real_distribution<double> unit(0, 1);
+    vector<vec3> barys;
+    for (int i = 0; i < 256; ++i) {
+        double u = unit(rng), v = unit(rng);
+        if (u + v > 1) {
+            u = 1 - u;
+            v = 1 - v;
+        }
+        barys.emplace_back(u, v, 1 - u - v);
+    }
+    bench.micro("micro/shader/phong_fragment", [&](long iterations) {
+        for (long i = 0; i < iterations; ++i) {
+            TGAColor c = shader.fragment(barys[i % 256]);
+            keep(c);
+        }
+    });
+
+    // 同样的重心坐标组成 2x2 的 quad，相邻像素相差千分之一；结果是每个 quad（4 个像素）的时间
+    vector<FragmentQuad> quads(256);
+    for (int i = 0; i < 256; ++i) {
+        FragmentQuad &quad = quads[i];
+        quad.x = quad.y = 0;
+        quad.mask = 0xf;
+        for (int k = 0; k < 4; ++k) {
+            double du = (k & 1) * 1e-3, dv = (k >> 1) * 1e-3;
+            quad.bary[k] = barys[i] + vec3(-du - dv, du, dv);
+        }
+    }
+    bench.micro("micro/shader/phong_fragment_quad", [&](long iterations) {
+        TGAColor colors[4];
+        for (long i = 0; i < iterations; ++i) {
+            shader.fragment_quad(quads[i % 256], colors);
+            keep(colors);
+        }
+    });
+}
+
+void texture_benchmarks(Benchmark &bench, const Model &model) {
+    const TGAImage &diffuse = model.diffuse_map();
+    Mipmap mipmap(diffuse);
+    mt19937 rng(4);
+    uniform_real_distribution<double> unit(0, 1), lod(0, 4);
+    vector<vec2> uvs;
+    vector<double> lods;
+    for (int i = 0; i < 1024; ++i) {
+        uvs.emplace_back(unit(rng), unit(rng));
+        lods.push_back(lod(rng));
+    }
+
+    bench.micro("micro/texture/nearest", [&](long iterations) {
+        for (long i = 0; i < iterations; ++i) {
+            TGAColor c = get_diffuse(diffuse, uvs[i % 1024]);
+            keep(c);
+        }
+    });
+    bench.micro("micro/texture/mipmap", [&](long iterations) {
+        for (long i = 0; i < iterations; ++i) {
+            TGAColor c = mipmap.sample(uvs[i % 1024], lods[i % 1024]);
+            keep(c);
+        }
+    });
+    bench.micro("micro/texture/mipmap_build", [&](long iterations) {
+        for (long i = 0; i < iterations; ++i) {
+            Mipmap m(diffuse);
+            keep(m);
+        }
+    });
+}
+
+void io_benchmarks(Benchmark &bench) {
+    for (const Scene &scene : SCENES) {
+        const char *file = scene.files[0];
+        bench.micro(string("micro/io/obj_parse/") + scene.name, [&](long iterations) {
+            for (long i = 0; i < iterations; ++i) {
+                Model model(file, false);
+                keep(model);
+            }
+        });
+    }
+
+    const string texture = Model::texture_filename(DIABLO_FILENAME, "_diffuse.tga");
+    TGAImage image;
+    bench.micro("micro/io/tga_read", [&](long iterations) {
+        for (long i = 0; i < iterations; ++i)
+            image.read_tga_file(texture);
+    });
+    const char *temp = "render_bench.tga";
+    bench.micro("micro/io/tga_write", [&](long iterations) {
+        for (long i = 0; i < iterations; ++i)
+            image.write_tga_file(temp);
+    });
+    remove(temp);
+}
+
+void micro_benchmarks(Benchmark &bench) {
+    geometry_benchmarks(bench);
+    raster_benchmarks(bench);
+    if (bench.enabled("micro/shader") || bench.enabled("micro/texture")) {
+        Model model(DIABLO_FILENAME);
+        shader_benchmarks(bench, model);
+        texture_benchmarks(bench, model);
+    }
+    io_benchmarks(bench);
+}
+
+string frame_name(const string &scene, int size) {
+    ostringstream name;
+    name << "macro/" << scene << "/" << size << "x" << size;
+    return name.str();
+}
+
+bool any_enabled(const Benchmark &bench, const string &scene, const vector<int> &sizes) {
+    for (int size : sizes)
+        if (bench.enabled(frame_name(scene, size))) return true;
+    return false;
+}
+
+/* 在每个分辨率下绘制整帧：清空、绘制所有模型、转换到输出图像 */
+void frame_benchmarks(Benchmark &bench, const string &scene, const vector<unique_ptr<Model>> &models,
+                      const vector<int> &sizes) {
+    vector<PhongShader> shaders(models.size(), make_phong_shader());
+    for (size_t i = 0; i < models.size(); ++i)
+        set_textures(shaders[i], *models[i]);
+    for (int size : sizes) {
+        RenderContext context(size, size);
+        context.parallel = bench.threads > 1;
+        bench.macro(frame_name(scene, size), [&]() {
+            context.clear();
+            for (size_t i = 0; i < models.size(); ++i)
+                context.draw(shaders[i], *models[i]);
+            context.resolve();
+        });
+    }
+}
+
+/* 自带的模型，以及程序生成的场景（名字是 gen/场景_规模，见 SceneGenerator） */
+void macro_benchmarks(Benchmark &bench, const vector<int> &sizes, const vector<pair<string, int>> &generated) {
+    for (const Scene &scene : SCENES) {
+        if (!any_enabled(bench, scene.name, sizes)) continue;
+        vector<unique_ptr<Model>> models;
+        for (const char *file : scene.files)
+            models.emplace_back(new Model(file));
+        frame_benchmarks(bench, scene.name, models, sizes);
+    }
+
+    for (const auto &g : generated) {
+        string scene = "gen/" + g.first + "_" + to_string(g.second);
+        if (!any_enabled(bench, scene, sizes)) continue;
+        vector<unique_ptr<Model>> models;
+        models.emplace_back(new Model());
+        SceneGenerator().generate(g.first, g.second, *models[0]);
+        SceneGenerator::set_default_textures(*models[0]);
+        frame_benchmarks(bench, scene, models, sizes);
+    }
+}
+
+vector<int> parse_list(const string &text) {
+    vector<int> res;
+    istringstream in(text);
+    string item;
+    while (getline(in, item, ','))
+        if (atoi(item.c_str()) > 0) res.push_back(atoi(item.c_str()));
+    return res;
+}
+
+/* 场景:规模,... 例如 sphere:65536,planes:16；格式错误或者场景未知时返回 false */
+bool parse_scenes(const string &text, vector<pair<string, int>> &scenes) {
+    scenes.clear();
+    const vector<string> &names = SceneGenerator::names();
+    istringstream in(text);
+    string item;
+    while (getline(in, item, ',')) {
+        size_t colon = item.find(':');
+        if (colon == string::npos) return false;
+        string name = item.substr(0, colon);
+        int size = atoi(item.c_str() + colon + 1);
+        if (size <= 0 || find(names.begin(), names.end(), name) == names.end()) return false;
+        scenes.emplace_back(name, size);
+    }
+    return true;
+}
+
+
+int main(int argc, char **argv) {
+    Benchmark bench;
+    string format = "json";
+    string output;
+    vector<int> thread_counts = {1};
+    int hardware = int(thread::hardware_concurrency());
+    if (hardware > 1) thread_counts.push_back(hardware);
+    vector<int> sizes = {512, 1024, 2048};
+    // 每种生成的场景取几个规模，便于看出随规模的变化
+    string scenes = "sphere:16384,sphere:262144,grid:1024,planes:4,planes:16,slivers:256,slivers:2048,cloud:262144,"
+                    "fullscreen:4,fullscreen:16";
+    bool micro = true, macro = true, scenes_given = false;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--format" && i + 1 < argc) format = argv[++i];
+        else if (arg == "--output" && i + 1 < argc) output = argv[++i];
+        else if (arg == "--filter" && i + 1 < argc) bench.filter = argv[++i];
+        else if (arg == "--threads" && i + 1 < argc) thread_counts = parse_list(argv[++i]);
+        else if (arg == "--sizes" && i + 1 < argc) sizes = parse_list(argv[++i]);
+        else if (arg == "--scenes" && i + 1 < argc) {
+            scenes = argv[++i];
+            scenes_given = true;
+        }
+        else if (arg == "--samples" && i + 1 < argc) bench.min_samples = max(1, atoi(argv[++i]));
+        else if (arg == "--min-time" && i + 1 < argc) bench.min_time_ms = atof(argv[++i]);
+        else if (arg == "--micro") macro = false;
+        else if (arg == "--macro") micro = false;
+        else if (arg == "--quick") {
+            bench.min_samples = 3;
+            bench.min_time_ms = 20;
+            sizes = {256, 512};
+            if (!scenes_given) scenes = "sphere:4096,grid:64,planes:8,slivers:1024,cloud:16384,fullscreen:4";
+        } else {
+            cerr << "unknown argument " << arg << endl;
+            return 1;
+        }
+    }
+    if (format != "json" && format != "csv") {
+        cerr << "unknown format " << format << endl;
+        return 1;
+    }
+    vector<pair<string, int>> generated;
+    if (!parse_scenes(scenes, generated)) {
+        cerr << "bad scene list " << scenes << endl;
+        return 1;
+    }
+
+    // 每组基准在单独的子进程中执行，全局调度器使用这一组的线程数，不同的组之间也不共享缓存和分配器的状态
+    bool ok = true;
+    if (micro)
+        ok &= bench.run_isolated(1, micro_benchmarks);
+    if (macro)
+        for (int threads : thread_counts)
+            ok &= bench.run_isolated(threads, [&](Benchmark &b) { macro_benchmarks(b, sizes, generated); });
+
+    ofstream file;
+    if (!output.empty()) {
+        file.open(output);
+        if (!file) {
+            cerr << "can't open " << output << endl;
+            return 1;
+        }
+    }
+    ostream &out = output.empty() ? cout : file;
+    if (format == "json")
+        bench.write_json(out);
+    else
+        bench.write_csv(out);
+    return ok ? 0 : 1;
+}
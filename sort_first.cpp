@@ -0,0 +1,311 @@
+// 多进程 sort-first 渲染：屏幕划分为矩形区域，多个工作进程用同样的管线绘制各自领取的区域，
+// 结果直接写入共享内存中的帧缓冲，不需要网络服务，也不需要合成。
+// 协调进程每一帧按上一帧各区域的耗时从大到小排列领取顺序，工作进程从共享的队列中动态领取，
+// 先做完的进程继续领取剩下的区域，耗时长的区域最先开始，尾部只剩下小区域。
+//
+// 用法：sort_first [-j 进程数] [-w 宽] [-h 高] [--region 像素] [--frames N] [--verify] [输出文件]
+//       sort_first --worker <共享内存名> <编号>
+// 区域的边长默认使每个进程平均分到 8 个区域左右
+// 工作进程默认由协调进程 fork，也可以用 --worker 在其他容器中手动启动（共享同一个 /dev/shm）；
+// --verify 时再在单个进程中绘制一次，和多进程的结果逐字节比较
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <numeric>
+#include <vector>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "mipmap.h"
+#include "my_gl.h"
+#include "scene.h"
+#include "shader.h"
+#include "shadow.h"
+#include "shared_memory.h"
+
+using namespace std;
+
+
+const uint32_t CONTROL_MAGIC = 0x53464231;  // "SFB1"
+
+struct Region {
+    int x0, y0, x1, y1;
+    double cost;  // 上一次绘制的耗时，毫秒
+    int worker;   // 上一次绘制它的工作进程
+};
+
+/* 共享内存开头的控制块，后面依次是领取顺序 order[n_regions]、区域 regions[n_regions] 和 RGB 像素 */
+struct ControlBlock {
+    uint32_t magic;
+    int width;
+    int height;
+    int n_regions;
+    int n_workers;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t start;     // 开始新的一帧或者退出
+    pthread_cond_t finished;  // 工作进程就绪，或者一帧的所有区域都已完成
+    int frame;
+    int shutdown;
+    int ready;
+    int done;
+
+    // 高 32 位是帧号，低 32 位是下一个要领取的 order 下标；帧号不对时说明这一帧已经结束
+    std::atomic<uint64_t> next;
+};
+
+/* 共享内存中各部分的偏移 */
+struct ShmLayout {
+    size_t order, regions, pixels, total;
+
+    ShmLayout(int width, int height, int n_regions) {
+        order = (sizeof(ControlBlock) + 63) & ~size_t(63);
+        regions = order + ((sizeof(int) * n_regions + 63) & ~size_t(63));
+        pixels = regions + ((sizeof(Region) * n_regions + 63) & ~size_t(63));
+        total = pixels + size_t(width) * height * TGAImage::RGB;
+    }
+};
+
+
+/* scene.h 中的场景，阴影贴图的分辨率固定，和输出的尺寸无关 */
+struct Scene {
+    Model model;
+    unique_ptr<Mipmap> diffuse_mipmap;
+    ShadowMap shadow_map;
+    mat<4, 4> model_matrix;
+    PhongShader shader;
+    ScreenRect bounds;  // 模型在屏幕上的包围矩形
+
+    Scene(int width, int height)
+            : model(DIABLO_FILENAME), diffuse_mipmap(new Mipmap(model.diffuse_map())), shadow_map(2048, 2048),
+              model_matrix(scene_model_matrix()), shader(make_phong_shader(model_matrix, width, height)) {
+        shadow_map.set_light(lookat(scene_light_pos(), vec3(0, 0, -200), vec3(0, 1, 0)), scene_projection());
+        set_textures(shader, model);
+        shader.diffuse_mipmap = diffuse_mipmap.get();
+        shader.shadow_map = &shadow_map;
+        shader.shadow_pcf_radius = 1;
+    }
+
+    /* 每一帧绘制之前渲染阴影贴图 */
+    void begin_frame(RenderContext &context) {
+        shadow_map.clear();
+        render_depth(shadow_map, model, model_matrix, &context.arena());
+        bounds = context.screen_bounds(model, shader.projection_matrix * shader.view_matrix * model_matrix);
+    }
+
+    /* 只绘制 rect 内的像素，写入 pixels（width x height 的 RGB 图像） */
+    void render(RenderContext &context, const ScreenRect &rect, uint8_t *pixels) {
+        context.clear(vector<ScreenRect>{rect});
+        context.set_scissor(rect);
+        // 每个区域都要重新做顶点变换，和模型不相交的区域直接跳过
+        if (bounds.intersects(rect))
+            context.draw(shader, model);
+        for (int y = rect.y0; y <= rect.y1; ++y)
+            context.target().resolve_span(y, rect.x0, rect.x1,
+                                          pixels + (size_t(y) * context.get_width() + rect.x0) * TGAImage::RGB,
+                                          TGAImage::RGB);
+    }
+};
+
+
+/* 工作进程：打开共享内存，等待协调进程开始每一帧，从队列中领取区域直到这一帧没有剩余 */
+int run_worker(const string &shm_name, int id) {
+    SharedMemory shm;
+    if (!shm.open(shm_name)) return 1;
+    auto *control = static_cast<ControlBlock *>(shm.data());
+    if (shm.size() < sizeof(ControlBlock) || control->magic != CONTROL_MAGIC) {
+        cerr << "worker " << id << ": bad control block in " << shm_name << endl;
+        return 1;
+    }
+    const int width = control->width, height = control->height, n_regions = control->n_regions;
+    ShmLayout layout(width, height, n_regions);
+    auto *base = static_cast<uint8_t *>(shm.data());
+    const int *order = reinterpret_cast<const int *>(base + layout.order);
+    Region *regions = reinterpret_cast<Region *>(base + layout.regions);
+    uint8_t *pixels = base + layout.pixels;
+
+    // 进程之间并行，进程内部不再并行
+    Scene scene(width, height);
+    RenderContext context(width, height);
+    context.parallel = false;
+
+    pthread_mutex_lock(&control->mutex);
+    ++control->ready;
+    pthread_cond_signal(&control->finished);
+    int seen = 0;
+    for (;;) {
+        while (control->frame == seen && !control->shutdown)
+            pthread_cond_wait(&control->start, &control->mutex);
+        if (control->shutdown) break;
+        seen = control->frame;
+        pthread_mutex_unlock(&control->mutex);
+
+        scene.begin_frame(context);
+        int n_done = 0;
+        for (;;) {
+            uint64_t v = control->next.load();
+            if (int(v >> 32) != seen || int(v & 0xffffffff) >= n_regions) break;
+            if (!control->next.compare_exchange_weak(v, v + 1)) continue;
+
+            Region &region = regions[order[v & 0xffffffff]];
+            auto start = chrono::steady_clock::now();
+            scene.render(context, ScreenRect(region.x0, region.y0, region.x1, region.y1), pixels);
+            region.cost = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            region.worker = id;
+            ++n_done;
+        }
+
+        pthread_mutex_lock(&control->mutex);
+        control->done += n_done;
+        if (control->done == n_regions)
+            pthread_cond_signal(&control->finished);
+    }
+    pthread_mutex_unlock(&control->mutex);
+    return 0;
+}
+
+
+int main(int argc, char **argv) {
+    int n_workers = int(sysconf(_SC_NPROCESSORS_ONLN));
+    int width = 1024;
+    int height = 1024;
+    int region_size = 0;
+    int frames = 1;
+    bool verify = false;
+    string output = "../render.tga";
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--worker" && i + 2 < argc) return run_worker(argv[i + 1], atoi(argv[i + 2]));
+        else if (arg == "-j" && i + 1 < argc) n_workers = atoi(argv[++i]);
+        else if (arg == "-w" && i + 1 < argc) width = atoi(argv[++i]);
+        else if (arg == "-h" && i + 1 < argc) height = atoi(argv[++i]);
+        else if (arg == "--region" && i + 1 < argc) region_size = atoi(argv[++i]);
+        else if (arg == "--frames" && i + 1 < argc) frames = atoi(argv[++i]);
+        else if (arg == "--verify") verify = true;
+        else output = arg;
+    }
+    n_workers = max(1, n_workers);
+    frames = max(1, frames);
+    if (region_size <= 0)
+        region_size = int(sqrt(double(width) * height / (8 * n_workers)));
+    region_size = max(16, (region_size + 15) & ~15);
+    if (width <= 0 || height <= 0) {
+        cerr << "bad size " << width << "x" << height << endl;
+        return 1;
+    }
+
+    // 按 region_size 划分屏幕
+    vector<Region> grid;
+    for (int y = 0; y < height; y += region_size)
+        for (int x = 0; x < width; x += region_size)
+            grid.push_back({x, y, min(width, x + region_size) - 1, min(height, y + region_size) - 1, 0, -1});
+    const int n_regions = int(grid.size());
+
+    // 共享内存：控制块、区域和帧缓冲
+    ShmLayout layout(width, height, n_regions);
+    SharedMemory shm;
+    string shm_name = "/render_sort_first_" + to_string(getpid());
+    if (!shm.create(shm_name, layout.total)) return 1;
+    auto *base = static_cast<uint8_t *>(shm.data());
+    auto *control = new(base) ControlBlock();
+    int *order = reinterpret_cast<int *>(base + layout.order);
+    Region *regions = reinterpret_cast<Region *>(base + layout.regions);
+    const uint8_t *pixels = base + layout.pixels;
+    copy(grid.begin(), grid.end(), regions);
+
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&control->mutex, &mutex_attr);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&control->start, &cond_attr);
+    pthread_cond_init(&control->finished, &cond_attr);
+    control->width = width;
+    control->height = height;
+    control->n_regions = n_regions;
+    control->n_workers = n_workers;
+    control->magic = CONTROL_MAGIC;
+
+    // 启动工作进程
+    vector<pid_t> workers;
+    for (int i = 0; i < n_workers; ++i) {
+        pid_t pid = fork();
+        if (pid == 0) _exit(run_worker(shm_name, i));
+        if (pid < 0) {
+            cerr << "fork failed" << endl;
+            break;
+        }
+        workers.push_back(pid);
+    }
+    if (workers.empty()) {
+        shm.unlink();
+        return 1;
+    }
+
+    pthread_mutex_lock(&control->mutex);
+    while (control->ready < int(workers.size()))
+        pthread_cond_wait(&control->finished, &control->mutex);
+    pthread_mutex_unlock(&control->mutex);
+
+    for (int frame = 1; frame <= frames; ++frame) {
+        // 上一帧耗时长的区域先领取，第一帧按屏幕顺序
+        iota(order, order + n_regions, 0);
+        stable_sort(order, order + n_regions, [regions](int a, int b) { return regions[a].cost > regions[b].cost; });
+
+        auto start = chrono::steady_clock::now();
+        pthread_mutex_lock(&control->mutex);
+        control->done = 0;
+        control->next = uint64_t(frame) << 32;
+        control->frame = frame;
+        pthread_cond_broadcast(&control->start);
+        while (control->done < n_regions)
+            pthread_cond_wait(&control->finished, &control->mutex);
+        pthread_mutex_unlock(&control->mutex);
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        // 每个工作进程的总耗时，最大值和平均值之比反映负载是否均衡
+        vector<double> load(workers.size(), 0);
+        for (int i = 0; i < n_regions; ++i) {
+            // 手动启动的工作进程的编号可能超出 fork 的数量
+            if (size_t(regions[i].worker) >= load.size()) load.resize(regions[i].worker + 1, 0);
+            load[regions[i].worker] += regions[i].cost;
+        }
+        double max_load = *max_element(load.begin(), load.end());
+        double mean_load = accumulate(load.begin(), load.end(), 0.) / load.size();
+        cout << "frame " << frame << ": " << ms << " ms, " << workers.size() << " workers, " << n_regions
+             << " regions, imbalance " << (mean_load > 0 ? max_load / mean_load : 1) << endl;
+    }
+
+    pthread_mutex_lock(&control->mutex);
+    control->shutdown = 1;
+    pthread_cond_broadcast(&control->start);
+    pthread_mutex_unlock(&control->mutex);
+    for (pid_t pid : workers)
+        waitpid(pid, nullptr, 0);
+
+    TGAImage image(width, height, TGAImage::RGB);
+    memcpy(image.buffer(), pixels, size_t(width) * height * TGAImage::RGB);
+    shm.unlink();
+
+    if (verify) {
+        // 同样的场景在一个进程中完整绘制
+        Scene scene(width, height);
+        RenderContext context(width, height);
+        context.clear();
+        scene.begin_frame(context);
+        context.draw(scene.shader, scene.model);
+        context.resolve();
+        bool same = memcmp(context.image().buffer(), image.buffer(), size_t(width) * height * TGAImage::RGB) == 0;
+        cout << "single process: " << (same ? "identical" : "DIFFERENT") << endl;
+        if (!same) return 1;
+    }
+    return image.write_tga_file(output.c_str()) ? 0 : 1;
+}
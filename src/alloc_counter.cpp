@@ -0,0 +1,65 @@
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include "alloc_counter.h"
+
+using namespace std;
+
+
+#ifdef RENDER_ALLOC_COUNTER
+
+namespace {
+    atomic<uint64_t> g_count(0);
+    atomic<uint64_t> g_bytes(0);
+
+    void *counted_alloc(size_t size) {
+        g_count.fetch_add(1, memory_order_relaxed);
+        g_bytes.fetch_add(size, memory_order_relaxed);
+        return malloc(size ? size : 1);
+    }
+}
+
+void *operator new(size_t size) {
+    void *p = counted_alloc(size);
+    if (!p) throw bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size) {
+    void *p = counted_alloc(size);
+    if (!p) throw bad_alloc();
+    return p;
+}
+
+void *operator new(size_t size, const nothrow_t &) noexcept {
+    return counted_alloc(size);
+}
+
+void *operator new[](size_t size, const nothrow_t &) noexcept {
+    return counted_alloc(size);
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+void operator delete[](void *p) noexcept { free(p); }
+
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+bool alloc_counter_enabled() { return true; }
+
+uint64_t alloc_count() { return g_count.load(memory_order_relaxed); }
+
+uint64_t alloc_bytes() { return g_bytes.load(memory_order_relaxed); }
+
+#else
+
+bool alloc_counter_enabled() { return false; }
+
+uint64_t alloc_count() { return 0; }
+
+uint64_t alloc_bytes() { return 0; }
+
+#endif
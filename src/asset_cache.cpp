@@ -0,0 +1,55 @@
+
+#include "asset_cache.h"
+
+using namespace std;
+
+
+/* 读取贴图并翻转，失败时 image 为空 */
+static void read_texture(const string &filename, TGAImage &image) {
+    if (filename.empty()) return;
+    if (image.read_tga_file(filename))
+        image.flip_vertically();
+}
+
+AssetFuture<Model> AssetCache::model_async(const string &filename, bool textures) {
+    lock_guard<mutex> lock(mutex_);
+    AssetFuture<Model> &entry = models_[make_pair(filename, textures)];
+    if (entry.valid()) return entry;
+
+    // 网格和贴图同时载入，最后一个任务把贴图交给模型；对象先分配，任务在原处填写
+    shared_ptr<Model> model = make_shared<Model>();
+    bool optimize = optimize_models;
+    auto mesh = scheduler_.submit([model, filename, optimize]() {
+        *model = Model(filename, false);
+        if (optimize) model->optimize();
+    });
+    if (!textures) {
+        entry = AssetFuture<Model>(model, &scheduler_, mesh);
+        return entry;
+    }
+    const char *suffixes[3] = {"_diffuse.tga", "_nm_tangent.tga", "_spec.tga"};
+    shared_ptr<TGAImage> maps[3];
+    TaskScheduler::TaskHandle loads[4] = {mesh};
+    for (int i = 0; i < 3; ++i) {
+        maps[i] = make_shared<TGAImage>();
+        string texture = Model::texture_filename(filename, suffixes[i]);
+        shared_ptr<TGAImage> map = maps[i];
+        loads[i + 1] = scheduler_.submit([map, texture]() { read_texture(texture, *map); });
+    }
+    auto done = scheduler_.submit([model, maps]() {
+        model->set_textures(move(*maps[0]), move(*maps[1]), move(*maps[2]));
+    }, loads, 4);
+    entry = AssetFuture<Model>(model, &scheduler_, done);
+    return entry;
+}
+
+AssetFuture<TGAImage> AssetCache::texture_async(const string &filename) {
+    lock_guard<mutex> lock(mutex_);
+    AssetFuture<TGAImage> &entry = textures_[filename];
+    if (entry.valid()) return entry;
+    shared_ptr<TGAImage> image = make_shared<TGAImage>();
+    entry = AssetFuture<TGAImage>(image, &scheduler_, scheduler_.submit([image, filename]() {
+        read_texture(filename, *image);
+    }));
+    return entry;
+}
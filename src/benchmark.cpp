@@ -0,0 +1,204 @@
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "benchmark.h"
+#include "task_scheduler.h"
+
+using namespace std;
+
+
+double BenchmarkResult::percentile(double p) const {
+    if (samples.empty()) return 0;
+    vector<double> sorted = samples;
+    sort(sorted.begin(), sorted.end());
+    double pos = p / 100 * (sorted.size() - 1);
+    size_t i = min(sorted.size() - 1, size_t(pos));
+    size_t j = min(sorted.size() - 1, i + 1);
+    return sorted[i] + (sorted[j] - sorted[i]) * (pos - i);
+}
+
+double BenchmarkResult::mean() const {
+    if (samples.empty()) return 0;
+    double sum = 0;
+    for (double s : samples) sum += s;
+    return sum / samples.size();
+}
+
+double BenchmarkResult::variance() const {
+    if (samples.size() < 2) return 0;
+    double m = mean(), sum = 0;
+    for (double s : samples) sum += (s - m) * (s - m);
+    return sum / (samples.size() - 1);
+}
+
+
+bool Benchmark::enabled(const string &name) const {
+    return filter.empty() || name.find(filter) != string::npos;
+}
+
+void Benchmark::add(BenchmarkResult result) {
+    cerr << left << setw(48) << result.name << " " << result.threads << " threads  median "
+         << result.median() << " " << result.unit << "  (" << result.samples.size() << " samples, p90 "
+         << result.percentile(90) << ")" << endl;
+    results_.push_back(move(result));
+}
+
+void Benchmark::micro(const string &name, const function<void(long)> &body) {
+    if (!enabled(name)) return;
+    using clock = chrono::steady_clock;
+    auto time_ns = [&](long n) {
+        auto start = clock::now();
+        body(n);
+        return double(chrono::duration_cast<chrono::nanoseconds>(clock::now() - start).count());
+    };
+
+    // 预热，同时把迭代次数加倍到一个样本至少 1 ms
+    long n = 1;
+    while (time_ns(n) < 1e6 && n < (1L << 40))
+        n *= 2;
+
+    BenchmarkResult result;
+    result.name = name;
+    result.threads = threads;
+    result.unit = "ns";
+    result.iterations = n;
+    double total_ms = 0;
+    while (int(result.samples.size()) < max_samples &&
+           (int(result.samples.size()) < min_samples || total_ms < min_time_ms)) {
+        double ns = time_ns(n);
+        result.samples.push_back(ns / n);
+        total_ms += ns / 1e6;
+    }
+    add(move(result));
+}
+
+void Benchmark::macro(const string &name, const function<void()> &body) {
+    if (!enabled(name)) return;
+    using clock = chrono::steady_clock;
+    body();
+
+    BenchmarkResult result;
+    result.name = name;
+    result.threads = threads;
+    result.unit = "ms";
+    result.iterations = 1;
+    double total_ms = 0;
+    while (int(result.samples.size()) < max_samples &&
+           (int(result.samples.size()) < min_samples || total_ms < min_time_ms)) {
+        auto start = clock::now();
+        body();
+        double ms = chrono::duration<double, milli>(clock::now() - start).count();
+        result.samples.push_back(ms);
+        total_ms += ms;
+    }
+    add(move(result));
+}
+
+bool Benchmark::run_isolated(int n_threads, const function<void(Benchmark &)> &fn) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return false;
+    }
+    cout.flush();
+    cerr.flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        // 子进程：每个结果一行，名字、线程数、单位、迭代次数和样本用制表符分开
+        close(fds[0]);
+        TaskScheduler::set_global_threads(n_threads);
+        Benchmark child = *this;
+        child.results_.clear();
+        child.threads = n_threads;
+        fn(child);
+        ostringstream out;
+        out << setprecision(17);
+        for (const BenchmarkResult &r : child.results_) {
+            out << r.name << '\t' << r.threads << '\t' << r.unit << '\t' << r.iterations;
+            for (double s : r.samples) out << '\t' << s;
+            out << '\n';
+        }
+        string data = out.str();
+        for (size_t written = 0; written < data.size();) {
+            ssize_t k = write(fds[1], data.data() + written, data.size() - written);
+            if (k <= 0) _exit(1);
+            written += size_t(k);
+        }
+        close(fds[1]);
+        cerr.flush();
+        _exit(0);
+    }
+
+    close(fds[1]);
+    string data;
+    char buf[4096];
+    ssize_t k;
+    while ((k = read(fds[0], buf, sizeof(buf))) > 0)
+        data.append(buf, size_t(k));
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        cerr << "benchmark process with " << n_threads << " threads failed" << endl;
+        return false;
+    }
+
+    istringstream in(data);
+    string line;
+    while (getline(in, line)) {
+        istringstream fields(line);
+        BenchmarkResult r;
+        string field;
+        getline(fields, r.name, '\t');
+        getline(fields, field, '\t');
+        r.threads = stoi(field);
+        getline(fields, r.unit, '\t');
+        getline(fields, field, '\t');
+        r.iterations = stol(field);
+        while (getline(fields, field, '\t'))
+            r.samples.push_back(stod(field));
+        results_.push_back(move(r));
+    }
+    return true;
+}
+
+void Benchmark::write_json(ostream &out) const {
+    out << "{\n  \"hardware_threads\": " << thread::hardware_concurrency() << ",\n  \"results\": [";
+    for (size_t i = 0; i < results_.size(); ++i) {
+        const BenchmarkResult &r = results_[i];
+        out << (i ? "," : "") << "\n    {\"name\": \"" << r.name << "\", \"threads\": " << r.threads
+            << ", \"unit\": \"" << r.unit << "\", \"iterations\": " << r.iterations
+            << ", \"samples\": " << r.samples.size()
+            << ", \"min\": " << r.percentile(0) << ", \"p10\": " << r.percentile(10)
+            << ", \"median\": " << r.median() << ", \"p90\": " << r.percentile(90)
+            << ", \"p99\": " << r.percentile(99) << ", \"max\": " << r.percentile(100)
+            << ", \"mean\": " << r.mean() << ", \"variance\": " << r.variance()
+            << ", \"stddev\": " << sqrt(r.variance()) << "}";
+    }
+    out << "\n  ]\n}" << endl;
+}
+
+void Benchmark::write_csv(ostream &out) const {
+    out << "name,threads,unit,iterations,samples,min,p10,median,p90,p99,max,mean,variance,stddev\n";
+    for (const BenchmarkResult &r : results_) {
+        out << r.name << ',' << r.threads << ',' << r.unit << ',' << r.iterations << ',' << r.samples.size()
+            << ',' << r.percentile(0) << ',' << r.percentile(10) << ',' << r.median() << ','
+            << r.percentile(90) << ',' << r.percentile(99) << ',' << r.percentile(100) << ','
+            << r.mean() << ',' << r.variance() << ',' << sqrt(r.variance()) << '\n';
+    }
+    out.flush();
+}
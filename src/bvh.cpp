@@ -0,0 +1,440 @@
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "bvh.h"
+#include "hash.h"
+#include "task_scheduler.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+
+namespace {
+    const int SAH_BINS = 16;
+    const int MAX_LEAF_SIZE = 4;
+    const double TRAVERSAL_COST = 1.0;
+
+    // 大于这个数量的子树才交给另一个线程构建
+    const int PARALLEL_BUILD_MIN = 4096;
+    const int PARALLEL_BUILD_DEPTH = 4;
+
+    // 超过这个深度后改为按中位数划分，保证遍历栈不会溢出
+    const int MAX_SAH_DEPTH = 40;
+
+    struct Bounds {
+        float bmin[3] = {numeric_limits<float>::max(), numeric_limits<float>::max(), numeric_limits<float>::max()};
+        float bmax[3] = {-numeric_limits<float>::max(), -numeric_limits<float>::max(), -numeric_limits<float>::max()};
+
+        void grow(const float p[3]) {
+            for (int i = 0; i < 3; ++i) {
+                bmin[i] = min(bmin[i], p[i]);
+                bmax[i] = max(bmax[i], p[i]);
+            }
+        }
+
+        void grow(const Bounds &b) {
+            grow(b.bmin);
+            grow(b.bmax);
+        }
+
+        double area() const {
+            double d[3];
+            for (int i = 0; i < 3; ++i) d[i] = max(0.f, bmax[i] - bmin[i]);
+            return 2 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+        }
+    };
+}
+
+struct BVH::BuildPrim {
+    Bounds bounds;
+    float centroid[3];
+    int tri;
+};
+
+
+void RayPacket4::set(int i, const vec3 &origin, const vec3 &dir, double t_min, double t_max) {
+    // 方向分量为 0 时 1/d 是无穷大，和包围盒的边界相乘会得到 NaN，这里替换为很小的数
+    auto safe = [](double d) { return std::abs(d) < 1e-12 ? (d < 0 ? -1e-12 : 1e-12) : d; };
+    ox[i] = float(origin.x);
+    oy[i] = float(origin.y);
+    oz[i] = float(origin.z);
+    dx[i] = float(safe(dir.x));
+    dy[i] = float(safe(dir.y));
+    dz[i] = float(safe(dir.z));
+    tmin[i] = float(t_min);
+    tmax[i] = float(t_max);
+}
+
+
+BVH::BVH(const Model &model, const mat<4, 4> &model_matrix, bool parallel) {
+    int n = model.nfaces();
+    vector<BuildPrim> prims(n);
+    vector<Tri> world_tris(n);
+
+    for (int f = 0; f < n; ++f) {
+        float v[3][3];
+        for (int j = 0; j < 3; ++j) {
+            vec3 p = proj<3>(model_matrix * embed<4>(model.vert(f, j)));
+            for (int k = 0; k < 3; ++k) v[j][k] = float(p[k]);
+        }
+        BuildPrim &prim = prims[f];
+        prim.tri = f;
+        for (int j = 0; j < 3; ++j) prim.bounds.grow(v[j]);
+        for (int k = 0; k < 3; ++k) {
+            prim.centroid[k] = (v[0][k] + v[1][k] + v[2][k]) / 3;
+            world_tris[f].v0[k] = v[0][k];
+            world_tris[f].e1[k] = v[1][k] - v[0][k];
+            world_tris[f].e2[k] = v[2][k] - v[0][k];
+        }
+    }
+
+    if (n > 0)
+        nodes_ = build(prims, 0, n, 0, parallel);
+
+    // 三角形按叶子的顺序重新排列，遍历叶子时是连续访问
+    tris_.resize(n);
+    for (int i = 0; i < n; ++i)
+        tris_[i] = world_tris[prims[i].tri];
+
+    // 按原来的顺序哈希，和构建的划分无关
+    Hasher h;
+    h.bytes(world_tris.data(), world_tris.size() * sizeof(Tri));
+    hash_ = h.value();
+}
+
+vector<BVH::Node> BVH::build(vector<BuildPrim> &prims, int begin, int end, int depth, bool parallel) {
+    Bounds bounds, centroid_bounds;
+    for (int i = begin; i < end; ++i) {
+        bounds.grow(prims[i].bounds);
+        centroid_bounds.grow(prims[i].centroid);
+    }
+
+    Node node{};
+    for (int k = 0; k < 3; ++k) {
+        node.bmin[k] = bounds.bmin[k];
+        node.bmax[k] = bounds.bmax[k];
+    }
+    int n = end - begin;
+    if (n <= 2) {
+        node.first = begin;
+        node.count = n;
+        return {node};
+    }
+
+    // 分桶计算 SAH，寻找代价最小的轴和划分位置
+    int best_axis = -1;
+    int best_split = 0;
+    double best_cost = numeric_limits<double>::max();
+    for (int axis = 0; axis < 3; ++axis) {
+        float lo = centroid_bounds.bmin[axis];
+        float extent = centroid_bounds.bmax[axis] - lo;
+        if (extent <= 0) continue;
+
+        Bounds bins[SAH_BINS];
+        int counts[SAH_BINS] = {0};
+        for (int i = begin; i < end; ++i) {
+            int b = min(SAH_BINS - 1, int(SAH_BINS * (prims[i].centroid[axis] - lo) / extent));
+            bins[b].grow(prims[i].bounds);
+            ++counts[b];
+        }
+
+        // 从右向左累积，得到每个划分位置右边的面积和数量
+        double right_area[SAH_BINS];
+        int right_count[SAH_BINS];
+        Bounds acc;
+        int cnt = 0;
+        for (int b = SAH_BINS - 1; b > 0; --b) {
+            acc.grow(bins[b]);
+            cnt += counts[b];
+            right_area[b] = cnt ? acc.area() : 0;
+            right_count[b] = cnt;
+        }
+        acc = Bounds();
+        cnt = 0;
+        for (int b = 1; b < SAH_BINS; ++b) {
+            acc.grow(bins[b - 1]);
+            cnt += counts[b - 1];
+            if (cnt == 0 || right_count[b] == 0) continue;
+            double cost = acc.area() * cnt + right_area[b] * right_count[b];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = b;
+            }
+        }
+    }
+
+    int mid;
+    if (best_axis >= 0 && depth < MAX_SAH_DEPTH) {
+        // 和不划分相比，划分的代价更高并且三角形足够少时，做成叶子
+        double split_cost = TRAVERSAL_COST + best_cost / bounds.area();
+        if (split_cost >= n && n <= MAX_LEAF_SIZE) {
+            node.first = begin;
+            node.count = n;
+            return {node};
+        }
+        float lo = centroid_bounds.bmin[best_axis];
+        float extent = centroid_bounds.bmax[best_axis] - lo;
+        auto it = partition(prims.begin() + begin, prims.begin() + end, [&](const BuildPrim &p) {
+            return min(SAH_BINS - 1, int(SAH_BINS * (p.centroid[best_axis] - lo) / extent)) < best_split;
+        });
+        mid = int(it - prims.begin());
+    } else {
+        // 所有三角形的中心重合，或者树太深，在中心包围盒最长的轴上按中位数划分
+        if (n <= MAX_LEAF_SIZE) {
+            node.first = begin;
+            node.count = n;
+            return {node};
+        }
+        best_axis = 0;
+        for (int k = 1; k < 3; ++k) {
+            if (centroid_bounds.bmax[k] - centroid_bounds.bmin[k] >
+                centroid_bounds.bmax[best_axis] - centroid_bounds.bmin[best_axis])
+                best_axis = k;
+        }
+        mid = begin + n / 2;
+        nth_element(prims.begin() + begin, prims.begin() + mid, prims.begin() + end,
+                    [best_axis](const BuildPrim &a, const BuildPrim &b) {
+                        return a.centroid[best_axis] < b.centroid[best_axis];
+                    });
+    }
+
+    vector<Node> left, right;
+    if (parallel && n > PARALLEL_BUILD_MIN && depth < PARALLEL_BUILD_DEPTH) {
+        // 左子树交给调度器，其他线程空闲时窃取；没有被窃取时由 wait 在当前线程执行
+        TaskScheduler &scheduler = TaskScheduler::global();
+        auto left_task = scheduler.submit([&]() { left = build(prims, begin, mid, depth + 1, parallel); });
+        right = build(prims, mid, end, depth + 1, parallel);
+        scheduler.wait(left_task);
+    } else {
+        left = build(prims, begin, mid, depth + 1, parallel);
+        right = build(prims, mid, end, depth + 1, parallel);
+    }
+
+    // 拼接成深度优先的顺序：父节点，左子树，右子树；子树内部的右孩子下标需要加上偏移
+    vector<Node> res;
+    res.reserve(1 + left.size() + right.size());
+    node.first = int(1 + left.size());
+    node.count = -best_axis - 1;
+    res.push_back(node);
+    for (Node child : left) {
+        if (child.count <= 0) child.first += 1;
+        res.push_back(child);
+    }
+    for (Node child : right) {
+        if (child.count <= 0) child.first += int(1 + left.size());
+        res.push_back(child);
+    }
+    return res;
+}
+
+
+bool BVH::occluded(const vec3 &origin, const vec3 &dir, double t_min, double t_max) const {
+    if (nodes_.empty()) return false;
+
+    float o[3], d[3], inv_d[3];
+    for (int k = 0; k < 3; ++k) {
+        o[k] = float(origin[k]);
+        d[k] = float(dir[k]);
+        inv_d[k] = 1.f / (std::abs(d[k]) < 1e-12f ? (d[k] < 0 ? -1e-12f : 1e-12f) : d[k]);
+    }
+    float tmin = float(t_min), tmax = float(t_max);
+
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const Node &node = nodes_[stack[--top]];
+
+        // slab 方法与包围盒求交
+        float t0 = tmin, t1 = tmax;
+        for (int k = 0; k < 3; ++k) {
+            float ta = (node.bmin[k] - o[k]) * inv_d[k];
+            float tb = (node.bmax[k] - o[k]) * inv_d[k];
+            t0 = max(t0, min(ta, tb));
+            t1 = min(t1, max(ta, tb));
+        }
+        if (t0 > t1) continue;
+
+        if (node.count > 0) {
+            // Möller–Trumbore 求交，只需要知道是否相交
+            for (int i = node.first; i < node.first + node.count; ++i) {
+                const Tri &tri = tris_[i];
+                float p[3] = {d[1] * tri.e2[2] - d[2] * tri.e2[1],
+                              d[2] * tri.e2[0] - d[0] * tri.e2[2],
+                              d[0] * tri.e2[1] - d[1] * tri.e2[0]};
+                float det = tri.e1[0] * p[0] + tri.e1[1] * p[1] + tri.e1[2] * p[2];
+                if (std::abs(det) < 1e-12f) continue;
+                float inv_det = 1.f / det;
+                float s[3] = {o[0] - tri.v0[0], o[1] - tri.v0[1], o[2] - tri.v0[2]};
+                float u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inv_det;
+                if (u < 0 || u > 1) continue;
+                float q[3] = {s[1] * tri.e1[2] - s[2] * tri.e1[1],
+                              s[2] * tri.e1[0] - s[0] * tri.e1[2],
+                              s[0] * tri.e1[1] - s[1] * tri.e1[0]};
+                float v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * inv_det;
+                if (v < 0 || u + v > 1) continue;
+                float t = (tri.e2[0] * q[0] + tri.e2[1] * q[1] + tri.e2[2] * q[2]) * inv_det;
+                if (t > tmin && t < tmax) return true;
+            }
+        } else {
+            // 先访问光线方向上较近的孩子
+            int axis = -node.count - 1;
+            int near_child = int(&node - nodes_.data()) + 1;
+            int far_child = node.first;
+            if (d[axis] < 0) swap(near_child, far_child);
+            stack[top++] = far_child;
+            stack[top++] = near_child;
+        }
+    }
+    return false;
+}
+
+
+#ifdef __SSE2__
+
+int BVH::occluded4(const RayPacket4 &packet, int active) const {
+    if (nodes_.empty() || !active) return 0;
+
+    __m128 o[3] = {_mm_loadu_ps(packet.ox), _mm_loadu_ps(packet.oy), _mm_loadu_ps(packet.oz)};
+    __m128 d[3] = {_mm_loadu_ps(packet.dx), _mm_loadu_ps(packet.dy), _mm_loadu_ps(packet.dz)};
+    __m128 inv_d[3];
+    for (int k = 0; k < 3; ++k) inv_d[k] = _mm_div_ps(_mm_set1_ps(1.f), d[k]);
+    const __m128 tmin = _mm_loadu_ps(packet.tmin);
+    const __m128 tmax = _mm_loadu_ps(packet.tmax);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 eps = _mm_set1_ps(1e-12f);
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+
+    // 整个光线包按第一条活动光线的方向决定访问顺序
+    int lead = 0;
+    while (!(active >> lead & 1)) ++lead;
+    const float lead_d[3] = {packet.dx[lead], packet.dy[lead], packet.dz[lead]};
+
+    int hit = 0;
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const Node &node = nodes_[stack[--top]];
+
+        // 4 条光线同时与包围盒求交
+        __m128 t0 = tmin, t1 = tmax;
+        for (int k = 0; k < 3; ++k) {
+            __m128 ta = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmin[k]), o[k]), inv_d[k]);
+            __m128 tb = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmax[k]), o[k]), inv_d[k]);
+            t0 = _mm_max_ps(t0, _mm_min_ps(ta, tb));
+            t1 = _mm_min_ps(t1, _mm_max_ps(ta, tb));
+        }
+        int live = _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & active & ~hit;
+        if (!live) continue;
+
+        if (node.count > 0) {
+            for (int i = node.first; i < node.first + node.count; ++i) {
+                const Tri &tri = tris_[i];
+                __m128 e1[3], e2[3];
+                for (int k = 0; k < 3; ++k) {
+                    e1[k] = _mm_set1_ps(tri.e1[k]);
+                    e2[k] = _mm_set1_ps(tri.e2[k]);
+                }
+                __m128 p[3] = {_mm_sub_ps(_mm_mul_ps(d[1], e2[2]), _mm_mul_ps(d[2], e2[1])),
+                               _mm_sub_ps(_mm_mul_ps(d[2], e2[0]), _mm_mul_ps(d[0], e2[2])),
+                               _mm_sub_ps(_mm_mul_ps(d[0], e2[1]), _mm_mul_ps(d[1], e2[0]))};
+                __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1[0], p[0]), _mm_mul_ps(e1[1], p[1])),
+                                        _mm_mul_ps(e1[2], p[2]));
+                __m128 valid = _mm_cmpgt_ps(_mm_and_ps(det, abs_mask), eps);
+                __m128 inv_det = _mm_div_ps(one, det);
+                __m128 s[3];
+                for (int k = 0; k < 3; ++k) s[k] = _mm_sub_ps(o[k], _mm_set1_ps(tri.v0[k]));
+                __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(s[0], p[0]), _mm_mul_ps(s[1], p[1])),
+                                                 _mm_mul_ps(s[2], p[2])), inv_det);
+                __m128 q[3] = {_mm_sub_ps(_mm_mul_ps(s[1], e1[2]), _mm_mul_ps(s[2], e1[1])),
+                               _mm_sub_ps(_mm_mul_ps(s[2], e1[0]), _mm_mul_ps(s[0], e1[2])),
+                               _mm_sub_ps(_mm_mul_ps(s[0], e1[1]), _mm_mul_ps(s[1], e1[0]))};
+                __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], q[0]), _mm_mul_ps(d[1], q[1])),
+                                                 _mm_mul_ps(d[2], q[2])), inv_det);
+                __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2[0], q[0]), _mm_mul_ps(e2[1], q[1])),
+                                                 _mm_mul_ps(e2[2], q[2])), inv_det);
+                valid = _mm_and_ps(valid, _mm_cmpge_ps(u, zero));
+                valid = _mm_and_ps(valid, _mm_cmpge_ps(v, zero));
+                valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), one));
+                valid = _mm_and_ps(valid, _mm_cmpgt_ps(t, tmin));
+                valid = _mm_and_ps(valid, _mm_cmplt_ps(t, tmax));
+                hit |= _mm_movemask_ps(valid) & live;
+            }
+            if ((hit & active) == active) break;
+        } else {
+            int axis = -node.count - 1;
+            int near_child = int(&node - nodes_.data()) + 1;
+            int far_child = node.first;
+            if (lead_d[axis] < 0) swap(near_child, far_child);
+            stack[top++] = far_child;
+            stack[top++] = near_child;
+        }
+    }
+    return hit & active;
+}
+
+#else
+
+int BVH::occluded4(const RayPacket4 &packet, int active) const {
+    int hit = 0;
+    for (int i = 0; i < 4; ++i) {
+        if (!(active >> i & 1)) continue;
+        vec3 o(packet.ox[i], packet.oy[i], packet.oz[i]);
+        vec3 d(packet.dx[i], packet.dy[i], packet.dz[i]);
+        if (occluded(o, d, packet.tmin[i], packet.tmax[i])) hit |= 1 << i;
+    }
+    return hit;
+}
+
+#endif
+
+
+double BVH::ambient_occlusion(const vec3 &pos, const vec3 &normal, int n_samples, double radius,
+                              double t_min) const {
+    if (n_samples <= 0) return 1.;
+
+    // 以法线为 z 轴的正交基
+    vec3 n = normal;
+    n.normalize();
+    vec3 a = std::abs(n.x) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+    vec3 t = cross(a, n).normalize();
+    vec3 b = cross(n, t);
+
+    // 每个点的采样模式旋转一个由位置决定的角度，把条带变成噪声，同时保证结果可以重现
+    unsigned seed = unsigned(std::llround(pos.x * 73.) * 73856093LL ^ std::llround(pos.y * 73.) * 19349663LL
+                             ^ std::llround(pos.z * 73.) * 83492791LL);
+    double rotation = (seed % 1024) / 1024. * 2 * M_PI;
+
+    // Hammersley 点集，按余弦分布映射到半球
+    int n_occluded = 0;
+    RayPacket4 packet{};
+    for (int base = 0; base < n_samples; base += 4) {
+        int active = 0;
+        for (int i = 0; i < 4 && base + i < n_samples; ++i) {
+            int s = base + i;
+            unsigned bits = unsigned(s);
+            bits = (bits << 16u) | (bits >> 16u);
+            bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+            bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+            bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+            bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+            double u1 = (s + 0.5) / n_samples;
+            double u2 = bits * 2.3283064365386963e-10;
+            double r = std::sqrt(u1);
+            double phi = 2 * M_PI * u2 + rotation;
+            vec3 dir = t * (r * std::cos(phi)) + b * (r * std::sin(phi)) + n * std::sqrt(max(0., 1 - u1));
+            packet.set(i, pos, dir, t_min, radius);
+            active |= 1 << i;
+        }
+        int hit = occluded4(packet, active);
+        for (; hit; hit &= hit - 1) ++n_occluded;
+    }
+    return 1. - double(n_occluded) / n_samples;
+}
@@ -0,0 +1,53 @@
+
+#include <cassert>
+#include "dirty_region.h"
+
+using namespace std;
+
+
+void DirtyRegion::update(int instance, const ScreenRect &bounds) {
+    assert(instance >= 0);
+    if (size_t(instance) >= bounds_.size())
+        bounds_.resize(instance + 1);
+    ScreenRect &old = bounds_[instance];
+    if (old == bounds) return;
+    invalidate(old);
+    invalidate(bounds);
+    old = bounds;
+}
+
+void DirtyRegion::touch(int instance) {
+    invalidate(bounds(instance));
+}
+
+void DirtyRegion::remove(int instance) {
+    update(instance, ScreenRect());
+}
+
+ScreenRect DirtyRegion::bounds(int instance) const {
+    return size_t(instance) < bounds_.size() ? bounds_[instance] : ScreenRect();
+}
+
+void DirtyRegion::invalidate(const ScreenRect &rect) {
+    if (rect.empty()) return;
+
+    // 和已有的矩形相交时合并，合并之后可能又和其他矩形相交，直到没有相交的为止
+    ScreenRect r = rect;
+    for (size_t i = 0; i < dirty_.size();) {
+        if (dirty_[i].intersects(r)) {
+            r = r.united(dirty_[i]);
+            dirty_[i] = dirty_.back();
+            dirty_.pop_back();
+            i = 0;
+        } else {
+            ++i;
+        }
+    }
+    dirty_.push_back(r);
+}
+
+long DirtyRegion::area() const {
+    long sum = 0;
+    for (const ScreenRect &r : dirty_) sum += r.area();
+    return sum;
+}
@@ -0,0 +1,53 @@
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include "frame_arena.h"
+
+using namespace std;
+
+
+void *FrameArena::allocate(size_t bytes, size_t align) {
+    assert(align > 0 && (align & (align - 1)) == 0);
+
+    for (; current_ < blocks_.size(); ++current_, offset_ = 0) {
+        Block &block = blocks_[current_];
+        uintptr_t base = reinterpret_cast<uintptr_t>(block.data.get());
+        size_t begin = ((base + offset_ + align - 1) & ~uintptr_t(align - 1)) - base;
+        if (begin + bytes <= block.size) {
+            offset_ = begin + bytes;
+            return block.data.get() + begin;
+        }
+    }
+
+    // 所有的块都放不下，申请新的块
+    size_t size = max(block_size_, bytes + align);
+    blocks_.push_back({unique_ptr<unsigned char[]>(new unsigned char[size]), size});
+    current_ = blocks_.size() - 1;
+    offset_ = 0;
+    return allocate(bytes, align);
+}
+
+void FrameArena::reset() {
+    if (blocks_.size() > 1) {
+        size_t total = capacity();
+        blocks_.clear();
+        blocks_.push_back({unique_ptr<unsigned char[]>(new unsigned char[total]), total});
+    }
+    current_ = 0;
+    offset_ = 0;
+}
+
+size_t FrameArena::used() const {
+    size_t res = offset_;
+    for (size_t i = 0; i < current_ && i < blocks_.size(); ++i)
+        res += blocks_[i].size;
+    return res;
+}
+
+size_t FrameArena::capacity() const {
+    size_t res = 0;
+    for (const auto &block : blocks_)
+        res += block.size;
+    return res;
+}
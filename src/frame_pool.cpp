@@ -0,0 +1,67 @@
+
+#include "frame_pool.h"
+
+using namespace std;
+
+
+unique_ptr<RenderTarget> FramePool::acquire_target(int width, int height, int samples, RenderTarget::Layout layout) {
+    {
+        lock_guard<mutex> lock(mutex_);
+        for (auto it = targets_.begin(); it != targets_.end(); ++it) {
+            const RenderTarget &t = **it;
+            if (t.get_width() != width || t.get_height() != height ||
+                t.get_samples() != samples || t.get_layout() != layout)
+                continue;
+            unique_ptr<RenderTarget> res = move(*it);
+            targets_.erase(it);
+            res->clear();
+            return res;
+        }
+    }
+    return unique_ptr<RenderTarget>(new RenderTarget(width, height, samples, layout));
+}
+
+void FramePool::release(unique_ptr<RenderTarget> target) {
+    if (!target) return;
+    lock_guard<mutex> lock(mutex_);
+    targets_.push_back(move(target));
+}
+
+TGAImage FramePool::acquire_image(int width, int height, int bytespp) {
+    {
+        lock_guard<mutex> lock(mutex_);
+        for (auto it = images_.begin(); it != images_.end(); ++it) {
+            if (it->get_width() != width || it->get_height() != height || it->get_bytespp() != bytespp)
+                continue;
+            TGAImage res = move(*it);
+            images_.erase(it);
+            return res;
+        }
+    }
+    return TGAImage(width, height, bytespp);
+}
+
+void FramePool::release(TGAImage &&image) {
+    if (image.get_width() <= 0 || image.get_height() <= 0) return;
+    lock_guard<mutex> lock(mutex_);
+    images_.push_back(move(image));
+}
+
+unique_ptr<FrameArena> FramePool::acquire_arena() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (!arenas_.empty()) {
+            unique_ptr<FrameArena> res = move(arenas_.back());
+            arenas_.pop_back();
+            res->reset();
+            return res;
+        }
+    }
+    return unique_ptr<FrameArena>(new FrameArena());
+}
+
+void FramePool::release(unique_ptr<FrameArena> arena) {
+    if (!arena) return;
+    lock_guard<mutex> lock(mutex_);
+    arenas_.push_back(move(arena));
+}
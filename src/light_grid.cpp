@@ -0,0 +1,133 @@
+
+#include <cmath>
+#include <limits>
+#include "light_grid.h"
+#include "my_gl.h"
+#include "task_scheduler.h"
+
+using namespace std;
+
+
+void LightGrid::build(const RenderContext &context, const mat<4, 4> &view, const mat<4, 4> &projection) {
+    const RenderTarget &target = context.target();
+    tile_shift_ = RenderTarget::TILE_SHIFT;
+    tiles_x_ = target.tiles_x();
+    tiles_y_ = target.tiles_y();
+    const int n_tiles = tiles_x_ * tiles_y_;
+
+    // 深度缓冲中的值还原为视图坐标系的 z：ndc_z * w = p22 * z + p23, w = p32 * z + p33
+    auto view_z = [&projection](double screen_z) {
+        double ndc = (screen_z - Z_BUFFER_MIN) * 2 / (Z_BUFFER_MAX - Z_BUFFER_MIN) - 1;
+        return (projection[2][3] - ndc * projection[3][3]) / (ndc * projection[3][2] - projection[2][2]);
+    };
+
+    // 每个块的深度范围；深度缓冲的值是截断的，真实深度在 [z, z + 1) 之间
+    tile_z_min_.assign(n_tiles, numeric_limits<double>::infinity());
+    tile_z_max_.assign(n_tiles, -numeric_limits<double>::infinity());
+    const int samples = target.get_samples();
+    parallel_for(0, n_tiles, [&](int tile) {
+        int tx = tile % tiles_x_, ty = tile / tiles_x_;
+        // 没有绘制过的块不会有片段
+        if (target.tile_cleared(tx, ty)) return;
+        int z_min = Z_BUFFER_MAX, z_max = Z_BUFFER_MIN;
+        int x1 = min(target.get_width(), (tx + 1) << tile_shift_);
+        int y1 = min(target.get_height(), (ty + 1) << tile_shift_);
+        for (int y = ty << tile_shift_; y < y1; ++y) {
+            for (int x = tx << tile_shift_; x < x1; ++x) {
+                size_t i = target.index(x, y);
+                for (int s = 0; s < samples; ++s) {
+                    z_min = min(z_min, int(target.depth(i + s)));
+                    z_max = max(z_max, int(target.depth(i + s)));
+                }
+            }
+        }
+        double za = view_z(z_min), zb = view_z(min(z_max + 1, int(Z_BUFFER_MAX)));
+        tile_z_min_[tile] = min(za, zb);
+        tile_z_max_[tile] = max(za, zb);
+    }, context.parallel);
+
+    // 近平面前方的点的 w 的符号
+    double near_z = view_z(Z_BUFFER_MIN);
+    double front_w = projection[3][2] * near_z + projection[3][3];
+
+    // 每个光源在屏幕上覆盖的块：包围球在视图坐标系中的包围盒的 8 个角投影之后的范围；
+    // 包围盒跨过近平面时覆盖整个屏幕
+    light_rect_.resize(lights_.size() * 4);
+    for (size_t l = 0; l < lights_.size(); ++l) {
+        const PointLight &light = lights_[l];
+        vec3 c = proj<3>(view * embed<4>(light.pos));
+        double r = light.radius;
+        double x_min = numeric_limits<double>::infinity(), y_min = x_min;
+        double x_max = -x_min, y_max = -x_min;
+        bool full = false;
+        for (int k = 0; k < 8 && !full; ++k) {
+            vec3 corner(c.x + (k & 1 ? r : -r), c.y + (k & 2 ? r : -r), c.z + (k & 4 ? r : -r));
+            vec4 clip = projection * embed<4>(corner);
+            if (clip[3] * front_w <= 0 || clip[2] / clip[3] < -1) {
+                full = true;
+                break;
+            }
+            vec3 s = context.to_screen(clip);
+            x_min = min(x_min, s.x);
+            x_max = max(x_max, s.x);
+            y_min = min(y_min, s.y);
+            y_max = max(y_max, s.y);
+        }
+        int *rect = &light_rect_[l * 4];
+        if (full) {
+            rect[0] = 0;
+            rect[1] = 0;
+            rect[2] = tiles_x_ - 1;
+            rect[3] = tiles_y_ - 1;
+            continue;
+        }
+        // 多重采样的采样点偏离像素最多半个像素，留出一个像素
+        int px0 = max(0, int(std::floor(x_min)) - 1), py0 = max(0, int(std::floor(y_min)) - 1);
+        int px1 = min(target.get_width() - 1, int(std::ceil(x_max)) + 1);
+        int py1 = min(target.get_height() - 1, int(std::ceil(y_max)) + 1);
+        if (px0 > px1 || py0 > py1) {
+            rect[0] = rect[1] = 0;
+            rect[2] = rect[3] = -1;
+            continue;
+        }
+        rect[0] = px0 >> tile_shift_;
+        rect[1] = py0 >> tile_shift_;
+        rect[2] = px1 >> tile_shift_;
+        rect[3] = py1 >> tile_shift_;
+    }
+
+    // 两遍：先统计每个块的光源数，再按光源顺序填入，块内的下标是升序的
+    offsets_.assign(n_tiles + 1, 0);
+    for (int pass = 0; pass < 2; ++pass) {
+        for (size_t l = 0; l < lights_.size(); ++l) {
+            const int *rect = &light_rect_[l * 4];
+            vec3 c = proj<3>(view * embed<4>(lights_[l].pos));
+            double z0 = c.z - lights_[l].radius, z1 = c.z + lights_[l].radius;
+            for (int ty = rect[1]; ty <= rect[3]; ++ty) {
+                for (int tx = rect[0]; tx <= rect[2]; ++tx) {
+                    int tile = ty * tiles_x_ + tx;
+                    if (z1 < tile_z_min_[tile] || z0 > tile_z_max_[tile]) continue;
+                    if (pass == 0) ++offsets_[tile + 1];
+                    else indices_[cursor_[tile]++] = int(l);
+                }
+            }
+        }
+        if (pass == 0) {
+            for (int tile = 0; tile < n_tiles; ++tile)
+                offsets_[tile + 1] += offsets_[tile];
+            indices_.resize(offsets_[n_tiles]);
+            cursor_.assign(offsets_.begin(), offsets_.end() - 1);
+        }
+    }
+}
+
+double LightGrid::average_lights_per_tile() const {
+    int n_tiles = tiles_x_ * tiles_y_;
+    return n_tiles ? double(indices_.size()) / n_tiles : 0.;
+}
+
+void LightGrid::hash(Hasher &h) const {
+    h << int(lights_.size());
+    for (const auto &light : lights_)
+        h << light.pos << light.color << light.radius;
+}
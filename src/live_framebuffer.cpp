@@ -0,0 +1,175 @@
+
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include "live_framebuffer.h"
+
+using namespace std;
+
+
+static size_t bitmap_words(int tiles) {
+    return (size_t(tiles) + 63) / 64;
+}
+
+bool LiveFramebuffer::create(const string &name, int width, int height) {
+    assert(width > 0 && height > 0);
+    int tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    size_t offset = sizeof(LiveFramebufferHeader) + bitmap_words(tiles_x * tiles_y) * sizeof(uint64_t);
+    offset = (offset + 63) & ~size_t(63);
+    if (!shm_.create(name, offset + size_t(width) * height * 4))
+        return false;
+
+    // 新建的段全部为 0：帧号 0，位图为空，像素为清空值
+    LiveFramebufferHeader *h = new(shm_.data()) LiveFramebufferHeader();
+    h->pixels_offset = uint32_t(offset);
+    h->width = width;
+    h->height = height;
+    h->tile_size = TILE_SIZE;
+    h->tiles_x = tiles_x;
+    h->tiles_y = tiles_y;
+    h->sequence.store(0, memory_order_relaxed);
+    // magic 最后写入，查看器看到 magic 时其余的字段已经有效
+    atomic_thread_fence(memory_order_release);
+    memcpy(h->magic, "LFB1", 4);
+    return true;
+}
+
+bool LiveFramebuffer::open(const string &name) {
+    if (!shm_.open(name, false))
+        return false;
+    const LiveFramebufferHeader *h = header();
+    if (shm_.size() < sizeof(LiveFramebufferHeader) || memcmp(h->magic, "LFB1", 4) != 0 ||
+        shm_.size() < h->pixels_offset + size_t(h->width) * h->height * 4) {
+        cerr << "not a live framebuffer: " << name << endl;
+        shm_.close();
+        return false;
+    }
+    return true;
+}
+
+void LiveFramebuffer::write_begin() {
+    LiveFramebufferHeader *h = writable_header();
+    h->sequence.store(h->sequence.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+void LiveFramebuffer::write_end() {
+    LiveFramebufferHeader *h = writable_header();
+    h->sequence.store(h->sequence.load(memory_order_relaxed) + 1, memory_order_release);
+}
+
+void LiveFramebuffer::begin_frame() {
+    LiveFramebufferHeader *h = writable_header();
+    write_begin();
+    ++h->frame;
+    h->complete = 0;
+    memset(bitmap(), 0, bitmap_words(h->tiles_x * h->tiles_y) * sizeof(uint64_t));
+    write_end();
+}
+
+ScreenRect LiveFramebuffer::tile_rect(const ScreenRect &rect) {
+    LiveFramebufferHeader *h = writable_header();
+    ScreenRect r = rect.intersected(ScreenRect(0, 0, h->width - 1, h->height - 1));
+    if (r.empty()) return r;
+
+    // 扩展到整块
+    int tx0 = r.x0 / TILE_SIZE, ty0 = r.y0 / TILE_SIZE;
+    int tx1 = r.x1 / TILE_SIZE, ty1 = r.y1 / TILE_SIZE;
+    uint64_t *bits = bitmap();
+    for (int ty = ty0; ty <= ty1; ++ty)
+        for (int tx = tx0; tx <= tx1; ++tx) {
+            size_t i = size_t(ty) * h->tiles_x + tx;
+            bits[i / 64] |= uint64_t(1) << (i % 64);
+        }
+    return {tx0 * TILE_SIZE, ty0 * TILE_SIZE,
+            min(h->width - 1, (tx1 + 1) * TILE_SIZE - 1), min(h->height - 1, (ty1 + 1) * TILE_SIZE - 1)};
+}
+
+void LiveFramebuffer::publish(const RenderTarget &target, const ScreenRect &rect) {
+    LiveFramebufferHeader *h = writable_header();
+    assert(target.get_width() == h->width && target.get_height() == h->height);
+    uint8_t *data = pixels();
+    write_begin();
+    ScreenRect r = tile_rect(rect);
+    for (int y = r.y0; y <= r.y1; ++y)
+        target.resolve_span(y, r.x0, r.x1, data + (size_t(y) * h->width + r.x0) * 4, TGAImage::RGBA);
+    write_end();
+}
+
+void LiveFramebuffer::publish(const TGAImage &image, const ScreenRect &rect) {
+    LiveFramebufferHeader *h = writable_header();
+    assert(image.get_width() == h->width && image.get_height() == h->height);
+    int bytespp = image.get_bytespp();
+    assert(bytespp == TGAImage::RGB || bytespp == TGAImage::RGBA);
+    uint8_t *data = pixels();
+    write_begin();
+    ScreenRect r = tile_rect(rect);
+    for (int y = r.y0; y <= r.y1; ++y) {
+        const uint8_t *src = image.buffer() + (size_t(y) * h->width + r.x0) * bytespp;
+        uint8_t *dst = data + (size_t(y) * h->width + r.x0) * 4;
+        if (bytespp == TGAImage::RGBA) {
+            memcpy(dst, src, size_t(r.x1 - r.x0 + 1) * 4);
+            continue;
+        }
+        for (int x = r.x0; x <= r.x1; ++x, src += 3, dst += 4) {
+            memcpy(dst, src, 3);
+            dst[3] = 255;
+        }
+    }
+    write_end();
+}
+
+void LiveFramebuffer::end_frame() {
+    write_begin();
+    writable_header()->complete = 1;
+    write_end();
+}
+
+uint32_t LiveFramebuffer::read_begin() const {
+    uint32_t seq;
+    while ((seq = header()->sequence.load(memory_order_acquire)) & 1);
+    return seq;
+}
+
+bool LiveFramebuffer::read_retry(uint32_t seq) const {
+    atomic_thread_fence(memory_order_acquire);
+    return header()->sequence.load(memory_order_relaxed) != seq;
+}
+
+bool LiveFramebuffer::snapshot(TGAImage &image, uint64_t *frame, bool *complete, vector<bool> *dirty,
+                               int max_retries) const {
+    const LiveFramebufferHeader *h = header();
+    int width = h->width, height = h->height;
+    if (image.get_width() != width || image.get_height() != height ||
+        (image.get_bytespp() != TGAImage::RGB && image.get_bytespp() != TGAImage::RGBA))
+        image = TGAImage(width, height, TGAImage::RGB);
+    int bytespp = image.get_bytespp();
+    uint8_t *dst = image.buffer();
+    size_t n_pixels = size_t(width) * height;
+
+    for (int attempt = 0; attempt <= max_retries; ++attempt) {
+        uint32_t seq = read_begin();
+        if (bytespp == TGAImage::RGBA) {
+            memcpy(dst, pixels(), n_pixels * 4);
+        } else {
+            const uint8_t *src = pixels();
+            for (size_t i = 0; i < n_pixels; ++i)
+                memcpy(dst + i * 3, src + i * 4, 3);
+        }
+        uint64_t f = h->frame;
+        bool c = h->complete != 0;
+        if (dirty) {
+            dirty->assign(size_t(h->tiles_x) * h->tiles_y, false);
+            for (int ty = 0; ty < h->tiles_y; ++ty)
+                for (int tx = 0; tx < h->tiles_x; ++tx)
+                    (*dirty)[size_t(ty) * h->tiles_x + tx] = tile_dirty(tx, ty);
+        }
+        if (read_retry(seq)) continue;
+        if (frame) *frame = f;
+        if (complete) *complete = c;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,47 @@
+
+#include <algorithm>
+#include <cmath>
+#include "mipmap.h"
+
+using namespace std;
+
+
+Mipmap::Mipmap(const TGAImage &image) {
+    levels_.push_back(image);
+    if (image.get_width() <= 0 || image.get_height() <= 0) return;
+
+    while (levels_.back().get_width() > 1 || levels_.back().get_height() > 1) {
+        const TGAImage &src = levels_.back();
+        int w = max(1, src.get_width() / 2);
+        int h = max(1, src.get_height() / 2);
+        int bpp = src.get_bytespp();
+        TGAImage dst(w, h, bpp);
+        for (int y = 0; y < h; ++y) {
+            for (int x = 0; x < w; ++x) {
+                // 原图的宽或高为 1 时，对应方向上只有一个像素
+                int x1 = min(2 * x + 1, src.get_width() - 1);
+                int y1 = min(2 * y + 1, src.get_height() - 1);
+                TGAColor c[4] = {src.get(2 * x, 2 * y), src.get(x1, 2 * y), src.get(2 * x, y1), src.get(x1, y1)};
+                TGAColor res = c[0];
+                for (int i = 0; i < bpp; ++i)
+                    res[i] = (c[0][i] + c[1][i] + c[2][i] + c[3][i] + 2) / 4;
+                dst.set(x, y, res);
+            }
+        }
+        levels_.push_back(dst);
+    }
+}
+
+double Mipmap::lod(const vec2 &duv_dx, const vec2 &duv_dy) const {
+    double w = levels_[0].get_width(), h = levels_[0].get_height();
+    double lx = vec2(duv_dx.x * w, duv_dx.y * h).norm2();
+    double ly = vec2(duv_dy.x * w, duv_dy.y * h).norm2();
+    double rho2 = max(lx, ly);
+    return rho2 > 1 ? 0.5 * std::log2(rho2) : 0.;
+}
+
+TGAColor Mipmap::sample(const vec2 &uv, double lod) const {
+    int i = min(levels() - 1, max(0, int(std::lround(lod))));
+    const TGAImage &img = levels_[i];
+    return img.get(uv[0] * img.get_width(), uv[1] * img.get_height());
+}
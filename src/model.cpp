@@ -1,9 +1,20 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
 #include <iostream>
 #include <fstream>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <queue>
 #include <sstream>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
 #include "model.h"
+#include "hash.h"
 
-Model::Model(const std::string filename) : verts_(), uv_(), norms_(), facet_vrt_(), facet_tex_(), facet_nrm_(), diffusemap_(), normalmap_(), specularmap_() {
+Model::Model(const std::string filename, const bool textures) : verts_(), uv_(), norms_(), facet_vrt_(), facet_tex_(), facet_nrm_(), diffusemap_(), normalmap_(), specularmap_() {
     std::ifstream in;
     in.open (filename, std::ifstream::in);
     if (in.fail()) return;
@@ -46,9 +57,60 @@ Model::Model(const std::string filename) : verts_(), uv_(), norms_(), facet_vrt_
     }
     in.close();
     std::cerr << "# v# " << nverts() << " f# "  << nfaces() << " vt# " << uv_.size() << " vn# " << norms_.size() << std::endl;
-    load_texture(filename, "_diffuse.tga",    diffusemap_);
-    load_texture(filename, "_nm_tangent.tga", normalmap_);
-    load_texture(filename, "_spec.tga",       specularmap_);
+    if (textures) {
+        load_texture(filename, "_diffuse.tga",    diffusemap_);
+        load_texture(filename, "_nm_tangent.tga", normalmap_);
+        load_texture(filename, "_spec.tga",       specularmap_);
+    }
+    compute_tangents();
+    compute_bounds();
+    compute_hash();
+}
+
+Model::Model(std::vector<vec3> verts, std::vector<vec2> uv, std::vector<vec3> norms, std::vector<int> facet_vrt,
+             std::vector<int> facet_tex, std::vector<int> facet_nrm)
+        : verts_(std::move(verts)), uv_(std::move(uv)), norms_(std::move(norms)), facet_vrt_(std::move(facet_vrt)),
+          facet_tex_(std::move(facet_tex)), facet_nrm_(std::move(facet_nrm)) {
+    assert(facet_vrt_.size()%3==0 && facet_tex_.size()==facet_vrt_.size() && facet_nrm_.size()==facet_vrt_.size());
+    compute_tangents();
+    compute_bounds();
+    compute_hash();
+}
+
+bool Model::write_obj(const std::string &filename) const {
+    std::ofstream out(filename);
+    if (!out) {
+        std::cerr << "can't open file " << filename << std::endl;
+        return false;
+    }
+    out << std::setprecision(7);
+    for (const vec3 &v : verts_) out << "v " << v.x << " " << v.y << " " << v.z << "\n";
+    for (const vec2 &t : uv_) out << "vt " << t.x << " " << t.y << "\n";
+    for (const vec3 &n : norms_) out << "vn " << n.x << " " << n.y << " " << n.z << "\n";
+    for (int f=0; f<nfaces(); f++) {
+        out << "f";
+        for (int j=0; j<3; j++)
+            out << " " << facet_vrt_[f*3+j]+1 << "/" << facet_tex_[f*3+j]+1 << "/" << facet_nrm_[f*3+j]+1;
+        out << "\n";
+    }
+    out.close();
+    if (!out) {
+        std::cerr << "can't write file " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void Model::compute_hash() {
+    Hasher h;
+    h.bytes(verts_.data(), verts_.size()*sizeof(vec3));
+    h.bytes(uv_.data(), uv_.size()*sizeof(vec2));
+    h.bytes(norms_.data(), norms_.size()*sizeof(vec3));
+    h.bytes(facet_vrt_.data(), facet_vrt_.size()*sizeof(int));
+    h.bytes(facet_tex_.data(), facet_tex_.size()*sizeof(int));
+    h.bytes(facet_nrm_.data(), facet_nrm_.size()*sizeof(int));
+    h << diffusemap_.content_hash() << normalmap_.content_hash() << specularmap_.content_hash();
+    hash_ = h.value();
 }
 
 int Model::nverts() const {
@@ -67,10 +129,26 @@ vec3 Model::vert(const int iface, const int nthvert) const {
     return verts_[facet_vrt_[iface*3+nthvert]];
 }
 
-void Model::load_texture(std::string filename, const std::string suffix, TGAImage &img) {
+int Model::facet_vert(const int iface, const int nthvert) const {
+    return facet_vrt_[iface*3+nthvert];
+}
+
+void Model::set_textures(TGAImage diffuse, TGAImage normal, TGAImage specular) {
+    diffusemap_ = std::move(diffuse);
+    normalmap_ = std::move(normal);
+    specularmap_ = std::move(specular);
+    compute_hash();
+}
+
+std::string Model::texture_filename(const std::string &filename, const std::string &suffix) {
     size_t dot = filename.find_last_of(".");
-    if (dot==std::string::npos) return;
-    std::string texfile = filename.substr(0,dot) + suffix;
+    if (dot==std::string::npos) return "";
+    return filename.substr(0,dot) + suffix;
+}
+
+void Model::load_texture(std::string filename, const std::string suffix, TGAImage &img) {
+    std::string texfile = texture_filename(filename, suffix);
+    if (texfile.empty()) return;
     std::cerr << "texture file " << texfile << " loading " << (img.read_tga_file(texfile.c_str()) ? "ok" : "failed") << std::endl;
     img.flip_vertically();
 }
@@ -99,3 +177,520 @@ vec3 Model::normal(const int iface, const int nthvert) const {
     return norms_[facet_nrm_[iface*3+nthvert]];
 }
 
+vec4 Model::tangent(const int iface, const int nthvert) const {
+    if (facet_tan_.empty()) return vec4();
+    return tangents_[facet_tan_[iface*3+nthvert]];
+}
+
+// 和 MikkTSpace 的做法相同：位置、法线、uv 和 uv 的朝向都相同的角共享一个切线，
+// 每个面的切线先投影到角的法线平面上，再按角的大小加权求和，最后正交化；副切线在着色时由 sign * cross(n, t) 得到
+void Model::compute_tangents() {
+    if (norms_.empty() || uv_.empty()) return;
+
+    std::map<std::tuple<int, int, int, bool>, int> groups;
+    std::vector<vec3> sums;
+    facet_tan_.assign(facet_vrt_.size(), 0);
+    std::vector<bool> signs;
+
+    for (int f=0; f<nfaces(); f++) {
+        vec3 e1 = vert(f, 1) - vert(f, 0);
+        vec3 e2 = vert(f, 2) - vert(f, 0);
+        vec2 d1 = uv(f, 1) - uv(f, 0);
+        vec2 d2 = uv(f, 2) - uv(f, 0);
+        double det = d1.x*d2.y - d2.x*d1.y;
+        bool positive = det >= 0;
+        // uv 退化的面只参与分组，不贡献方向
+        vec3 t;
+        if (std::abs(det) > 1e-12)
+            t = (d2.y*e1 - d1.y*e2) / det;
+
+        for (int j=0; j<3; j++) {
+            auto key = std::make_tuple(facet_vrt_[f*3+j], facet_tex_[f*3+j], facet_nrm_[f*3+j], positive);
+            auto it = groups.find(key);
+            if (it==groups.end()) {
+                it = groups.emplace(key, int(sums.size())).first;
+                sums.emplace_back();
+                signs.push_back(positive);
+            }
+            facet_tan_[f*3+j] = it->second;
+
+            vec3 n = normal(f, j);
+            vec3 tp = t - n*(n*t);
+            if (tp.norm2() < 1e-24) continue;
+            vec3 a = vert(f, (j+1)%3) - vert(f, j);
+            vec3 b = vert(f, (j+2)%3) - vert(f, j);
+            double cos_angle = (a*b) / std::sqrt(a.norm2()*b.norm2());
+            double angle = std::acos(std::max(-1., std::min(1., cos_angle)));
+            if (std::isfinite(angle)) sums[it->second] = sums[it->second] + tp.normalize()*angle;
+        }
+    }
+
+    // 正交化；没有有效方向的顶点取任意一个和法线垂直的方向
+    tangents_.assign(sums.size(), vec4());
+    std::vector<bool> done(sums.size(), false);
+    for (size_t c=0; c<facet_tan_.size(); c++) {
+        int g = facet_tan_[c];
+        if (done[g]) continue;
+        done[g] = true;
+        vec3 n = norms_[facet_nrm_[c]];
+        vec3 t = sums[g] - n*(n*sums[g]);
+        if (t.norm2() < 1e-24) {
+            t = std::abs(n.x) < 0.9 ? vec3(1, 0, 0) : vec3(0, 1, 0);
+            t = t - n*(n*t);
+        }
+        t.normalize();
+        tangents_[g] = embed<4>(t, signs[g] ? 1. : -1.);
+    }
+}
+
+
+void Model::compute_bounds() {
+    if (verts_.empty()) return;
+    bounds_min_ = bounds_max_ = verts_[0];
+    for (const vec3 &v : verts_)
+        for (int i=0; i<3; i++) {
+            bounds_min_[i] = std::min(bounds_min_[i], v[i]);
+            bounds_max_[i] = std::max(bounds_max_[i], v[i]);
+        }
+}
+
+
+namespace {
+    // 二次误差 Q(p) = (p, 1)^T A (p, 1)，A 是对称的 4x4 矩阵，只存上三角
+    struct Quadric {
+        double a[10] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+        // 到平面 n * p + d = 0 的距离的平方，n 是单位向量
+        static Quadric plane(const vec3 &n, double d) {
+            Quadric q;
+            double v[4] = {n.x, n.y, n.z, d};
+            for (int i=0, k=0; i<4; i++)
+                for (int j=i; j<4; j++) q.a[k++] = v[i]*v[j];
+            return q;
+        }
+
+        Quadric &operator+=(const Quadric &q) {
+            for (int i=0; i<10; i++) a[i] += q.a[i];
+            return *this;
+        }
+
+        double error(const vec3 &p) const {
+            double v[4] = {p.x, p.y, p.z, 1};
+            double e = 0;
+            for (int i=0, k=0; i<4; i++)
+                for (int j=i; j<4; j++) e += a[k++]*v[i]*v[j]*(i==j ? 1 : 2);
+            return std::max(0., e);
+        }
+    };
+
+    // 半边收缩的简化：顶点 u 并入相邻的顶点 v，v 的位置不变，所以保留下来的角的法线和 uv 仍然是原来的值。
+    // 角的 uv 或者法线不唯一的顶点（uv 接缝、硬边）以及开放边界、非流形边上的顶点固定不动，只能作为 v；
+    // u 的角改用 v 在这条边所在的面中的 uv 和法线。代价是两个顶点的二次误差之和在 v 处的值
+    class Simplifier {
+    public:
+        Simplifier(const std::vector<vec3> &verts, const std::vector<int> &fv, const std::vector<int> &ft,
+                   const std::vector<int> &fn)
+                : verts_(verts), fv_(fv), ft_(ft), fn_(fn), face_alive_(fv.size()/3, true),
+                  vert_faces_(verts.size()), quadrics_(verts.size()), locked_(verts.size(), false),
+                  vert_alive_(verts.size(), true), version_(verts.size(), 0),
+                  radius_(verts.size(), 0) {
+            int nfaces = int(fv_.size()/3);
+            std::vector<int> first_corner(verts_.size(), -1);
+            std::unordered_map<std::uint64_t, int> edges;
+            for (int f=0; f<nfaces; f++) {
+                const int *v = &fv_[f*3];
+                if (v[0]==v[1] || v[1]==v[2] || v[2]==v[0]) {
+                    face_alive_[f] = false;
+                    continue;
+                }
+                alive_faces_++;
+                vec3 n = cross(verts_[v[1]] - verts_[v[0]], verts_[v[2]] - verts_[v[0]]);
+                if (n.norm2() > 0) {
+                    n.normalize();
+                    Quadric q = Quadric::plane(n, -(n*verts_[v[0]]));
+                    for (int j=0; j<3; j++) quadrics_[v[j]] += q;
+                }
+                for (int j=0; j<3; j++) {
+                    vert_faces_[v[j]].push_back(f);
+                    int &c = first_corner[v[j]];
+                    if (c < 0) c = f*3+j;
+                    else if (ft_[c]!=ft_[f*3+j] || fn_[c]!=fn_[f*3+j]) locked_[v[j]] = true;
+                    int a = std::min(v[j], v[(j+1)%3]), b = std::max(v[j], v[(j+1)%3]);
+                    edges[std::uint64_t(a) << 32 | std::uint32_t(b)]++;
+                }
+            }
+            // 只属于一个面的边是边界，超过两个面的边是非流形
+            for (const auto &e : edges)
+                if (e.second != 2) {
+                    locked_[e.first >> 32] = true;
+                    locked_[e.first & 0xffffffffu] = true;
+                }
+            for (int u=0; u<int(verts_.size()); u++) push_best(u);
+        }
+
+        // 收缩到不超过 target 个面，或者没有可以收缩的边为止
+        void collapse_to(int target) {
+            while (alive_faces_ > target && !heap_.empty()) {
+                Candidate c = heap_.top();
+                heap_.pop();
+                if (!vert_alive_[c.u] || c.version != version_[c.u]) continue;
+                // 入队之后周围的面可能已经变化
+                int t, n;
+                if (!valid(c.u, c.v, t, n)) {
+                    version_[c.u]++;
+                    push_best(c.u);
+                    continue;
+                }
+                collapse(c.u, c.v, t, n, c.cost);
+            }
+        }
+
+        int faces() const { return alive_faces_; }
+
+        // 已经执行的收缩中最大的误差，近似为到原来表面的距离
+        double error() const { return max_error_; }
+
+        void result(std::vector<int> &fv, std::vector<int> &ft, std::vector<int> &fn) const {
+            fv.clear(); ft.clear(); fn.clear();
+            for (size_t f=0; f<face_alive_.size(); f++) {
+                if (!face_alive_[f]) continue;
+                fv.insert(fv.end(), &fv_[f*3], &fv_[f*3] + 3);
+                ft.insert(ft.end(), &ft_[f*3], &ft_[f*3] + 3);
+                fn.insert(fn.end(), &fn_[f*3], &fn_[f*3] + 3);
+            }
+        }
+
+    private:
+        struct Candidate {
+            double cost;
+            int u, v, version;
+            bool operator<(const Candidate &o) const { return cost > o.cost; }
+        };
+
+        int corner(int f, int v) const {
+            for (int j=0; j<3; j++)
+                if (fv_[f*3+j]==v) return f*3+j;
+            return -1;
+        }
+
+        // u 能否并入 v；可以时 t、n 是 u 的角改用的 uv 和法线下标
+        bool valid(int u, int v, int &t, int &n) const {
+            if (!vert_alive_[v]) return false;
+            int shared = 0;
+            t = n = -1;
+            std::vector<int> opposite;
+            for (int f : vert_faces_[u]) {
+                int c = corner(f, v);
+                if (c < 0) continue;
+                // 这条边两侧的面中 v 的 uv 和法线必须相同，否则 u 的角不知道该用哪一个
+                if (shared++ == 0) {
+                    t = ft_[c];
+                    n = fn_[c];
+                } else if (ft_[c]!=t || fn_[c]!=n) {
+                    return false;
+                }
+                for (int j=0; j<3; j++)
+                    if (fv_[f*3+j]!=u && fv_[f*3+j]!=v) opposite.push_back(fv_[f*3+j]);
+            }
+            if (shared==0 || shared > 2) return false;
+
+            // 连接条件：u 和 v 的公共邻居只能是这条边所在的面的第三个顶点，否则收缩之后出现非流形的边
+            for (int f : vert_faces_[u]) {
+                if (corner(f, v) >= 0) continue;
+                for (int j=0; j<3; j++) {
+                    int w = fv_[f*3+j];
+                    if (w==u || std::find(opposite.begin(), opposite.end(), w)!=opposite.end()) continue;
+                    for (int g : vert_faces_[w])
+                        if (corner(g, v) >= 0) return false;
+                }
+            }
+
+            // 剩下的面不能翻转，也不能退化
+            for (int f : vert_faces_[u]) {
+                if (corner(f, v) >= 0) continue;
+                vec3 p[3], q[3];
+                for (int j=0; j<3; j++) {
+                    p[j] = verts_[fv_[f*3+j]];
+                    q[j] = fv_[f*3+j]==u ? verts_[v] : p[j];
+                }
+                vec3 n0 = cross(p[1] - p[0], p[2] - p[0]);
+                vec3 n1 = cross(q[1] - q[0], q[2] - q[0]);
+                if (n1.norm2() <= 1e-12*n0.norm2() || n0*n1 < 0.5*std::sqrt(n0.norm2()*n1.norm2())) return false;
+            }
+            return true;
+        }
+
+        // u 的代价最小的合法收缩放入队列
+        void push_best(int u) {
+            if (!vert_alive_[u] || locked_[u]) return;
+            Candidate best{std::numeric_limits<double>::infinity(), u, -1, version_[u]};
+            for (int f : vert_faces_[u])
+                for (int j=0; j<3; j++) {
+                    int v = fv_[f*3+j];
+                    if (v==u) continue;
+                    Quadric q = quadrics_[u];
+                    q += quadrics_[v];
+                    double cost = q.error(verts_[v]);
+                    int t, n;
+                    if (cost < best.cost && valid(u, v, t, n)) {
+                        best.cost = cost;
+                        best.v = v;
+                    }
+                }
+            if (best.v >= 0) heap_.push(best);
+        }
+
+        void collapse(int u, int v, int t, int n, double cost) {
+            std::vector<int> faces = vert_faces_[u];
+            for (int f : faces) {
+                if (corner(f, v) >= 0) {
+                    face_alive_[f] = false;
+                    alive_faces_--;
+                    for (int j=0; j<3; j++) {
+                        std::vector<int> &vf = vert_faces_[fv_[f*3+j]];
+                        vf.erase(std::find(vf.begin(), vf.end(), f));
+                    }
+                    continue;
+                }
+                int c = corner(f, u);
+                fv_[c] = v;
+                ft_[c] = t;
+                fn_[c] = n;
+                vert_faces_[v].push_back(f);
+            }
+            vert_faces_[u].clear();
+            vert_alive_[u] = false;
+            quadrics_[v] += quadrics_[u];
+            // 二次误差的平方根是 v 到合并进来的所有平面的距离的上界，没有按面积加权，收缩多次之后偏大很多；
+            // 合并进来的原始顶点到 v 的距离也是一个上界，两者取较小的
+            radius_[v] = std::max(radius_[v], radius_[u] + (verts_[u] - verts_[v]).norm());
+            max_error_ = std::max(max_error_, std::min(std::sqrt(cost), radius_[v]));
+
+            // v 和它的邻居的代价都变了
+            std::vector<int> affected(1, v);
+            for (int f : vert_faces_[v])
+                for (int j=0; j<3; j++) affected.push_back(fv_[f*3+j]);
+            std::sort(affected.begin(), affected.end());
+            affected.erase(std::unique(affected.begin(), affected.end()), affected.end());
+            for (int w : affected) {
+                version_[w]++;
+                push_best(w);
+            }
+        }
+
+        const std::vector<vec3> &verts_;
+        std::vector<int> fv_, ft_, fn_;
+        std::vector<bool> face_alive_;
+        std::vector<std::vector<int>> vert_faces_;
+        std::vector<Quadric> quadrics_;
+        std::vector<bool> locked_;
+        std::vector<bool> vert_alive_;
+        std::vector<int> version_;
+        std::priority_queue<Candidate> heap_;
+        // 合并到这个顶点的原始顶点离它最远的距离
+        std::vector<double> radius_;
+        int alive_faces_ = 0;
+        double max_error_ = 0;
+    };
+}
+
+void Model::build_lods(int max_levels, double ratio) {
+    assert(ratio > 0 && ratio < 1);
+    lod_max_levels_ = max_levels;
+    lod_ratio_ = ratio;
+    lods_.clear();
+    lod_errors_.clear();
+    if (nfaces()==0) return;
+
+    // 每一级在上一级的基础上继续收缩，面数不再减少时停止
+    Simplifier simplifier(verts_, facet_vrt_, facet_tex_, facet_nrm_);
+    int previous = simplifier.faces();
+    for (int level=1; level<=max_levels; level++) {
+        simplifier.collapse_to(int(previous*ratio));
+        if (simplifier.faces() > previous*(1 + ratio)/2) break;
+        previous = simplifier.faces();
+
+        // 只保留用到的顶点、uv 和法线
+        std::shared_ptr<Model> m = std::make_shared<Model>();
+        std::vector<int> fv, ft, fn;
+        simplifier.result(fv, ft, fn);
+        std::vector<int> vmap(verts_.size(), -1), tmap(uv_.size(), -1), nmap(norms_.size(), -1);
+        for (size_t c=0; c<fv.size(); c++) {
+            if (vmap[fv[c]] < 0) { vmap[fv[c]] = int(m->verts_.size()); m->verts_.push_back(verts_[fv[c]]); }
+            if (tmap[ft[c]] < 0) { tmap[ft[c]] = int(m->uv_.size()); m->uv_.push_back(uv_[ft[c]]); }
+            if (nmap[fn[c]] < 0) { nmap[fn[c]] = int(m->norms_.size()); m->norms_.push_back(norms_[fn[c]]); }
+            m->facet_vrt_.push_back(vmap[fv[c]]);
+            m->facet_tex_.push_back(tmap[ft[c]]);
+            m->facet_nrm_.push_back(nmap[fn[c]]);
+        }
+        m->compute_tangents();
+        m->compute_bounds();
+        Hasher h;
+        h << hash_ << level;
+        m->hash_ = h.value();
+        lods_.push_back(m);
+        lod_errors_.push_back(simplifier.error());
+    }
+}
+
+
+namespace {
+    // Tipsify (Sander, Nehab, Barczak 2007)：围绕一个顶点输出它所有还没有输出的三角形，
+    // 下一个中心顶点从刚输出的顶点中选择还在缓存中、剩余三角形最多的一个，选不到时退回到最近输出过的顶点，
+    // 再退回到按编号顺序扫描。退回时缓存中已经没有可用的顶点，从这里开始一个新的簇。
+    // 返回三角形的新顺序，clusters 是每个簇的第一个三角形在新顺序中的位置
+    std::vector<int> tipsify(const std::vector<int> &fv, int nverts, int cache_size, std::vector<int> &clusters) {
+        int nfaces = int(fv.size()/3);
+        std::vector<int> offsets(nverts + 1, 0), adjacency(fv.size());
+        for (int v : fv) offsets[v+1]++;
+        for (int v=0; v<nverts; v++) offsets[v+1] += offsets[v];
+        std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+        for (int c=0; c<int(fv.size()); c++) adjacency[fill[fv[c]]++] = c/3;
+
+        std::vector<int> live(nverts), stamp(nverts, 0), dead_end;
+        for (int v=0; v<nverts; v++) live[v] = offsets[v+1] - offsets[v];
+        std::vector<bool> emitted(nfaces, false);
+        std::vector<int> order, candidates;
+        order.reserve(nfaces);
+        clusters.clear();
+        int time = cache_size + 1, cursor = 0;
+
+        auto skip_dead_end = [&]() {
+            while (!dead_end.empty()) {
+                int d = dead_end.back();
+                dead_end.pop_back();
+                if (live[d] > 0) return d;
+            }
+            for (; cursor < nverts; cursor++)
+                if (live[cursor] > 0) return cursor;
+            return -1;
+        };
+
+        int fan = skip_dead_end();
+        bool restart = true;
+        while (fan >= 0) {
+            if (restart && stamp[fan] + cache_size < time) clusters.push_back(int(order.size()));
+            candidates.clear();
+            for (int i=offsets[fan]; i<offsets[fan+1]; i++) {
+                int f = adjacency[i];
+                if (emitted[f]) continue;
+                emitted[f] = true;
+                order.push_back(f);
+                for (int j=0; j<3; j++) {
+                    int v = fv[f*3+j];
+                    dead_end.push_back(v);
+                    candidates.push_back(v);
+                    live[v]--;
+                    if (time - stamp[v] > cache_size) stamp[v] = time++;
+                }
+            }
+
+            // 优先选择输出剩余的三角形之后仍然在缓存中的顶点，其中最早进入缓存的一个
+            int next = -1, best = -1;
+            for (int v : candidates) {
+                if (live[v] == 0) continue;
+                int priority = 0;
+                if (time - stamp[v] + 2*live[v] <= cache_size) priority = time - stamp[v];
+                if (priority > best) {
+                    best = priority;
+                    next = v;
+                }
+            }
+            restart = next < 0;
+            fan = restart ? skip_dead_end() : next;
+        }
+        return order;
+    }
+
+    // 按第一次使用的顺序重新编号 values，没有用到的放在最后；indices 同时改为新的编号
+    template<typename T>
+    void reorder_by_first_use(std::vector<T> &values, std::vector<int> &indices) {
+        std::vector<int> remap(values.size(), -1);
+        std::vector<T> reordered;
+        reordered.reserve(values.size());
+        for (int &i : indices) {
+            if (remap[i] < 0) {
+                remap[i] = int(reordered.size());
+                reordered.push_back(values[i]);
+            }
+            i = remap[i];
+        }
+        for (size_t i=0; i<values.size(); i++)
+            if (remap[i] < 0) reordered.push_back(values[i]);
+        values.swap(reordered);
+    }
+}
+
+void Model::optimize(int cache_size) {
+    int nf = nfaces();
+    if (nf == 0) return;
+    std::vector<int> boundaries;
+    std::vector<int> order = tipsify(facet_vrt_, nverts(), cache_size, boundaries);
+    boundaries.push_back(nf);
+    // 簇太大时排序的粒度不够，切成不超过 64 个三角形的小簇，顶点缓存只在切开的地方多几次缺失
+    const int max_cluster = 64;
+    std::vector<int> clusters;
+    for (size_t c=0; c+1<boundaries.size(); c++)
+        for (int i=boundaries[c]; i<boundaries[c+1]; i+=max_cluster) clusters.push_back(i);
+    clusters.push_back(nf);
+
+    // 按簇的中心到模型中心的距离从近到远排列。Sander 等人的做法是沿簇的法线朝外的先画，这要求剔除背面，
+    // 这里的光栅化不剔除背面，每个像素通常被正面和背面各覆盖一次，朝外优先在自带的模型上反而增加了 overdraw；
+    // 先画躯干和凹处、四肢和尖刺等外围的部分最后画，实测 overdraw 更低
+    std::vector<vec3> centroids(clusters.size() - 1);
+    vec3 center;
+    double total = 0;
+    for (size_t c=0; c+1<clusters.size(); c++) {
+        double area = 0;
+        for (int i=clusters[c]; i<clusters[c+1]; i++) {
+            int f = order[i];
+            double a = cross(vert(f, 1) - vert(f, 0), vert(f, 2) - vert(f, 0)).norm();
+            centroids[c] = centroids[c] + (vert(f, 0) + vert(f, 1) + vert(f, 2)) * (a/3);
+            area += a;
+        }
+        center = center + centroids[c];
+        total += area;
+        if (area > 0) centroids[c] = centroids[c] / area;
+    }
+    if (total > 0) center = center / total;
+    std::vector<std::pair<double, int>> keys;
+    for (size_t c=0; c+1<clusters.size(); c++)
+        keys.emplace_back((centroids[c] - center).norm2(), int(c));
+    std::stable_sort(keys.begin(), keys.end());
+
+    std::vector<int> fv, ft, fn;
+    fv.reserve(facet_vrt_.size()); ft.reserve(facet_vrt_.size()); fn.reserve(facet_vrt_.size());
+    for (const auto &k : keys)
+        for (int i=clusters[k.second]; i<clusters[k.second+1]; i++) {
+            int f = order[i];
+            fv.insert(fv.end(), &facet_vrt_[f*3], &facet_vrt_[f*3] + 3);
+            ft.insert(ft.end(), &facet_tex_[f*3], &facet_tex_[f*3] + 3);
+            fn.insert(fn.end(), &facet_nrm_[f*3], &facet_nrm_[f*3] + 3);
+        }
+    facet_vrt_.swap(fv);
+    facet_tex_.swap(ft);
+    facet_nrm_.swap(fn);
+
+    // 顶点数据按使用的顺序存放，相邻的三角形读取相邻的内存
+    reorder_by_first_use(verts_, facet_vrt_);
+    if (!uv_.empty()) reorder_by_first_use(uv_, facet_tex_);
+    if (!norms_.empty()) reorder_by_first_use(norms_, facet_nrm_);
+    compute_tangents();
+    compute_hash();
+
+    // 细节层次的面索引指向旧的顺序，由新的网格重新生成
+    if (!lods_.empty()) build_lods(lod_max_levels_, lod_ratio_);
+}
+
+double Model::acmr(int cache_size) const {
+    if (nfaces() == 0) return 0;
+    std::vector<int> fifo(cache_size, -1);
+    int head = 0, misses = 0;
+    for (int v : facet_vrt_) {
+        if (std::find(fifo.begin(), fifo.end(), v) != fifo.end()) continue;
+        fifo[head] = v;
+        head = (head + 1) % cache_size;
+        misses++;
+    }
+    return double(misses) / nfaces();
+}
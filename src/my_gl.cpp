@@ -1,15 +1,11 @@
 
 #include "my_gl.h"
+#include "task_scheduler.h"
 #include <cassert>
+#include <new>
 
 using namespace std;
 
-int view_port_x_offset;
-int view_port_y_offset;
-int view_port_width;
-int view_port_height;
-
-
 mat<4, 4> lookat(const vec3 &eye, const vec3 &target, const vec3 &up) {
     vec3 k_ = (eye - target).normalize();
     vec3 i_ = cross(up, k_).normalize();
@@ -47,7 +43,43 @@ mat<4, 4> projection(int width, int height, int near, int far) {
     return proj;
 }
 
-void view_port(int x_offset, int y_offset, int width, int height) {
+RenderContext::RenderContext(int width, int height, RenderTarget::Layout layout, FramePool *pool)
+        : RenderContext(width, height, ScreenRect(0, 0, width - 1, height - 1), layout, pool) {}
+
+RenderContext::RenderContext(int width, int height, const ScreenRect &region, RenderTarget::Layout layout,
+                             FramePool *pool)
+        : width_(width), height_(height), region_(region.intersected(ScreenRect(0, 0, width - 1, height - 1))),
+          view_port_x_offset(0), view_port_y_offset(0), view_port_width(width), view_port_height(height),
+          pool_(pool) {
+    assert(width > 0 && height > 0 && !region_.empty());
+    const int block = rate_width(RATE_4X4);
+    bounds_ = ScreenRect(region_.x0 & ~(block - 1), region_.y0 & ~(block - 1),
+                         region_.x1 | (block - 1), region_.y1 | (block - 1));
+    bounds_ = bounds_.intersected(ScreenRect(0, 0, width - 1, height - 1));
+    origin_x_ = bounds_.x0 & ~(RenderTarget::TILE_SIZE - 1);
+    origin_y_ = bounds_.y0 & ~(RenderTarget::TILE_SIZE - 1);
+    scissor_ = screen();
+    int target_width = bounds_.x1 - origin_x_ + 1, target_height = bounds_.y1 - origin_y_ + 1;
+    int image_width = region_.x1 - region_.x0 + 1, image_height = region_.y1 - region_.y0 + 1;
+    if (pool_) {
+        target_ = pool_->acquire_target(target_width, target_height, 1, layout);
+        arena_ = pool_->acquire_arena();
+        image_ = pool_->acquire_image(image_width, image_height, TGAImage::RGB);
+    } else {
+        target_.reset(new RenderTarget(target_width, target_height, 1, layout));
+        arena_.reset(new FrameArena());
+        image_ = TGAImage(image_width, image_height, TGAImage::RGB);
+    }
+}
+
+RenderContext::~RenderContext() {
+    if (!pool_) return;
+    pool_->release(std::move(target_));
+    pool_->release(std::move(arena_));
+    pool_->release(std::move(image_));
+}
+
+void RenderContext::view_port(int x_offset, int y_offset, int width, int height) {
     assert(width > 0 && height > 0);
 
     view_port_x_offset = x_offset;
@@ -56,75 +88,665 @@ void view_port(int x_offset, int y_offset, int width, int height) {
     view_port_height = height;
 }
 
-/* 重心坐标插值的参数 */
-vec3 barycentric(const vec2 &A, const vec2 &B, const vec2 &C, const vec2 &P) {
-    mat<3, 3> abc;
-    abc[0] = embed<3>(A);
-    abc[1] = embed<3>(B);
-    abc[2] = embed<3>(C);
+void RenderContext::hash(Hasher &h) const {
+    h << width_ << height_;
+    h << region_.x0 << region_.y0 << region_.x1 << region_.y1;
+    h << view_port_x_offset << view_port_y_offset << view_port_width << view_port_height;
+    h << samples_;
+    h << scissor_.x0 << scissor_.y0 << scissor_.x1 << scissor_.y1;
+    h << int(scissor_rects_.size());
+    for (const ScreenRect &rect : scissor_rects_)
+        h << rect.x0 << rect.y0 << rect.x1 << rect.y1;
+    h << int(shading_rate_) << int(tile_rates_.size());
+    if (!tile_rates_.empty())
+        h.bytes(tile_rates_.data(), tile_rates_.size());
+}
+
+void RenderContext::clear() {
+    target_->clear();
+    arena_->reset();
+}
+
+void RenderContext::clear(const vector<ScreenRect> &rects) {
+    for (const ScreenRect &rect : rects)
+        target_->clear(rect.intersected(screen()).translated(-origin_x_, -origin_y_));
+    arena_->reset();
+}
+
+void RenderContext::set_scissor(const ScreenRect &rect) {
+    scissor_ = rect.intersected(screen());
+    scissor_rects_.clear();
+}
+
+void RenderContext::set_scissor(const vector<ScreenRect> &rects) {
+    scissor_ = ScreenRect();
+    scissor_rects_.clear();
+    for (const ScreenRect &rect : rects) {
+        ScreenRect r = rect.intersected(screen());
+        if (r.empty()) continue;
+        scissor_rects_.push_back(r);
+        scissor_ = scissor_.united(r);
+    }
+}
 
-    if (abs(abc.det()) < 1e-3)
-        return {-1, 1, 1};
-    return abc.invert_transpose() * embed<3>(P);
+void RenderContext::clear_scissor() {
+    scissor_ = screen();
+    scissor_rects_.clear();
 }
 
+ScreenRect RenderContext::screen_bounds(const Model &model, const mat<4, 4> &mvp) const {
+    ScreenRect bounds;
+    for (int i = 0; i < model.nverts(); ++i) {
+        vec4 clip = mvp * embed<4>(model.vert(i));
+        // 相机看向 -z，可见的点 w < 0
+        if (clip[3] >= 0) return screen();
+        vec3 p = to_screen(clip);
+        // 和 triangle() 一样取整，再留出一个像素的余量
+        bounds = bounds.united(ScreenRect(int(p.x) - 1, int(p.y) - 1, int(p.x) + 1, int(p.y) + 1));
+    }
+    return bounds.intersected(screen());
+}
+
+int RenderContext::select_lod(const Model &model, const mat<4, 4> &mvp, double pixel_error) const {
+    if (model.nlods() == 1) return 0;
+    vec3 lo = model.bounds_min(), hi = model.bounds_max();
+    double size = (hi - lo).norm();
+    if (size <= 0) return 0;
+
+    // 包围盒上离相机最近的点投影误差最大：每个角沿三个轴各移动一小段，取屏幕上最大的位移作为单位长度的像素数
+    double eps = size * 1e-3;
+    double scale = 0;
+    for (int i = 0; i < 8; ++i) {
+        vec3 corner(i & 1 ? hi.x : lo.x, i & 2 ? hi.y : lo.y, i & 4 ? hi.z : lo.z);
+        vec4 clip = mvp * embed<4>(corner);
+        if (clip[3] >= 0) return 0;
+        vec3 p = to_screen(clip);
+        for (int axis = 0; axis < 3; ++axis) {
+            vec3 q = corner;
+            q[axis] += eps;
+            vec4 clip_q = mvp * embed<4>(q);
+            if (clip_q[3] >= 0) return 0;
+            vec3 d = to_screen(clip_q) - p;
+            scale = std::max(scale, std::sqrt(d.x * d.x + d.y * d.y) / eps);
+        }
+    }
+
+    int level = 0;
+    while (level + 1 < model.nlods() && model.lod_error(level + 1) * scale <= pixel_error)
+        ++level;
+    return level;
+}
+
+void RenderContext::set_samples(int samples) {
+    assert(samples == 1 || samples == 2 || samples == 4 || samples == 8);
+    if (samples == samples_) {
+        target_->clear();
+        return;
+    }
+    samples_ = samples;
+    // 归还给池之后 target_ 为空，先取出尺寸和布局
+    const int width = target_->get_width(), height = target_->get_height();
+    RenderTarget::Layout layout = target_->get_layout();
+    if (pool_) {
+        pool_->release(std::move(target_));
+        target_ = pool_->acquire_target(width, height, samples_, layout);
+    } else {
+        target_.reset(new RenderTarget(width, height, samples_, layout));
+    }
+}
+
+void RenderContext::resolve() {
+    // region 和渲染目标重合时（例如整帧渲染）整个转换
+    if (region_.x0 == origin_x_ && region_.y0 == origin_y_ &&
+        region_.x1 == bounds_.x1 && region_.y1 == bounds_.y1) {
+        target_->resolve(image_, parallel);
+        return;
+    }
+    resolve(region_);
+}
+
+void RenderContext::resolve(const ScreenRect &rect) {
+    const int image_width = region_.x1 - region_.x0 + 1, image_height = region_.y1 - region_.y0 + 1;
+    if (image_.get_width() != image_width || image_.get_height() != image_height ||
+        (image_.get_bytespp() != TGAImage::RGB && image_.get_bytespp() != TGAImage::RGBA)) {
+        image_ = TGAImage(image_width, image_height, TGAImage::RGB);
+        if (rect != region_) resolve(region_);
+    }
+    ScreenRect r = rect.intersected(region_);
+    if (r.empty()) return;
+    int bytespp = image_.get_bytespp();
+    uint8_t *data = image_.buffer();
+    parallel_for(r.y0, r.y1 + 1, [&](int y) {
+        uint8_t *dst = data + (size_t(y - region_.y0) * image_width + r.x0 - region_.x0) * bytespp;
+        target_->resolve_span(y - origin_y_, r.x0 - origin_x_, r.x1 - origin_x_, dst, bytespp);
+    }, parallel);
+}
+
+void RenderContext::set_tile_shading_rate(int tx, int ty, ShadingRate rate) {
+    assert(tx >= 0 && tx < target_->tiles_x() && ty >= 0 && ty < target_->tiles_y());
+    if (tile_rates_.empty())
+        tile_rates_.assign(size_t(target_->tiles_x()) * target_->tiles_y(), RATE_1X1);
+    tile_rates_[size_t(ty) * target_->tiles_x() + tx] = uint8_t(rate);
+}
+
+void RenderContext::auto_shading_rates(double max_variance, const RenderTarget &previous) {
+    assert(previous.get_width() == target_->get_width() && previous.get_height() == target_->get_height());
+    const int n = RenderTarget::TILE_SIZE;
+    const int tiles_x = target_->tiles_x(), tiles_y = target_->tiles_y();
+    tile_rates_.resize(size_t(tiles_x) * tiles_y);
+
+    parallel_for(0, tiles_x * tiles_y, [&](int tile) {
+        int tx = tile % tiles_x, ty = tile / tiles_x;
+        // 没有绘制过的块是常数颜色
+        if (previous.tile_cleared(tx, ty)) {
+            tile_rates_[tile] = RATE_4X4;
+            return;
+        }
+
+        // 块内像素的亮度，多重采样时取第一个采样点
+        int w = min(n, previous.get_width() - tx * n), h = min(n, previous.get_height() - ty * n);
+        float luma[n][n];
+        for (int y = 0; y < h; ++y)
+            for (int x = 0; x < w; ++x) {
+                const uint8_t *c = previous.color(previous.index(tx * n + x, ty * n + y));
+                luma[y][x] = 0.114f * c[0] + 0.587f * c[1] + 0.299f * c[2];
+            }
+
+        // 从粗到细，第一个平均方差足够小的着色率
+        uint8_t chosen = RATE_1X1;
+        for (int rate = RATE_4X4; rate > RATE_1X1; --rate) {
+            int bw = rate_width(ShadingRate(rate)), bh = rate_height(ShadingRate(rate));
+            double sum_var = 0;
+            int blocks = 0;
+            for (int by = 0; by < h; by += bh) {
+                for (int bx = 0; bx < w; bx += bw) {
+                    double s = 0, s2 = 0;
+                    int count = 0;
+                    for (int y = by; y < min(h, by + bh); ++y)
+                        for (int x = bx; x < min(w, bx + bw); ++x, ++count) {
+                            s += luma[y][x];
+                            s2 += luma[y][x] * luma[y][x];
+                        }
+                    sum_var += s2 / count - (s / count) * (s / count);
+                    ++blocks;
+                }
+            }
+            if (sum_var <= max_variance * blocks) {
+                chosen = uint8_t(rate);
+                break;
+            }
+        }
+        tile_rates_[tile] = chosen;
+    }, parallel);
+}
+
+
+/* 三角形的设置：重心坐标是屏幕坐标的线性函数 w_i = a_i * x + b_i * y + c_i */
+struct RenderContext::TriangleSetup {
+    double a[3], b[3], c[3];
+    double z[3];
+
+    /* 退化的三角形返回 false */
+    bool init(const vec3 v[3]) {
+        double area = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[1].y - v[0].y) * (v[2].x - v[0].x);
+        if (std::abs(area) < 1e-3) return false;
+        for (int i = 0; i < 3; ++i) {
+            const vec3 &p = v[(i + 1) % 3];
+            const vec3 &q = v[(i + 2) % 3];
+            a[i] = (p.y - q.y) / area;
+            b[i] = (q.x - p.x) / area;
+            c[i] = (p.x * q.y - p.y * q.x) / area;
+            z[i] = v[i].z;
+        }
+        return true;
+    }
+
+    vec3 barycentric(double x, double y) const {
+        return {a[0] * x + b[0] * y + c[0], a[1] * x + b[1] * y + c[1], a[2] * x + b[2] * y + c[2]};
+    }
+
+    double depth(const vec3 &bary) const {
+        return bary.x * z[0] + bary.y * z[1] + bary.z * z[2];
+    }
+};
+
+/* 分块绘制中设置好的三角形，边界已经和 scissor 求交 */
+struct RenderContext::BinnedTriangle {
+    TriangleSetup setup;
+    int border_min[2];
+    int border_max[2];
+};
+
+namespace {
+    /* 多重采样的采样点相对像素中心的偏移，和 D3D 的标准采样模式相同，单位 1/16 像素 */
+    const int SAMPLE_OFFSETS_2X[2][2] = {{4, 4}, {-4, -4}};
+    const int SAMPLE_OFFSETS_4X[4][2] = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+    const int SAMPLE_OFFSETS_8X[8][2] = {{1, -3}, {-1, 3}, {5, 1}, {-3, -5}, {-5, 5}, {-7, -1}, {3, 7}, {7, -7}};
+
+    const int (*sample_offsets(int samples))[2] {
+        switch (samples) {
+            case 2: return SAMPLE_OFFSETS_2X;
+            case 4: return SAMPLE_OFFSETS_4X;
+            default: return SAMPLE_OFFSETS_8X;
+        }
+    }
+
+    inline bool inside(const vec3 &bary) {
+        return bary.x >= 0 && bary.y >= 0 && bary.z >= 0;
+    }
+
+    inline bool depth_in_range(double depth) {
+        return depth >= Z_BUFFER_MIN && depth <= Z_BUFFER_MAX;
+    }
+}
+
+void RenderContext::triangle(Shader &shader, const vector<Location> &locations) {
+    assert(locations.size() == 3);
+    triangle(shader, locations.data());
+}
+
+void RenderContext::draw(Shader &shader, const Model &model) {
+    // 每个面的三个顶点连续存放
+    Location *locations = arena_->alloc<Location>(size_t(model.nfaces()) * 3);
+    for (int i = 0; i < model.nfaces(); ++i)
+        for (int j = 0; j < 3; ++j)
+            new(&locations[i * 3 + j]) Location(model.vert(i, j), model.normal(i, j), model.uv(i, j),
+                                                         model.tangent(i, j));
+
+    // 多线程时按块分组，一次 parallel_for 绘制所有的块；着色器不能复制时逐个三角形绘制
+    if (parallel && TaskScheduler::global().size() > 1 && draw_binned(shader, locations, model.nfaces()))
+        return;
+    for (int i = 0; i < model.nfaces(); ++i)
+        triangle(shader, &locations[i * 3]);
+    for (int ty = 0; ty < target_->tiles_y(); ++ty)
+        for (int tx = 0; tx < target_->tiles_x(); ++tx)
+            finish_tile(tx, ty);
+}
 
-/* 绘制三角形，接受世界坐标系的点 */
-void triangle(TGAImage &image, vector<vector<z_buffer_t>> &z_buffer, Shader &shader, const vector<Location> &locations) {
+void RenderContext::finish_tile(int tx, int ty) {
+    if (!tile_done || depth_only_) return;
+    const int shift = RenderTarget::TILE_SHIFT;
+    ScreenRect tile(origin_x_ + (tx << shift), origin_y_ + (ty << shift),
+                    origin_x_ + ((tx + 1) << shift) - 1, origin_y_ + ((ty + 1) << shift) - 1);
+    tile_done(tile.intersected(region_));
+}
+
+bool RenderContext::draw_binned(Shader &shader, const Location *locations, int n_faces) {
+    const int shift = RenderTarget::TILE_SHIFT;
+    const int tiles_x = target_->tiles_x(), n_tiles = tiles_x * target_->tiles_y();
+
+    // 每个线程平均分到几个任务，给窃取留出余地；每个任务使用自己的着色器副本，顶点着色和光栅化两个阶段共用
+    const int n_tasks = min(n_tiles, TaskScheduler::global().size() * 4);
+    Shader **shaders = arena_->alloc<Shader *>(n_tasks);
+    for (int i = 0; i < n_tasks; ++i)
+        if (!(shaders[i] = shader.clone(*arena_))) return false;
+
+    // 每批至少 256 个面，小模型不必为很少的顶点分出任务；批 b 处理面 [first(b), first(b + 1))
+    const int n_batches = max(1, min(n_tasks, n_faces / 256));
+    auto first = [&](int batch) { return n_faces * batch / n_batches; };
+
+    // 只写深度时片段着色器不会被调用，不需要保存 varyings
+    const size_t align = alignof(max_align_t);
+    const size_t stride = depth_only_ ? 0 : (shader.varying_size() + align - 1) / align * align;
+    BinnedTriangle *triangles = arena_->alloc<BinnedTriangle>(size_t(n_faces));
+    auto *varyings = static_cast<unsigned char *>(arena_->allocate(stride * n_faces));
+    int *batch_sizes = arena_->alloc<int>(n_batches);
+    int *counts = arena_->alloc<int>(size_t(n_batches) * n_tiles);
+
+    // 第一阶段：每批设置自己的三角形，放在批的起点之后，统计本批在每个块中的三角形数
+    parallel_for(0, n_batches, [&](int batch) {
+        Shader &batch_shader = *shaders[batch];
+        int *count = counts + size_t(batch) * n_tiles;
+        fill(count, count + n_tiles, 0);
+        int n = first(batch);
+        batch_shader.begin_faces(first(batch));
+        for (int i = first(batch); i < first(batch + 1); ++i) {
+            BinnedTriangle &t = triangles[n];
+            if (!setup_triangle(batch_shader, &locations[i * 3], t.setup, t.border_min, t.border_max)) continue;
+            if (stride) batch_shader.save_varyings(varyings + stride * n);
+            ++n;
+            for (int ty = (t.border_min[1] - origin_y_) >> shift; ty <= (t.border_max[1] - origin_y_) >> shift; ++ty)
+                for (int tx = (t.border_min[0] - origin_x_) >> shift; tx <= (t.border_max[0] - origin_x_) >> shift; ++tx)
+                    ++count[ty * tiles_x + tx];
+        }
+        batch_sizes[batch] = n - first(batch);
+    }, parallel);
+
+    // 按块、块内按批求前缀和：offsets[tile] 是块在 bins 中的起点，counts 变成每批在每个块中写入的位置
+    int *offsets = arena_->alloc<int>(size_t(n_tiles) + 1);
+    int total = 0;
+    for (int tile = 0; tile < n_tiles; ++tile) {
+        offsets[tile] = total;
+        for (int batch = 0; batch < n_batches; ++batch) {
+            int &count = counts[size_t(batch) * n_tiles + tile];
+            int n = count;
+            count = total;
+            total += n;
+        }
+    }
+    offsets[n_tiles] = total;
+
+    // 第二阶段：每批把三角形的编号放进相交的块，批的顺序就是提交的顺序
+    int *bins = arena_->alloc<int>(size_t(total));
+    parallel_for(0, n_batches, [&](int batch) {
+        int *next = counts + size_t(batch) * n_tiles;
+        for (int i = first(batch); i < first(batch) + batch_sizes[batch]; ++i) {
+            const BinnedTriangle &t = triangles[i];
+            for (int ty = (t.border_min[1] - origin_y_) >> shift; ty <= (t.border_max[1] - origin_y_) >> shift; ++ty)
+                for (int tx = (t.border_min[0] - origin_x_) >> shift; tx <= (t.border_max[0] - origin_x_) >> shift; ++tx)
+                    bins[next[ty * tiles_x + tx]++] = i;
+        }
+    }, parallel);
+
+    // 第三阶段：任务 k 绘制第 k, k + n_tasks, ... 个块，相邻的块分给不同的任务，负载集中的区域也能分开。
+    // 块只属于一个任务，在这里填充清空的块；绘制之前恢复三角形的 varyings，画完之后马上通知 tile_done
+    parallel_for(0, n_tasks, [&](int task) {
+        Shader &task_shader = *shaders[task];
+        for (int tile = task; tile < n_tiles; tile += n_tasks) {
+            if (offsets[tile] == offsets[tile + 1]) {
+                finish_tile(tile % tiles_x, tile / tiles_x);
+                continue;
+            }
+            int x0 = origin_x_ + ((tile % tiles_x) << shift), y0 = origin_y_ + ((tile / tiles_x) << shift);
+            int x1 = x0 + RenderTarget::TILE_SIZE - 1, y1 = y0 + RenderTarget::TILE_SIZE - 1;
+            target_->prepare(x0 - origin_x_, y0 - origin_y_, x1 - origin_x_, y1 - origin_y_);
+            for (int k = offsets[tile]; k < offsets[tile + 1]; ++k) {
+                const BinnedTriangle &t = triangles[bins[k]];
+                if (stride) task_shader.load_varyings(varyings + stride * bins[k]);
+                tile_raster(task_shader, t.setup, max(x0, t.border_min[0]), max(y0, t.border_min[1]),
+                            min(x1, t.border_max[0]), min(y1, t.border_max[1]));
+            }
+            finish_tile(tile % tiles_x, tile / tiles_x);
+        }
+    }, parallel);
+    return true;
+}
+
+void RenderContext::depth_prepass(Shader &shader, const Model &model) {
+    depth_only_ = true;
+    draw(shader, model);
+    depth_only_ = false;
+}
+
+vec3 RenderContext::to_screen(const vec4 &clip) const {
+    // 透视除法：标准化设备坐标
+    vec3 res = proj<3>(clip / clip[3]);
+
+    // 屏幕坐标
+    res.x = (res.x + 1) * view_port_width / 2 + view_port_x_offset;
+    res.y = (res.y + 1) * view_port_height / 2 + view_port_y_offset;
+    res.z = (res.z + 1) * (Z_BUFFER_MAX - Z_BUFFER_MIN) / 2 + Z_BUFFER_MIN;
+    return res;
+}
+
+vec3 RenderContext::to_view(const vec3 &screen, const mat<4, 4> &inv_projection) const {
+    vec4 ndc;
+    ndc[0] = (screen.x - view_port_x_offset) * 2 / view_port_width - 1;
+    ndc[1] = (screen.y - view_port_y_offset) * 2 / view_port_height - 1;
+    ndc[2] = (screen.z - Z_BUFFER_MIN) * 2 / (Z_BUFFER_MAX - Z_BUFFER_MIN) - 1;
+    ndc[3] = 1;
+    vec4 p = inv_projection * ndc;
+    return proj<3>(p / p[3]);
+}
+
+void RenderContext::triangle(Shader &shader, const Location *locations) {
+    TriangleSetup setup;
+    int border_min[2], border_max[2];
+    if (!setup_triangle(shader, locations, setup, border_min, border_max)) return;
+
+    // 填充边界范围内还处于清空状态的块，之后的并行绘制直接读写
+    target_->prepare(border_min[0] - origin_x_, border_min[1] - origin_y_,
+                     border_max[0] - origin_x_, border_max[1] - origin_y_);
+
+    if (!scissor_rects_.empty()) {
+        triangle_tiles(shader, setup, border_min, border_max);
+        return;
+    }
+    if (samples_ > 1) {
+        triangle_msaa(shader, setup, border_min, border_max);
+        return;
+    }
+    if (shading_rate_ != RATE_1X1 || !tile_rates_.empty()) {
+        triangle_tiles(shader, setup, border_min, border_max);
+        return;
+    }
+
+    // 每一列 quad 并行
+    int quad_x0 = border_min[0] & ~1;
+    parallel_for(0, (border_max[0] - quad_x0) / 2 + 1, [&](int column) {
+        int qx = quad_x0 + 2 * column;
+        pixel_quads(shader, setup, max(qx, border_min[0]), border_min[1], min(qx + 1, border_max[0]), border_max[1]);
+    }, parallel);
+}
+
+bool RenderContext::setup_triangle(Shader &shader, const Location *locations, TriangleSetup &setup,
+                                   int border_min[2], int border_max[2]) {
     vec3 screen_poss[3];
 
     // 调用顶点着色器
-    vec4 temp_vec4;
-    vec3 temp_vec3;
     for (int i = 0; i < 3; ++i) {
-        temp_vec4 = shader.vertex(locations[i], i);
-        if (temp_vec4[3] == 0) return;
+        vec4 clip = shader.vertex(locations[i], i);
+        if (clip[3] == 0) return false;
+        screen_poss[i] = to_screen(clip);
+    }
+
+    // 寻找三角形的边界，多重采样时采样点可能偏离像素中心半个像素
+    int margin = samples_ > 1 ? 1 : 0;
+    int image_size[2] = {width_ - 1, height_ - 1};
+    border_min[0] = image_size[0];
+    border_min[1] = image_size[1];
+    border_max[0] = border_max[1] = 0;
+    for (const auto &screen_pos : screen_poss) {
+        border_min[0] = max(0, min(border_min[0], int(screen_pos.x) - margin));
+        border_min[1] = max(0, min(border_min[1], int(screen_pos.y) - margin));
+        border_max[0] = min(image_size[0], max(border_max[0], int(screen_pos.x) + margin));
+        border_max[1] = min(image_size[1], max(border_max[1], int(screen_pos.y) + margin));
+    }
 
-        // 透视除法：标准化设备坐标
-        temp_vec3 = proj<3>(temp_vec4 / temp_vec4[3]);
+    // 裁剪到 scissor（总在 region 内），不相交的三角形不需要设置
+    border_min[0] = max(border_min[0], scissor_.x0);
+    border_min[1] = max(border_min[1], scissor_.y0);
+    border_max[0] = min(border_max[0], scissor_.x1);
+    border_max[1] = min(border_max[1], scissor_.y1);
+    if (border_min[0] > border_max[0] || border_min[1] > border_max[1]) return false;
+    if (!scissor_rects_.empty()) {
+        ScreenRect bounds(border_min[0], border_min[1], border_max[0], border_max[1]);
+        if (none_of(scissor_rects_.begin(), scissor_rects_.end(),
+                    [&](const ScreenRect &rect) { return rect.intersects(bounds); }))
+            return false;
+    }
+
+    return setup.init(screen_poss);
+}
 
-        // 屏幕坐标
-        temp_vec3.x = (temp_vec3.x + 1) * view_port_width / 2 + view_port_x_offset;
-        temp_vec3.y = (temp_vec3.y + 1) * view_port_height / 2 + view_port_y_offset;
-        temp_vec3.z = (temp_vec3.z + 1) * (Z_BUFFER_MAX - Z_BUFFER_MIN) / 2 + Z_BUFFER_MIN;
-        screen_poss[i] = temp_vec3;
+void RenderContext::tile_raster(Shader &shader, const TriangleSetup &setup, int x0, int y0, int x1, int y1) {
+    if (scissor_rects_.empty()) {
+        tile_raster_rect(shader, setup, x0, y0, x1, y1);
+        return;
     }
+    // 矩形互不相交，每个像素最多绘制一次
+    ScreenRect area(x0, y0, x1, y1);
+    for (const ScreenRect &rect : scissor_rects_) {
+        ScreenRect r = rect.intersected(area);
+        if (!r.empty()) tile_raster_rect(shader, setup, r.x0, r.y0, r.x1, r.y1);
+    }
+}
 
-    // 寻找三角形的边界
-    int image_size[2] = {image.get_width(), image.get_height()};
-    int border_min[2] = {image_size[0], image_size[1]};
-    int border_max[2] = {0, 0};
-    for (const auto &screen_pos : screen_poss) {
-        border_min[0] = max(0, min(border_min[0], int(screen_pos.x)));
-        border_min[1] = max(0, min(border_min[1], int(screen_pos.y)));
-        border_max[0] = min(image_size[0], max(border_max[0], int(screen_pos.x)));
-        border_max[1] = min(image_size[1], max(border_max[1], int(screen_pos.y)));
+void RenderContext::tile_raster_rect(Shader &shader, const TriangleSetup &setup, int x0, int y0, int x1, int y1) {
+    if (samples_ > 1) {
+        msaa_pixels(shader, setup, x0, y0, x1, y1);
+        return;
+    }
+    const int shift = RenderTarget::TILE_SHIFT;
+    switch (tile_shading_rate((x0 - origin_x_) >> shift, (y0 - origin_y_) >> shift)) {
+        case RATE_1X1: pixel_quads(shader, setup, x0, y0, x1, y1); break;
+        case RATE_1X2: coarse_quads<1, 2>(shader, setup, x0, y0, x1, y1); break;
+        case RATE_2X2: coarse_quads<2, 2>(shader, setup, x0, y0, x1, y1); break;
+        case RATE_4X4: coarse_quads<4, 4>(shader, setup, x0, y0, x1, y1); break;
     }
+}
 
-#pragma omp parallel for
-    // 光栅化：遍历边界范围内的所有点，绘制
-    for (int x = border_min[0]; x <= border_max[0]; ++x) {
-        for (int y = border_min[1]; y <= border_max[1]; ++y) {
+/* 光栅化：以对齐的 2x2 quad 为单位遍历区域 [x0, x1] x [y0, y1]，quad 内的像素一起着色，相邻像素的差就是导数 */
+void RenderContext::pixel_quads(Shader &shader, const TriangleSetup &setup, int x0, int y0, int x1, int y1) {
+    int quad_x0 = x0 & ~1;
+    int quad_y0 = y0 & ~1;
+    for (int qx = quad_x0; qx <= x1; qx += 2) {
+        for (int qy = quad_y0; qy <= y1; qy += 2) {
+            FragmentQuad quad;
+            quad.x = qx;
+            quad.y = qy;
+            quad.mask = 0;
 
-            // 获得插值参数
-            auto bary_coeff = barycentric(proj<2>(screen_poss[0]),
-                                          proj<2>(screen_poss[1]),
-                                          proj<2>(screen_poss[2]),
-                                          vec2(x, y));
+            size_t index[4];
+            for (int i = 0; i < 4; ++i) {
+                int x = qx + (i & 1), y = qy + (i >> 1);
 
-            // 判断点是否在三角形内
-            if (bary_coeff.x < 0 || bary_coeff.y < 0 || bary_coeff.z < 0)
-                continue;
+                // 获得插值参数，判断点是否在三角形内
+                quad.bary[i] = setup.barycentric(x, y);
+                if (x < x0 || y < y0 || x > x1 || y > y1 || !inside(quad.bary[i]))
+                    continue;
 
-            // z-buffer 测试
-            z_buffer_t depth = bary_coeff * vec3(screen_poss[0].z, screen_poss[1].z, screen_poss[2].z);
-            if (depth < Z_BUFFER_MIN || depth > Z_BUFFER_MAX)
-                continue;
-            if (depth > z_buffer[y][x]) continue;
-            z_buffer[y][x] = depth;
+                // z-buffer 测试
+                double depth = setup.depth(quad.bary[i]);
+                index[i] = target_index(x, y);
+                z_buffer_t &z = target_->depth(index[i]);
+                if (!depth_in_range(depth) || z_buffer_t(depth) > z)
+                    continue;
+                z = z_buffer_t(depth);
+                quad.mask |= 1 << i;
+            }
+            if (!quad.mask || depth_only_) continue;
 
             // 调用片段着色器绘制
-            image.set(x, y, shader.fragment(bary_coeff));
+            TGAColor colors[4];
+            shader.fragment_quad(quad, colors);
+            for (int i = 0; i < 4; ++i)
+                if (quad.mask >> i & 1) target_->set_color(index[i], colors[i]);
+        }
+    }
+}
+
+/* 粗粒度着色：按渲染目标的块遍历，每个块使用自己的着色率 rw x rh。quad 的每个 lane 对应一个 rw x rh 的像素块，
+ * 块内的像素逐个做覆盖和深度测试，lane 在块的中心着色（部分覆盖时在被覆盖的像素的中心），结果写入通过测试的像素。
+ * 着色率为 1x1 的块使用逐像素的光栅化 */
+void RenderContext::triangle_tiles(Shader &shader, const TriangleSetup &setup,
+                                    const int border_min[2], const int border_max[2]) {
+    const int shift = RenderTarget::TILE_SHIFT;
+    const int tx0 = border_min[0] >> shift, ty0 = border_min[1] >> shift;
+    const int tiles_x = (border_max[0] >> shift) - tx0 + 1;
+    const int tiles_y = (border_max[1] >> shift) - ty0 + 1;
+
+    parallel_for(0, tiles_x * tiles_y, [&](int tile) {
+        int tx = tx0 + tile % tiles_x, ty = ty0 + tile / tiles_x;
+        int x0 = tx << shift, y0 = ty << shift;
+        int x1 = min(x0 + (1 << shift) - 1, border_max[0]);
+        int y1 = min(y0 + (1 << shift) - 1, border_max[1]);
+        tile_raster(shader, setup, max(x0, border_min[0]), max(y0, border_min[1]), x1, y1);
+    }, parallel);
+}
+
+template<int RW, int RH>
+void RenderContext::coarse_quads(Shader &shader, const TriangleSetup &setup, int x0, int y0, int x1, int y1) {
+    // quad 的起点按 quad 的尺寸对齐，渲染目标的块的尺寸是它的倍数，quad 不会跨过块
+    const int quad_x0 = x0 & ~(2 * RW - 1);
+    const int quad_y0 = y0 & ~(2 * RH - 1);
+
+    size_t index[4][RW * RH];
+    int count[4];
+    for (int qy = quad_y0; qy <= y1; qy += 2 * RH) {
+        for (int qx = quad_x0; qx <= x1; qx += 2 * RW) {
+            FragmentQuad quad;
+            quad.x = qx;
+            quad.y = qy;
+            quad.mask = 0;
+
+            for (int i = 0; i < 4; ++i) {
+                int bx = qx + (i & 1) * RW, by = qy + (i >> 1) * RH;
+                count[i] = 0;
+                double cx = 0, cy = 0;
+                for (int y = by; y < by + RH; ++y) {
+                    for (int x = bx; x < bx + RW; ++x) {
+                        if (x < x0 || y < y0 || x > x1 || y > y1) continue;
+                        vec3 bary = setup.barycentric(x, y);
+                        if (!inside(bary)) continue;
+
+                        // z-buffer 测试
+                        double depth = setup.depth(bary);
+                        size_t k = target_index(x, y);
+                        z_buffer_t &z = target_->depth(k);
+                        if (!depth_in_range(depth) || z_buffer_t(depth) > z)
+                            continue;
+                        z = z_buffer_t(depth);
+                        index[i][count[i]++] = k;
+                        cx += x;
+                        cy += y;
+                    }
+                }
+
+                if (count[i] == RW * RH || count[i] == 0) {
+                    quad.bary[i] = setup.barycentric(bx + (RW - 1) / 2., by + (RH - 1) / 2.);
+                } else {
+                    quad.bary[i] = setup.barycentric(cx / count[i], cy / count[i]);
+                }
+                if (count[i]) quad.mask |= 1 << i;
+            }
+            if (!quad.mask || depth_only_) continue;
+
+            // 每个 lane 着色一次，广播到块内通过测试的像素
+            TGAColor colors[4];
+            shader.fragment_quad(quad, colors);
+            for (int i = 0; i < 4; ++i)
+                for (int j = 0; j < count[i]; ++j)
+                    target_->set_color(index[i][j], colors[i]);
+        }
+    }
+}
+
+/* 多重采样：每个采样点单独做覆盖和深度测试，每个像素只调用一次片段着色器，结果写入通过测试的采样点 */
+void RenderContext::triangle_msaa(Shader &shader, const TriangleSetup &setup,
+                                  const int border_min[2], const int border_max[2]) {
+    parallel_for(border_min[0], border_max[0] + 1, [&](int x) {
+        msaa_pixels(shader, setup, x, border_min[1], x, border_max[1]);
+    }, parallel);
+}
+
+void RenderContext::msaa_pixels(Shader &shader, const TriangleSetup &setup, int x0, int y0, int x1, int y1) {
+    const int (*offsets)[2] = sample_offsets(samples_);
+    const int full_mask = (1 << samples_) - 1;
+
+    for (int x = x0; x <= x1; ++x) {
+        for (int y = y0; y <= y1; ++y) {
+            size_t base = target_index(x, y);
+
+            // 覆盖掩码和逐采样点的深度测试
+            int passed = 0;
+            double cx = 0, cy = 0;
+            for (int s = 0; s < samples_; ++s) {
+                double sx = x + offsets[s][0] / 16., sy = y + offsets[s][1] / 16.;
+                vec3 bary = setup.barycentric(sx, sy);
+                if (!inside(bary)) continue;
+                double depth = setup.depth(bary);
+                z_buffer_t &z = target_->depth(base + s);
+                if (!depth_in_range(depth) || z_buffer_t(depth) > z) continue;
+                z = z_buffer_t(depth);
+                passed |= 1 << s;
+                cx += sx;
+                cy += sy;
+            }
+            if (!passed || depth_only_) continue;
+
+            // 完全覆盖时在像素中心着色，否则在通过的采样点的中心着色，避免插值到三角形外面
+            vec3 bary;
+            if (passed == full_mask) {
+                bary = setup.barycentric(x, y);
+            } else {
+                int n = __builtin_popcount(passed);
+                bary = setup.barycentric(cx / n, cy / n);
+            }
+            TGAColor color = shader.fragment_at(x, y, bary);
+
+            for (int s = 0; s < samples_; ++s)
+                if (passed >> s & 1) target_->set_color(base + s, color);
         }
     }
 }
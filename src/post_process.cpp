@@ -0,0 +1,354 @@
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include "post_process.h"
+#include "my_gl.h"
+#include "task_scheduler.h"
+
+using namespace std;
+
+
+/* 一个块在线程缓冲中的位置：缓冲覆盖块加上全部 halo 的区域，当前有效区域随着邻域操作缩小 */
+struct PostProcess::Tile {
+    int x0, y0, x1, y1;
+    int bx0, by0, stride;
+    int rx0, ry0, rx1, ry1;
+
+    size_t at(int x, int y) const { return (size_t(y - by0) * stride + (x - bx0)) * 3; }
+
+    /* 块向外扩展 halo 之后和图像的交集设为有效区域 */
+    void set_region(int halo, int width, int height) {
+        rx0 = max(0, x0 - halo);
+        ry0 = max(0, y0 - halo);
+        rx1 = min(width - 1, x1 + halo);
+        ry1 = min(height - 1, y1 + halo);
+    }
+};
+
+void PostProcess::add_exposure(double exposure) {
+    Stage s;
+    s.kind = EXPOSURE;
+    s.a = exposure;
+    stages_.push_back(s);
+}
+
+void PostProcess::add_tone_map_reinhard() {
+    Stage s;
+    s.kind = REINHARD;
+    stages_.push_back(s);
+}
+
+void PostProcess::add_tone_map_aces() {
+    Stage s;
+    s.kind = ACES;
+    stages_.push_back(s);
+}
+
+void PostProcess::add_gamma(double gamma) {
+    assert(gamma > 0);
+    Stage s;
+    s.kind = GAMMA;
+    s.a = gamma;
+    stages_.push_back(s);
+}
+
+void PostProcess::add_color_grade(const mat<3, 3> &matrix, const vec3 &offset, double saturation) {
+    Stage s;
+    s.kind = COLOR_GRADE;
+    s.matrix = matrix;
+    s.offset = offset;
+    s.a = saturation;
+    stages_.push_back(s);
+}
+
+void PostProcess::add_ssao(int samples, double radius, double strength) {
+    assert(samples > 0 && radius > 0);
+    Stage s;
+    s.kind = SSAO;
+    s.n = samples;
+    s.a = radius;
+    s.b = strength;
+    stages_.push_back(s);
+}
+
+void PostProcess::add_blur(int radius) {
+    assert(radius > 0);
+    Stage s;
+    s.kind = BLUR;
+    s.n = radius;
+    stages_.push_back(s);
+}
+
+void PostProcess::add_sharpen(double amount) {
+    Stage s;
+    s.kind = SHARPEN;
+    s.a = amount;
+    stages_.push_back(s);
+}
+
+void PostProcess::pixel_ops(int first, int last, const Tile &tile, float *buf) const {
+    for (int y = tile.ry0; y <= tile.ry1; ++y) {
+        float *p = buf + tile.at(tile.rx0, y);
+        for (int x = tile.rx0; x <= tile.rx1; ++x, p += 3) {
+            double c[3] = {p[0], p[1], p[2]};
+            for (int k = first; k < last; ++k) {
+                const Stage &s = stages_[k];
+                switch (s.kind) {
+                    case EXPOSURE:
+                        for (double &v : c) v *= s.a;
+                        break;
+                    case REINHARD:
+                        for (double &v : c) v = v / (1 + v);
+                        break;
+                    case ACES:
+                        // Narkowicz 的 ACES 拟合
+                        for (double &v : c)
+                            v = std::min(1., std::max(0., v * (2.51 * v + 0.03) / (v * (2.43 * v + 0.59) + 0.14)));
+                        break;
+                    case GAMMA:
+                        for (double &v : c) v = std::pow(std::max(0., v), 1 / s.a);
+                        break;
+                    case COLOR_GRADE: {
+                        double g[3];
+                        for (int i = 0; i < 3; ++i)
+                            g[i] = s.matrix[i][0] * c[0] + s.matrix[i][1] * c[1] + s.matrix[i][2] * c[2] + s.offset[i];
+                        double lum = 0.2126 * g[0] + 0.7152 * g[1] + 0.0722 * g[2];
+                        for (int i = 0; i < 3; ++i) c[i] = lum + s.a * (g[i] - lum);
+                        break;
+                    }
+                    default:
+                        assert(false);
+                }
+            }
+            for (int i = 0; i < 3; ++i) p[i] = float(c[i]);
+        }
+    }
+}
+
+void PostProcess::ssao(const Stage &stage, const Tile &tile, const float *src, float *dst) const {
+    const RenderContext &context = *context_;
+    const RenderTarget &target = context.target();
+    const int width = target.get_width(), height = target.get_height();
+    const double radius = stage.a;
+
+    for (int y = tile.ry0; y <= tile.ry1; ++y) {
+        for (int x = tile.rx0; x <= tile.rx1; ++x) {
+            size_t i = tile.at(x, y);
+            double ao = 1;
+            int z = target.pixel_depth(x, y);
+            if (z < Z_BUFFER_MAX) {
+                vec3 p = context.to_view(vec3(x, y, z + 0.5), inv_projection_);
+                // 深度缓冲的量化误差，一个深度值在视图坐标系中的跨度
+                double bias = std::abs(view_z_[min(z + 1, 255)] - view_z_[z]);
+
+                // 投影是线性的，采样点的裁剪坐标是当前点的裁剪坐标加上采样核的偏移；
+                // 4x4 像素交错地使用旋转过的采样核
+                vec4 clip = projection_ * embed<4>(p);
+                const vec4 *offsets = &kernel_clip_[((x & 3) * 4 + (y & 3)) * kernel_.size()];
+                int occluded = 0;
+                for (size_t k = 0; k < kernel_.size(); ++k) {
+                    vec3 screen = context.to_screen(clip + offsets[k]);
+                    int sx = int(std::lround(screen.x)), sy = int(std::lround(screen.y));
+                    if (sx < 0 || sy < 0 || sx >= width || sy >= height) continue;
+                    double scene_z = view_z_[target.pixel_depth(sx, sy)];
+                    // 场景的表面比采样点更靠近相机，并且离当前点不太远
+                    if (scene_z > p.z + kernel_[k].z + bias && std::abs(scene_z - p.z) < radius)
+                        ++occluded;
+                }
+                ao = 1 - stage.b * occluded / kernel_.size();
+            }
+            for (int c = 0; c < 3; ++c) dst[i + c] = float(src[i + c] * ao);
+        }
+    }
+}
+
+void PostProcess::run(const RenderContext &context, const mat<4, 4> &projection, TGAImage &image) {
+    const RenderTarget &target = context.target();
+    const int width = target.get_width(), height = target.get_height();
+    if (image.get_width() != width || image.get_height() != height || image.get_bytespp() != TGAImage::RGB)
+        image = TGAImage(width, height, TGAImage::RGB);
+
+    context_ = &context;
+    projection_ = projection;
+    inv_projection_ = projection.invert();
+
+    // 深度值到视图坐标系 z 的查找表（取量化区间的中点），SSAO 的采样核
+    kernel_.clear();
+    for (const Stage &s : stages_) {
+        if (s.kind != SSAO) continue;
+        for (int z = 0; z < 256; ++z)
+            view_z_[z] = context.to_view(vec3(width / 2., height / 2., z + 0.5), inv_projection_).z;
+        // Hammersley 点映射到朝向相机（+z）的半球，越靠近中心越密
+        for (int i = 0; i < s.n; ++i) {
+            double u = (i + 0.5) / s.n;
+            unsigned bits = unsigned(i);
+            bits = (bits << 16u) | (bits >> 16u);
+            bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+            bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+            bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+            bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+            double v = bits * 2.3283064365386963e-10;
+            double r = std::sqrt(u), phi = 2 * M_PI * v;
+            double scale = s.a * (0.1 + 0.9 * u * u);
+            kernel_.emplace_back(r * std::cos(phi) * scale, r * std::sin(phi) * scale, std::sqrt(1 - u) * scale);
+        }
+        // 16 个旋转角度下采样核在裁剪坐标中的偏移
+        kernel_clip_.clear();
+        for (int rot = 0; rot < 16; ++rot) {
+            double ca = std::cos(rot * 2 * M_PI / 16), sa = std::sin(rot * 2 * M_PI / 16);
+            for (const vec3 &k : kernel_)
+                kernel_clip_.push_back(projection * embed<4>(vec3(k.x * ca - k.y * sa, k.x * sa + k.y * ca, k.z), 0.));
+        }
+        break;
+    }
+
+    int halo = 0;
+    for (const Stage &s : stages_)
+        halo += s.radius();
+    const int stride = TILE_SIZE + 2 * halo;
+    const size_t buf_size = size_t(stride) * stride * 3;
+
+    int n_threads = TaskScheduler::global().size();
+    if (int(scratch_.size()) < n_threads) {
+        scratch_.resize(n_threads);
+        rows_.resize(n_threads);
+    }
+
+    const int tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    const int tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    std::uint8_t *out = image.buffer();
+
+    parallel_for(0, tiles_x * tiles_y, [&](int t) {
+        int thread = TaskScheduler::global().thread_index();
+        vector<float> &scratch = scratch_[thread];
+        vector<std::uint8_t> &row = rows_[thread];
+        if (scratch.size() < buf_size * 3) scratch.resize(buf_size * 3);
+        if (row.size() < size_t(stride) * 3) row.resize(size_t(stride) * 3);
+        float *a = scratch.data(), *b = a + buf_size, *tmp = b + buf_size;
+
+        Tile tile;
+        tile.x0 = t % tiles_x * TILE_SIZE;
+        tile.y0 = t / tiles_x * TILE_SIZE;
+        tile.x1 = min(width - 1, tile.x0 + TILE_SIZE - 1);
+        tile.y1 = min(height - 1, tile.y0 + TILE_SIZE - 1);
+        tile.bx0 = tile.x0 - halo;
+        tile.by0 = tile.y0 - halo;
+        tile.stride = stride;
+
+        // 读入块和全部 halo
+        int remaining = halo;
+        tile.set_region(remaining, width, height);
+        for (int y = tile.ry0; y <= tile.ry1; ++y) {
+            target.resolve_span(y, tile.rx0, tile.rx1, row.data(), TGAImage::RGB);
+            float *p = a + tile.at(tile.rx0, y);
+            for (int x = 0; x <= tile.rx1 - tile.rx0; ++x, p += 3) {
+                p[0] = row[x * 3 + 2] / 255.f;
+                p[1] = row[x * 3 + 1] / 255.f;
+                p[2] = row[x * 3 + 0] / 255.f;
+            }
+        }
+
+        for (size_t k = 0; k < stages_.size();) {
+            // 连续的逐像素操作融合成一次遍历
+            if (stages_[k].per_pixel()) {
+                size_t last = k;
+                while (last < stages_.size() && stages_[last].per_pixel()) ++last;
+                pixel_ops(int(k), int(last), tile, a);
+                k = last;
+                continue;
+            }
+
+            // 邻域操作：读 a 中的有效区域，写入缩小之后的区域到 b，邻域在图像边缘处截断
+            const Stage &s = stages_[k];
+            int r = s.radius();
+            Tile src = tile;
+            remaining -= r;
+            tile.set_region(remaining, width, height);
+            switch (s.kind) {
+                case SSAO:
+                    ssao(s, tile, a, b);
+                    break;
+                case BLUR: {
+                    float weights[64];
+                    double sigma = std::max(0.5, r / 2.), sum = 0;
+                    assert(r < 32);
+                    for (int i = -r; i <= r; ++i) sum += std::exp(-i * i / (2 * sigma * sigma));
+                    for (int i = -r; i <= r; ++i) weights[i + r] = float(std::exp(-i * i / (2 * sigma * sigma)) / sum);
+                    // 邻域超出图像时截断到边缘，用每个 tap 的偏移表示
+                    int offsets[64];
+                    // 横向：源区域的所有行、目标区域的列
+                    for (int x = tile.rx0; x <= tile.rx1; ++x) {
+                        bool inner = x - r >= 0 && x + r < width;
+                        for (int y = src.ry0; y <= src.ry1; ++y) {
+                            const float *p = a + tile.at(x, y);
+                            if (!inner || y == src.ry0)
+                                for (int i = -r; i <= r; ++i)
+                                    offsets[i + r] = (min(width - 1, max(0, x + i)) - x) * 3;
+                            float c0 = 0, c1 = 0, c2 = 0;
+                            for (int i = 0; i <= 2 * r; ++i) {
+                                const float *s = p + offsets[i];
+                                c0 += weights[i] * s[0];
+                                c1 += weights[i] * s[1];
+                                c2 += weights[i] * s[2];
+                            }
+                            float *q = tmp + tile.at(x, y);
+                            q[0] = c0;
+                            q[1] = c1;
+                            q[2] = c2;
+                        }
+                    }
+                    // 纵向
+                    for (int y = tile.ry0; y <= tile.ry1; ++y) {
+                        for (int i = -r; i <= r; ++i)
+                            offsets[i + r] = (min(height - 1, max(0, y + i)) - y) * stride * 3;
+                        const float *p = tmp + tile.at(tile.rx0, y);
+                        float *q = b + tile.at(tile.rx0, y);
+                        for (int x = tile.rx0; x <= tile.rx1; ++x, p += 3, q += 3) {
+                            float c0 = 0, c1 = 0, c2 = 0;
+                            for (int i = 0; i <= 2 * r; ++i) {
+                                const float *s = p + offsets[i];
+                                c0 += weights[i] * s[0];
+                                c1 += weights[i] * s[1];
+                                c2 += weights[i] * s[2];
+                            }
+                            q[0] = c0;
+                            q[1] = c1;
+                            q[2] = c2;
+                        }
+                    }
+                    break;
+                }
+                case SHARPEN:
+                    for (int y = tile.ry0; y <= tile.ry1; ++y) {
+                        for (int x = tile.rx0; x <= tile.rx1; ++x) {
+                            const float *c = a + tile.at(x, y);
+                            const float *l = a + tile.at(max(0, x - 1), y);
+                            const float *rt = a + tile.at(min(width - 1, x + 1), y);
+                            const float *u = a + tile.at(x, max(0, y - 1));
+                            const float *d = a + tile.at(x, min(height - 1, y + 1));
+                            float *q = b + tile.at(x, y);
+                            for (int j = 0; j < 3; ++j)
+                                q[j] = float(c[j] + s.a * (4 * c[j] - l[j] - rt[j] - u[j] - d[j]));
+                        }
+                    }
+                    break;
+                default:
+                    assert(false);
+            }
+            std::swap(a, b);
+            ++k;
+        }
+
+        // 只写一次输出
+        assert(remaining == 0);
+        for (int y = tile.y0; y <= tile.y1; ++y) {
+            const float *p = a + tile.at(tile.x0, y);
+            std::uint8_t *q = out + (size_t(y) * width + tile.x0) * 3;
+            for (int x = tile.x0; x <= tile.x1; ++x, p += 3, q += 3) {
+                for (int j = 0; j < 3; ++j)
+                    q[2 - j] = std::uint8_t(std::lround(std::min(1.f, std::max(0.f, p[j])) * 255));
+            }
+        }
+    }, context.parallel);
+}
@@ -0,0 +1,103 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include "progressive.h"
+
+using namespace std;
+
+
+/* 图像中 rect 部分的亮度方差 */
+static double luma_variance(const TGAImage &image, const ScreenRect &rect) {
+    int bytespp = image.get_bytespp();
+    double s = 0, s2 = 0;
+    for (int y = rect.y0; y <= rect.y1; ++y) {
+        const uint8_t *c = image.buffer() + (size_t(y) * image.get_width() + rect.x0) * bytespp;
+        for (int x = rect.x0; x <= rect.x1; ++x, c += bytespp) {
+            double luma = 0.114 * c[0] + 0.587 * c[1] + 0.299 * c[2];
+            s += luma;
+            s2 += luma * luma;
+        }
+    }
+    double n = double(rect.area());
+    return s2 / n - (s / n) * (s / n);
+}
+
+bool ProgressiveRenderer::render(RenderContext &context, const Draw &draw, const ScreenRect &bounds, const Sink &sink) {
+    auto start = chrono::steady_clock::now();
+    auto elapsed = [&start]() {
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    };
+    refined_ = skipped_ = remaining_ = 0;
+    const int width = context.get_width(), height = context.get_height();
+    const ScreenRect screen(0, 0, width - 1, height - 1);
+
+    // 粗略的一遍：在 1/scale 的分辨率下绘制，按最近的像素放大到整幅图像
+    int scale = max(1, coarse_scale);
+    int cw = (width + scale - 1) / scale, ch = (height + scale - 1) / scale;
+    if (!coarse_ || coarse_->get_width() != cw || coarse_->get_height() != ch)
+        coarse_.reset(new RenderContext(cw, ch));
+    coarse_->clear();
+    draw(*coarse_);
+    coarse_->resolve();
+    TGAImage &image = context.image();
+    if (image.get_width() != width || image.get_height() != height || image.get_bytespp() != TGAImage::RGB)
+        image = TGAImage(width, height, TGAImage::RGB);
+    const TGAImage &small = coarse_->image();
+    for (int y = 0; y < height; ++y) {
+        const uint8_t *src = small.buffer() + size_t(y / scale) * cw * 3;
+        uint8_t *dst = image.buffer() + size_t(y) * width * 3;
+        for (int x = 0; x < width; ++x)
+            memcpy(dst + x * 3, src + (x / scale) * 3, 3);
+    }
+    coarse_ms_ = elapsed();
+    if (sink) sink(image, screen);
+
+    // 划分区域并排序；和 bounds 不相交的区域细化之后也只有背景。
+    // 不能按粗略的一遍有没有覆盖来判断，细小的三角形可能落在所有低分辨率的采样点之间
+    const int tile = RenderTarget::TILE_SIZE;
+    int size = max(tile, block_size / tile * tile);
+    blocks_.clear();
+    for (int y = 0; y < height; y += size) {
+        for (int x = 0; x < width; x += size) {
+            ScreenRect rect = ScreenRect(x, y, x + size - 1, y + size - 1).intersected(screen);
+            bool drawn = bounds.intersects(rect);
+            double variance = drawn ? luma_variance(image, rect) : 0;
+            if (!drawn || (max_variance >= 0 && variance <= max_variance)) {
+                ++skipped_;
+                continue;
+            }
+            double key;
+            if (order == VARIANCE_FIRST) {
+                key = -variance;
+            } else {
+                double dx = (rect.x0 + rect.x1 - screen.x1) / 2., dy = (rect.y0 + rect.y1 - screen.y1) / 2.;
+                key = dx * dx + dy * dy;
+            }
+            blocks_.push_back({rect, key});
+        }
+    }
+    stable_sort(blocks_.begin(), blocks_.end(), [](const Block &a, const Block &b) { return a.key < b.key; });
+
+    // 逐个区域在全分辨率下绘制；下一个区域的时间按已经完成的区域中最长的估计，第一个按粗略的一遍估计
+    context.clear();
+    double estimate = coarse_ms_;
+    size_t i = 0;
+    for (; i < blocks_.size(); ++i) {
+        double now = elapsed();
+        if (now + estimate > budget_ms) break;
+        const ScreenRect &rect = blocks_[i].rect;
+        // 清除区域的同时回收上一次绘制在 arena 中的顶点数据
+        context.clear(vector<ScreenRect>(1, rect));
+        context.set_scissor(rect);
+        draw(context);
+        context.resolve(rect);
+        ++refined_;
+        if (sink) sink(image, rect);
+        estimate = refined_ == 1 ? elapsed() - now : max(estimate, elapsed() - now);
+    }
+    remaining_ = int(blocks_.size() - i);
+
+    context.clear_scissor();
+    elapsed_ms_ = elapsed();
+    return remaining_ == 0;
+}
@@ -0,0 +1,168 @@
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "render_cache.h"
+
+using namespace std;
+
+
+/* 把 16 位十六进制文件名解析为键 */
+static bool parse_key(const string &name, uint64_t &key) {
+    if (name.size() != 16 + 4 || name.compare(16, 4, ".tga") != 0) return false;
+    key = 0;
+    for (int i = 0; i < 16; ++i) {
+        char c = name[i];
+        int d;
+        if (c >= '0' && c <= '9') d = c - '0';
+        else if (c >= 'a' && c <= 'f') d = c - 'a' + 10;
+        else return false;
+        key = key << 4 | uint64_t(d);
+    }
+    return true;
+}
+
+RenderCache::RenderCache(const string &dir, uint64_t max_bytes) : dir_(dir), max_bytes_(max_bytes) {
+    mkdir(dir_.c_str(), 0755);
+
+    // 扫描目录中已有的结果，按修改时间恢复 LRU 顺序
+    struct Found {
+        uint64_t key;
+        uint64_t bytes;
+        timespec mtime;
+    };
+    vector<Found> found;
+    DIR *d = opendir(dir_.c_str());
+    if (!d) {
+        cerr << "can't open render cache directory " << dir_ << endl;
+        return;
+    }
+    while (dirent *e = readdir(d)) {
+        uint64_t key;
+        struct stat st{};
+        if (!parse_key(e->d_name, key)) continue;
+        if (stat(path(key).c_str(), &st) != 0) continue;
+        found.push_back({key, uint64_t(st.st_size), st.st_mtim});
+    }
+    closedir(d);
+
+    sort(found.begin(), found.end(), [](const Found &a, const Found &b) {
+        if (a.mtime.tv_sec != b.mtime.tv_sec) return a.mtime.tv_sec > b.mtime.tv_sec;
+        return a.mtime.tv_nsec > b.mtime.tv_nsec;
+    });
+    for (const auto &f : found) {
+        lru_.push_back({f.key, f.bytes});
+        index_[f.key] = prev(lru_.end());
+        total_bytes_ += f.bytes;
+    }
+
+    lock_guard<mutex> lock(mutex_);
+    evict();
+}
+
+string RenderCache::path(uint64_t key) const {
+    static const char digits[] = "0123456789abcdef";
+    string name(16, '0');
+    for (int i = 15; i >= 0; --i, key >>= 4)
+        name[i] = digits[key & 0xf];
+    return dir_ + "/" + name + ".tga";
+}
+
+bool RenderCache::touch(uint64_t key) {
+    auto it = index_.find(key);
+    if (it == index_.end()) return false;
+    lru_.splice(lru_.begin(), lru_, it->second);
+
+    // 修改时间记录最近一次使用，下次启动时据此恢复顺序
+    utimensat(AT_FDCWD, path(key).c_str(), nullptr, 0);
+    return true;
+}
+
+bool RenderCache::lookup(uint64_t key, TGAImage &image) {
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (!touch(key)) {
+            ++misses_;
+            return false;
+        }
+        ++hits_;
+    }
+    return image.read_tga_file(path(key));
+}
+
+bool RenderCache::fetch(uint64_t key, const string &filename) {
+    // 在锁内打开缓存文件：之后即使被淘汰（删除）或者被 store 替换，已经打开的文件仍然可以完整读取
+    ifstream in;
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (!touch(key)) {
+            ++misses_;
+            return false;
+        }
+        in.open(path(key), ios::binary);
+        if (!in.is_open()) {
+            ++misses_;
+            return false;
+        }
+        ++hits_;
+    }
+
+    // 先写临时文件再重命名，失败时不会留下截断的输出，也不会覆盖原来的文件
+    ostringstream tmp;
+    tmp << filename << ".tmp" << hash<thread::id>()(this_thread::get_id());
+    {
+        ofstream out(tmp.str(), ios::binary);
+        if (!out.is_open()) return false;
+        out << in.rdbuf();
+        out.close();
+        if (!out.good() || in.bad()) {
+            remove(tmp.str().c_str());
+            return false;
+        }
+    }
+    if (rename(tmp.str().c_str(), filename.c_str()) != 0) {
+        remove(tmp.str().c_str());
+        return false;
+    }
+    return true;
+}
+
+void RenderCache::store(uint64_t key, const TGAImage &image) {
+    // 先写临时文件再重命名，其他进程不会读到写了一半的结果
+    ostringstream tmp;
+    tmp << path(key) << ".tmp" << hash<thread::id>()(this_thread::get_id());
+    if (!image.write_tga_file(tmp.str())) return;
+    struct stat st{};
+    if (stat(tmp.str().c_str(), &st) != 0 || rename(tmp.str().c_str(), path(key).c_str()) != 0) {
+        remove(tmp.str().c_str());
+        return;
+    }
+
+    lock_guard<mutex> lock(mutex_);
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+        total_bytes_ -= it->second->bytes;
+        lru_.erase(it->second);
+    }
+    lru_.push_front({key, uint64_t(st.st_size)});
+    index_[key] = lru_.begin();
+    total_bytes_ += st.st_size;
+    evict();
+}
+
+void RenderCache::evict() {
+    while (total_bytes_ > max_bytes_ && !lru_.empty()) {
+        const Entry &e = lru_.back();
+        remove(path(e.key).c_str());
+        total_bytes_ -= e.bytes;
+        index_.erase(e.key);
+        lru_.pop_back();
+    }
+}
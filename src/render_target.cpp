@@ -0,0 +1,136 @@
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <new>
+#include "render_target.h"
+#include "task_scheduler.h"
+
+using namespace std;
+
+
+void RenderTarget::AlignedFree::operator()(void *p) const {
+    free(p);
+}
+
+template<typename T>
+RenderTarget::AlignedPtr<T> RenderTarget::allocate(size_t n) {
+    void *p = nullptr;
+    if (posix_memalign(&p, 64, max<size_t>(n * sizeof(T), 64)) != 0)
+        throw bad_alloc();
+    return AlignedPtr<T>(static_cast<T *>(p));
+}
+
+RenderTarget::RenderTarget(int width, int height, int samples, Layout layout)
+        : width_(width), height_(height), samples_(samples), layout_(layout),
+          tiles_x_((width + TILE_SIZE - 1) / TILE_SIZE), tiles_y_((height + TILE_SIZE - 1) / TILE_SIZE),
+          stride_(tiles_x_ * TILE_SIZE), tile_cleared_(size_t(tiles_x_) * tiles_y_, 1) {
+    assert(width > 0 && height > 0);
+    assert(samples == 1 || samples == 2 || samples == 4 || samples == 8);
+
+    // 两种布局都按块对齐分配，边缘的块也是完整的
+    size_t n = size_t(stride_) * tiles_y_ * TILE_SIZE * samples_;
+    color_ = allocate<uint8_t>(n * 4);
+    depth_ = allocate<z_buffer_t>(n);
+}
+
+void RenderTarget::clear() {
+    std::fill(tile_cleared_.begin(), tile_cleared_.end(), 1);
+}
+
+void RenderTarget::clear(const ScreenRect &rect) {
+    ScreenRect r = rect.intersected(ScreenRect(0, 0, width_ - 1, height_ - 1));
+    if (r.empty()) return;
+    for (int ty = r.y0 >> TILE_SHIFT; ty <= r.y1 >> TILE_SHIFT; ++ty) {
+        for (int tx = r.x0 >> TILE_SHIFT; tx <= r.x1 >> TILE_SHIFT; ++tx) {
+            uint8_t &cleared = tile_cleared_[size_t(ty) * tiles_x_ + tx];
+            if (cleared) continue;
+            ScreenRect tile(tx * TILE_SIZE, ty * TILE_SIZE, (tx + 1) * TILE_SIZE - 1, (ty + 1) * TILE_SIZE - 1);
+            ScreenRect part = tile.intersected(r);
+            // 边缘的块超出图像的部分也算在矩形内
+            if (part.x0 == tile.x0 && part.y0 == tile.y0 &&
+                (part.x1 == tile.x1 || part.x1 == width_ - 1) && (part.y1 == tile.y1 || part.y1 == height_ - 1)) {
+                cleared = 1;
+                continue;
+            }
+            for (int y = part.y0; y <= part.y1; ++y) {
+                size_t begin = index(part.x0, y);
+                size_t n = size_t(part.x1 - part.x0 + 1) * samples_;
+                memset(color_.get() + begin * 4, 0, n * 4);
+                memset(depth_.get() + begin, Z_BUFFER_MAX, n);
+            }
+        }
+    }
+}
+
+void RenderTarget::fill_tile(int tx, int ty) {
+    if (layout_ == TILED) {
+        size_t begin = index(tx * TILE_SIZE, ty * TILE_SIZE);
+        size_t n = size_t(TILE_SIZE) * TILE_SIZE * samples_;
+        memset(color_.get() + begin * 4, 0, n * 4);
+        memset(depth_.get() + begin, Z_BUFFER_MAX, n);
+        return;
+    }
+    for (int y = ty * TILE_SIZE; y < (ty + 1) * TILE_SIZE; ++y) {
+        size_t begin = index(tx * TILE_SIZE, y);
+        size_t n = size_t(TILE_SIZE) * samples_;
+        memset(color_.get() + begin * 4, 0, n * 4);
+        memset(depth_.get() + begin, Z_BUFFER_MAX, n);
+    }
+}
+
+void RenderTarget::prepare(int x0, int y0, int x1, int y1) {
+    x0 = max(0, x0);
+    y0 = max(0, y0);
+    x1 = min(width_ - 1, x1);
+    y1 = min(height_ - 1, y1);
+    for (int ty = y0 >> TILE_SHIFT; ty <= y1 >> TILE_SHIFT; ++ty) {
+        for (int tx = x0 >> TILE_SHIFT; tx <= x1 >> TILE_SHIFT; ++tx) {
+            uint8_t &cleared = tile_cleared_[size_t(ty) * tiles_x_ + tx];
+            if (!cleared) continue;
+            fill_tile(tx, ty);
+            cleared = 0;
+        }
+    }
+}
+
+void RenderTarget::resolve_row(int y, uint8_t *dst, int bytespp) const {
+    resolve_span(y, 0, width_ - 1, dst, bytespp);
+}
+
+void RenderTarget::resolve_span(int y, int x0, int x1, uint8_t *dst, int bytespp) const {
+    assert(y >= 0 && y < height_ && x0 >= 0 && x1 < width_);
+    assert(bytespp == TGAImage::RGB || bytespp == TGAImage::RGBA);
+
+    const uint8_t *cleared = &tile_cleared_[size_t(y >> TILE_SHIFT) * tiles_x_];
+    for (int x = x0; x <= x1; ++x, dst += bytespp) {
+        // 还没有绘制过的块是清空值
+        if (cleared[x >> TILE_SHIFT]) {
+            memset(dst, 0, bytespp);
+            continue;
+        }
+        const uint8_t *c = color(index(x, y));
+        if (samples_ == 1) {
+            memcpy(dst, c, bytespp);
+            continue;
+        }
+        // 对像素的所有采样点求平均
+        int sum[4] = {0, 0, 0, 0};
+        for (int s = 0; s < samples_; ++s)
+            for (int i = 0; i < bytespp; ++i) sum[i] += c[s * 4 + i];
+        for (int i = 0; i < bytespp; ++i)
+            dst[i] = uint8_t((sum[i] + samples_ / 2) / samples_);
+    }
+}
+
+void RenderTarget::resolve(TGAImage &image, bool parallel) const {
+    if (image.get_width() != width_ || image.get_height() != height_ ||
+        (image.get_bytespp() != TGAImage::RGB && image.get_bytespp() != TGAImage::RGBA))
+        image = TGAImage(width_, height_, TGAImage::RGB);
+
+    int bytespp = image.get_bytespp();
+    uint8_t *data = image.buffer();
+    parallel_for(0, height_, [&](int y) {
+        resolve_row(y, data + size_t(y) * width_ * bytespp, bytespp);
+    }, parallel);
+}
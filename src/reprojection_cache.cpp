@@ -0,0 +1,218 @@
+
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include "reprojection_cache.h"
+#include "task_scheduler.h"
+
+using namespace std;
+
+const uint32_t ReprojectionCache::NO_SURFACE;
+
+ReprojectionCache::ReprojectionCache(int width, int height)
+        : width_(width), height_(height) {
+    assert(width > 0 && height > 0);
+    size_t n = size_t(width) * height;
+    prev_color_.resize(n * 4);
+    prev_depth_.resize(n);
+    depth_.resize(n);
+    prev_id_.assign(n, NO_SURFACE);
+    prev_age_.resize(n);
+    id_.resize(n);
+    age_.resize(n);
+}
+
+uint32_t ReprojectionCache::surface_id(int object, int face) {
+    // 高 12 位是物体，低 20 位是三角形，0 留给没有表面的像素
+    assert(object >= 0 && object < (1 << 12) - 1 && face >= 0 && face < (1 << 20));
+    return uint32_t(object + 1) << 20 | uint32_t(face);
+}
+
+void ReprojectionCache::begin_frame(const RenderContext &context) {
+    assert(context.get_width() == width_ && context.get_height() == height_);
+    assert(context.get_samples() == 1 && context.get_shading_rate() == RenderContext::RATE_1X1);
+    assert(max_age >= 0 && max_age < 256);
+    context_ = &context;
+    std::fill(id_.begin(), id_.end(), NO_SURFACE);
+    std::fill(has_mvp_.begin(), has_mvp_.end(), 0);
+    reused_ = 0;
+    shaded_ = 0;
+}
+
+void ReprojectionCache::end_frame(const RenderContext &context) {
+    assert(context_ == &context);
+    const RenderTarget &target = context.target();
+
+    // 保存这一帧的颜色，没有表面的像素不会被复用，不需要保存
+    parallel_for(0, height_, [&](int y) {
+        for (int x = 0; x < width_; ++x) {
+            size_t p = size_t(y) * width_ + x;
+            if (id_[p] != NO_SURFACE)
+                memcpy(&prev_color_[p * 4], target.color(target.index(x, y)), 4);
+        }
+    }, context.parallel);
+
+    prev_id_.swap(id_);
+    prev_depth_.swap(depth_);
+    prev_age_.swap(age_);
+    prev_mvp_ = mvp_;
+    prev_has_mvp_ = has_mvp_;
+    valid_ = true;
+    context_ = nullptr;
+}
+
+double ReprojectionCache::reuse_ratio() const {
+    uint64_t total = reused_ + shaded_;
+    return total ? double(reused_) / total : 0;
+}
+
+
+CachedShader::CachedShader(Shader &inner, ReprojectionCache &cache, int object_id, const mat<4, 4> &mvp)
+        : inner_(inner), cache_(cache), object_id_(object_id) {
+    // 需要在 begin_frame 之后创建
+    assert(cache.context_ && object_id >= 0);
+    if (cache.mvp_.size() <= size_t(object_id)) {
+        cache.mvp_.resize(object_id + 1);
+        cache.has_mvp_.resize(object_id + 1, 0);
+    }
+    cache.mvp_[object_id] = mvp;
+    cache.has_mvp_[object_id] = 1;
+
+    has_prev_ = cache.valid_ && size_t(object_id) < cache.prev_mvp_.size() && cache.prev_has_mvp_[object_id];
+    if (has_prev_)
+        prev_mvp_ = cache.prev_mvp_[object_id];
+}
+
+CachedShader::CachedShader(const CachedShader &other, Shader &inner)
+        : inner_(inner), cache_(other.cache_), object_id_(other.object_id_), prev_mvp_(other.prev_mvp_),
+          has_prev_(other.has_prev_), face_(other.face_), prev_valid_(other.prev_valid_),
+          prev_slope_(other.prev_slope_) {
+    copy(other.screen_, other.screen_ + 3, screen_);
+    copy(other.prev_screen_, other.prev_screen_ + 3, prev_screen_);
+}
+
+Shader *CachedShader::clone(FrameArena &arena) const {
+    Shader *inner = inner_.clone(arena);
+    if (!inner) return nullptr;
+    // 构造函数是私有的，不经过 make
+    return new(arena.alloc<CachedShader>(1)) CachedShader(*this, *inner);
+}
+
+/* 顶点着色器写入的成员，原来的着色器的 varyings 放在后面 */
+struct CachedShader::Varyings {
+    int face;
+    vec3 screen[3];
+    vec3 prev_screen[3];
+    bool prev_valid;
+    double prev_slope;
+};
+
+size_t CachedShader::inner_offset() {
+    const size_t align = alignof(max_align_t);
+    return (sizeof(Varyings) + align - 1) / align * align;
+}
+
+size_t CachedShader::varying_size() const {
+    return inner_offset() + inner_.varying_size();
+}
+
+void CachedShader::save_varyings(void *dst) const {
+    Varyings *v = new(dst) Varyings;
+    v->face = face_;
+    copy(screen_, screen_ + 3, v->screen);
+    copy(prev_screen_, prev_screen_ + 3, v->prev_screen);
+    v->prev_valid = prev_valid_;
+    v->prev_slope = prev_slope_;
+    inner_.save_varyings(static_cast<unsigned char *>(dst) + inner_offset());
+}
+
+void CachedShader::load_varyings(const void *src) {
+    const Varyings *v = static_cast<const Varyings *>(src);
+    face_ = v->face;
+    copy(v->screen, v->screen + 3, screen_);
+    copy(v->prev_screen, v->prev_screen + 3, prev_screen_);
+    prev_valid_ = v->prev_valid;
+    prev_slope_ = v->prev_slope;
+    inner_.load_varyings(static_cast<const unsigned char *>(src) + inner_offset());
+}
+
+vec4 CachedShader::vertex(const Location &location, int ivert) {
+    if (ivert == 0) {
+        ++face_;
+        prev_valid_ = has_prev_;
+    }
+
+    vec4 clip = inner_.vertex(location, ivert);
+    if (clip[3] != 0)
+        screen_[ivert] = cache_.context_->to_screen(clip);
+
+    // 顶点在上一帧的屏幕坐标
+    if (has_prev_) {
+        vec4 prev_clip = prev_mvp_ * embed<4>(location.local_pos);
+        if (prev_clip[3] == 0)
+            prev_valid_ = false;
+        else
+            prev_screen_[ivert] = cache_.context_->to_screen(prev_clip);
+    }
+
+    // 上一帧的三角形上深度的梯度
+    if (ivert == 2 && prev_valid_) {
+        const vec3 *v = prev_screen_;
+        double area = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[1].y - v[0].y) * (v[2].x - v[0].x);
+        if (std::abs(area) < 1e-3) {
+            prev_valid_ = false;
+        } else {
+            double dzdx = ((v[1].z - v[0].z) * (v[2].y - v[0].y) - (v[1].y - v[0].y) * (v[2].z - v[0].z)) / area;
+            double dzdy = ((v[1].x - v[0].x) * (v[2].z - v[0].z) - (v[1].z - v[0].z) * (v[2].x - v[0].x)) / area;
+            prev_slope_ = (std::abs(dzdx) + std::abs(dzdy)) / 2;
+        }
+    }
+    return clip;
+}
+
+void CachedShader::fragment_quad(const FragmentQuad &quad, TGAColor colors[4]) {
+    const uint32_t id = ReprojectionCache::surface_id(object_id_, face_);
+    const int width = cache_.width_, height = cache_.height_;
+
+    int shade_mask = 0;
+    int n_reused = 0;
+    for (int i = 0; i < 4; ++i) {
+        if (!(quad.mask >> i & 1)) continue;
+        const vec3 &b = quad.bary[i];
+        size_t p = size_t(quad.y + (i >> 1)) * width + quad.x + (i & 1);
+        cache_.id_[p] = id;
+        cache_.depth_[p] = float(screen_[0].z * b.x + screen_[1].z * b.y + screen_[2].z * b.z);
+        cache_.age_[p] = 0;
+
+        if (prev_valid_) {
+            // 和屏幕坐标一样按重心坐标线性插值，取最近的像素
+            vec3 s = prev_screen_[0] * b.x + prev_screen_[1] * b.y + prev_screen_[2] * b.z;
+            int x = int(std::floor(s.x + .5)), y = int(std::floor(s.y + .5));
+            if (x >= 0 && y >= 0 && x < width && y < height) {
+                size_t q = size_t(y) * width + x;
+                bool same = cache_.strict ? cache_.prev_id_[q] == id : cache_.prev_id_[q] >> 20 == id >> 20;
+                if (same && cache_.prev_age_[q] < cache_.max_age &&
+                    std::abs(cache_.prev_depth_[q] - s.z) <= cache_.depth_tolerance + prev_slope_) {
+                    colors[i] = TGAColor(&cache_.prev_color_[q * 4], 4);
+                    cache_.age_[p] = uint8_t(cache_.prev_age_[q] + 1);
+                    ++n_reused;
+                    continue;
+                }
+            }
+        }
+        shade_mask |= 1 << i;
+    }
+
+    // 其余的 lane 交给原来的着色器，导数仍然由整个 quad 计算
+    if (shade_mask) {
+        FragmentQuad q = quad;
+        q.mask = shade_mask;
+        TGAColor shaded[4];
+        inner_.fragment_quad(q, shaded);
+        for (int i = 0; i < 4; ++i)
+            if (shade_mask >> i & 1) colors[i] = shaded[i];
+    }
+
+    cache_.reused_.fetch_add(n_reused, std::memory_order_relaxed);
+    cache_.shaded_.fetch_add(__builtin_popcount(shade_mask), std::memory_order_relaxed);
+}
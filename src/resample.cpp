@@ -0,0 +1,302 @@
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include "resample.h"
+#include "task_scheduler.h"
+
+using namespace std;
+
+
+namespace {
+    // 权重的定点精度
+    const int PRECISION = 14;
+    // 并行时每个任务处理的行数
+    const int ROWS_PER_TASK = 16;
+    // 垂直一遍每次累加的字节数
+    const int CHUNK = 1024;
+
+    double filter_radius(Resampler::Filter filter) {
+        switch (filter) {
+            case Resampler::BOX: return 0.5;
+            case Resampler::BILINEAR: return 1;
+            case Resampler::MITCHELL: return 2;
+            default: return 3;
+        }
+    }
+
+    double filter_value(Resampler::Filter filter, double x) {
+        switch (filter) {
+            case Resampler::BOX:
+                // 半开区间，两个相邻的输入像素不会同时落在边界上
+                return x >= -0.5 && x < 0.5 ? 1 : 0;
+            case Resampler::BILINEAR:
+                x = abs(x);
+                return x < 1 ? 1 - x : 0;
+            case Resampler::MITCHELL: {
+                const double b = 1. / 3, c = 1. / 3;
+                x = abs(x);
+                if (x < 1)
+                    return ((12 - 9 * b - 6 * c) * x * x * x + (-18 + 12 * b + 6 * c) * x * x + (6 - 2 * b)) / 6;
+                if (x < 2)
+                    return ((-b - 6 * c) * x * x * x + (6 * b + 30 * c) * x * x + (-12 * b - 48 * c) * x +
+                            (8 * b + 24 * c)) / 6;
+                return 0;
+            }
+            default: {
+                x = abs(x);
+                if (x < 1e-8) return 1;
+                if (x >= 3) return 0;
+                double px = M_PI * x;
+                return 3 * sin(px) * sin(px / 3) / (px * px);
+            }
+        }
+    }
+
+    inline uint8_t clamp8(int32_t v) {
+        v >>= PRECISION;
+        return uint8_t(v < 0 ? 0 : v > 255 ? 255 : v);
+    }
+
+    /* 水平一遍：[y0, y1) 行，每行 dst_width 个 C 通道的像素 */
+    template<int C>
+    void horizontal_rows(const uint8_t *src, int src_width, uint8_t *dst, int dst_width,
+                         const int *first, const int *count, const int16_t *weights, int stride, int y0, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            const uint8_t *in = src + size_t(y) * src_width * C;
+            uint8_t *out = dst + size_t(y) * dst_width * C;
+            for (int x = 0; x < dst_width; ++x) {
+                const uint8_t *p = in + size_t(first[x]) * C;
+                const int16_t *k = weights + size_t(x) * stride;
+                int32_t acc[C];
+                for (int c = 0; c < C; ++c) acc[c] = 1 << (PRECISION - 1);
+                for (int t = 0; t < count[x]; ++t)
+                    for (int c = 0; c < C; ++c)
+                        acc[c] += k[t] * p[t * C + c];
+                for (int c = 0; c < C; ++c)
+                    out[x * C + c] = clamp8(acc[c]);
+            }
+        }
+    }
+
+    /* 把两行之和中相邻两个像素的同一通道相加，得到 2x2 的平均 */
+    template<int C>
+    void halve_row(const uint16_t *sum, uint8_t *dst, int w) {
+        for (int x = 0; x < w; ++x)
+            for (int c = 0; c < C; ++c)
+                dst[x * C + c] = uint8_t((sum[2 * x * C + c] + sum[(2 * x + 1) * C + c] + 2) >> 2);
+    }
+}
+
+void Resampler::compute_weights(Filter filter, int in_size, int out_size, Weights &w) const {
+    const double scale = double(in_size) / out_size;
+    // 缩小时滤波器按比例展宽
+    const double filter_scale = max(1., scale);
+    const double support = filter_radius(filter) * filter_scale;
+    w.stride = int(ceil(2 * support)) + 2;
+    w.first.resize(out_size);
+    w.count.resize(out_size);
+    w.weights.assign(size_t(out_size) * w.stride, 0);
+
+    vector<double> values(w.stride);
+    for (int i = 0; i < out_size; ++i) {
+        // 像素 k 覆盖 [k, k + 1)，中心在 k + 0.5
+        double center = (i + 0.5) * scale;
+        int lo = max(0, int(floor(center - support)));
+        int hi = min(in_size, int(ceil(center + support)));
+        double sum = 0;
+        for (int k = lo; k < hi; ++k) {
+            values[k - lo] = filter_value(filter, (k + 0.5 - center) / filter_scale);
+            sum += values[k - lo];
+        }
+        // 去掉两端为 0 的权重
+        int b = 0, e = hi - lo;
+        while (b < e && values[b] == 0) ++b;
+        while (e > b && values[e - 1] == 0) --e;
+        if (b == e || sum == 0) {
+            lo = min(in_size - 1, int(center));
+            values[0] = sum = 1;
+            b = 0;
+            e = 1;
+        }
+
+        // 归一化成定点数，舍入的误差加到最大的权重上，权重的和正好是 1 << PRECISION
+        int16_t *k = &w.weights[size_t(i) * w.stride];
+        int total = 0, largest = 0;
+        for (int j = 0; j < e - b; ++j) {
+            k[j] = int16_t(lround(values[b + j] / sum * (1 << PRECISION)));
+            total += k[j];
+            if (k[j] > k[largest]) largest = j;
+        }
+        k[largest] = int16_t(k[largest] + (1 << PRECISION) - total);
+        w.first[i] = lo + b;
+        w.count[i] = e - b;
+    }
+}
+
+void Resampler::resample(const TGAImage &src, TGAImage &dst, int w, int h) {
+    resample(filter, src, dst, w, h);
+}
+
+void Resampler::resample(Filter filter, const TGAImage &src, TGAImage &dst, int w, int h) {
+    assert(&src != &dst && w > 0 && h > 0);
+    const int bytespp = src.get_bytespp();
+    const int src_width = src.get_width(), src_height = src.get_height();
+    if (dst.get_width() != w || dst.get_height() != h || dst.get_bytespp() != bytespp)
+        dst = TGAImage(w, h, bytespp);
+    if (!src.buffer() || src_width <= 0 || src_height <= 0) return;
+
+    const bool scale_x = w != src_width, scale_y = h != src_height;
+    if (scale_x) compute_weights(filter, src_width, w, horizontal_);
+    if (scale_y) compute_weights(filter, src_height, h, vertical_);
+    if (!scale_x && !scale_y) {
+        copy(src.buffer(), src.buffer() + size_t(w) * h * bytespp, dst.buffer());
+    } else if (!scale_x) {
+        vertical_pass(src.buffer(), w * bytespp, h, dst.buffer());
+    } else if (!scale_y) {
+        horizontal_pass(src.buffer(), src_width, h, dst.buffer(), w, bytespp);
+    } else if (h < src_height) {
+        // 垂直缩小时先做垂直的一遍：水平的一遍不能按整行向量化，这样它只需要处理输出的行数
+        size_t size = size_t(src_width) * h * bytespp;
+        if (temp_.size() < size) temp_.resize(size);
+        vertical_pass(src.buffer(), src_width * bytespp, h, temp_.data());
+        horizontal_pass(temp_.data(), src_width, h, dst.buffer(), w, bytespp);
+    } else {
+        size_t size = size_t(w) * src_height * bytespp;
+        if (temp_.size() < size) temp_.resize(size);
+        horizontal_pass(src.buffer(), src_width, src_height, temp_.data(), w, bytespp);
+        vertical_pass(temp_.data(), w * bytespp, h, dst.buffer());
+    }
+}
+
+void Resampler::horizontal_pass(const uint8_t *src, int src_width, int rows, uint8_t *dst, int dst_width,
+                                int bytespp) {
+    const Weights &hw = horizontal_;
+    const int *first = hw.first.data(), *count = hw.count.data();
+    const int16_t *weights = hw.weights.data();
+    parallel_for(0, (rows + ROWS_PER_TASK - 1) / ROWS_PER_TASK, [&](int block) {
+        int y0 = block * ROWS_PER_TASK, y1 = min(rows, y0 + ROWS_PER_TASK);
+        switch (bytespp) {
+            case TGAImage::GRAYSCALE:
+                horizontal_rows<1>(src, src_width, dst, dst_width, first, count, weights, hw.stride, y0, y1);
+                break;
+            case TGAImage::RGB:
+                horizontal_rows<3>(src, src_width, dst, dst_width, first, count, weights, hw.stride, y0, y1);
+                break;
+            default:
+                horizontal_rows<4>(src, src_width, dst, dst_width, first, count, weights, hw.stride, y0, y1);
+                break;
+        }
+    }, parallel);
+}
+
+void Resampler::vertical_pass(const uint8_t *src, int row_bytes, int rows, uint8_t *dst) {
+    const Weights &vw = vertical_;
+    parallel_for(0, (rows + ROWS_PER_TASK - 1) / ROWS_PER_TASK, [&](int block) {
+        int y1 = min(rows, (block + 1) * ROWS_PER_TASK);
+        for (int y = block * ROWS_PER_TASK; y < y1; ++y) {
+            // 每个输出行是若干个输入行的加权和：整行连续的字节一起累加，一段一段地处理，累加值留在 L1 中
+            const int16_t *k = &vw.weights[size_t(y) * vw.stride];
+            const uint8_t *p = src + size_t(vw.first[y]) * row_bytes;
+            const int count = vw.count[y];
+            uint8_t *o = dst + size_t(y) * row_bytes;
+            for (int j0 = 0; j0 < row_bytes; j0 += CHUNK) {
+                const int n = min(CHUNK, row_bytes - j0);
+                int32_t acc[CHUNK];
+#pragma omp simd
+                for (int j = 0; j < n; ++j)
+                    acc[j] = 1 << (PRECISION - 1);
+                for (int t = 0; t < count; ++t) {
+                    const uint8_t *row = p + size_t(t) * row_bytes + j0;
+                    const int16_t weight = k[t];
+#pragma omp simd
+                    for (int j = 0; j < n; ++j)
+                        acc[j] += weight * int16_t(row[j]);
+                }
+#pragma omp simd
+                for (int j = 0; j < n; ++j)
+                    o[j0 + j] = clamp8(acc[j]);
+            }
+        }
+    }, parallel);
+}
+
+void Resampler::halve(const TGAImage &src, TGAImage &dst) {
+    const int bytespp = src.get_bytespp();
+    const int w = src.get_width() / 2, h = src.get_height() / 2;
+    if (dst.get_width() != w || dst.get_height() != h || dst.get_bytespp() != bytespp)
+        dst = TGAImage(w, h, bytespp);
+    const int src_row = src.get_width() * bytespp, dst_row = w * bytespp;
+    parallel_for(0, (h + ROWS_PER_TASK - 1) / ROWS_PER_TASK, [&](int block) {
+        uint16_t a[CHUNK];
+        const int pixels = CHUNK / (2 * bytespp);
+        int y1 = min(h, (block + 1) * ROWS_PER_TASK);
+        for (int y = block * ROWS_PER_TASK; y < y1; ++y) {
+            const uint8_t *r0 = src.buffer() + size_t(2 * y) * src_row, *r1 = r0 + src_row;
+            uint8_t *o = dst.buffer() + size_t(y) * dst_row;
+            // 一段一段地处理：先把两行逐字节相加，再把相邻两个像素的同一通道相加
+            for (int x0 = 0; x0 < w; x0 += pixels) {
+                const int n = min(pixels, w - x0), bytes = 2 * n * bytespp;
+                const uint8_t *p0 = r0 + size_t(x0) * 2 * bytespp, *p1 = r1 + size_t(x0) * 2 * bytespp;
+#pragma omp simd
+                for (int j = 0; j < bytes; ++j)
+                    a[j] = uint16_t(p0[j] + p1[j]);
+                switch (bytespp) {
+                    case TGAImage::GRAYSCALE: halve_row<1>(a, o + x0, n); break;
+                    case TGAImage::RGB: halve_row<3>(a, o + x0 * 3, n); break;
+                    default: halve_row<4>(a, o + x0 * 4, n); break;
+                }
+            }
+        }
+    }, parallel);
+}
+
+void Resampler::pyramid(const TGAImage &src, const vector<pair<int, int>> &sizes, vector<TGAImage> &outputs) {
+    outputs.resize(sizes.size());
+
+    // 每个尺寸使用宽高都不小于它的最小一级；一直减半到下一级比所有的尺寸都小为止
+    auto usable = [&](int lw, int lh, const pair<int, int> &size) {
+        return lw >= size.first && lh >= size.second;
+    };
+    vector<pair<int, int>> level_sizes;
+    int lw = src.get_width(), lh = src.get_height();
+    while (lw >= 2 && lh >= 2) {
+        int nw = lw / 2, nh = lh / 2;
+        bool needed = false;
+        for (const auto &size : sizes) needed |= usable(nw, nh, size);
+        if (!needed) break;
+        level_sizes.emplace_back(nw, nh);
+        lw = nw;
+        lh = nh;
+    }
+
+    // 逐级减半，第 0 级是 src 本身；宽高都是偶数时用专门的 2x2 平均，否则用一般的盒式滤波。
+    // 和某个输出尺寸相同的层级直接写入这个输出，不再复制
+    if (levels_.size() < level_sizes.size())
+        levels_.resize(level_sizes.size());
+    vector<const TGAImage *> levels = {&src};
+    vector<int> level_output(sizes.size(), -1);
+    for (size_t l = 0; l < level_sizes.size(); ++l) {
+        TGAImage *level = &levels_[l];
+        for (size_t i = 0; i < sizes.size(); ++i)
+            if (sizes[i] == level_sizes[l] && level_output[i] < 0) {
+                level = &outputs[i];
+                level_output[i] = int(l) + 1;
+                break;
+            }
+        const TGAImage &prev = *levels.back();
+        if (prev.get_width() % 2 == 0 && prev.get_height() % 2 == 0)
+            halve(prev, *level);
+        else
+            resample(BOX, prev, *level, level_sizes[l].first, level_sizes[l].second);
+        levels.push_back(level);
+    }
+
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        if (level_output[i] >= 0) continue;
+        const TGAImage *level = levels[0];
+        for (const TGAImage *l : levels)
+            if (usable(l->get_width(), l->get_height(), sizes[i])) level = l;
+        resample(filter, *level, outputs[i], sizes[i].first, sizes[i].second);
+    }
+}
@@ -0,0 +1,41 @@
+
+#include "scene.h"
+#include "my_gl.h"
+#include "transform.h"
+
+vec3 scene_light_pos() {
+    return vec3(0, 0.3, 1);
+}
+
+mat<4, 4> scene_model_matrix() {
+    return translation(0, 0, -200) * scaling(80);
+}
+
+mat<4, 4> scene_view_matrix() {
+    return lookat(vec3(0, 0, 0), vec3(0, 0, -1), vec3(0, 1, 0));
+}
+
+mat<4, 4> scene_projection(int width, int height) {
+    return projection(100 * width / height, 100, 100, 400);
+}
+
+void set_model_matrix(PhongShader &shader, const mat<4, 4> &model_matrix) {
+    shader.model_matrix = model_matrix;
+    shader.normal_matrix = model_matrix.invert_transpose();
+}
+
+void set_textures(PhongShader &shader, const Model &model) {
+    shader.diffuse_texture = &model.diffuse_map();
+    shader.normal_texture = &model.normal_map();
+    shader.specular_texture = &model.specular_map();
+}
+
+PhongShader make_phong_shader(const mat<4, 4> &model_matrix, int width, int height) {
+    PhongShader shader;
+    shader.light_pos = scene_light_pos();
+    shader.camera_pos = vec3(0, 0, 0);
+    set_model_matrix(shader, model_matrix);
+    shader.view_matrix = scene_view_matrix();
+    shader.projection_matrix = scene_projection(width, height);
+    return shader;
+}
@@ -0,0 +1,211 @@
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include "scene_generator.h"
+
+using namespace std;
+
+
+namespace {
+    /* 逐个三角形累积顶点、uv 和法线，最后构造 Model */
+    struct MeshBuilder {
+        vector<vec3> verts;
+        vector<vec2> uvs;
+        vector<vec3> norms;
+        vector<int> facet_vrt, facet_tex, facet_nrm;
+
+        int vertex(const vec3 &p, const vec2 &uv, const vec3 &n) {
+            verts.push_back(p);
+            uvs.push_back(uv);
+            norms.push_back(n);
+            return int(verts.size()) - 1;
+        }
+
+        /* 三个角共用顶点、uv 和法线的编号 */
+        void triangle(int a, int b, int c) {
+            for (int i : {a, b, c}) {
+                facet_vrt.push_back(i);
+                facet_tex.push_back(i);
+                facet_nrm.push_back(i);
+            }
+        }
+
+        /* 单独的平面三角形，法线朝向相机一侧，从相机看是逆时针 */
+        void flat_triangle(vec3 a, vec3 b, vec3 c) {
+            vec3 n = cross(b - a, c - a);
+            if (n.z < 0) {
+                swap(b, c);
+                n = n * -1;
+            }
+            if (n.norm2() > 0) n.normalize();
+            else n = vec3(0, 0, 1);
+            // 三个角共用一个法线
+            norms.push_back(n);
+            for (const vec3 &p : {a, b, c}) {
+                facet_vrt.push_back(int(verts.size()));
+                facet_tex.push_back(int(uvs.size()));
+                facet_nrm.push_back(int(norms.size()) - 1);
+                verts.push_back(p);
+                uvs.emplace_back((p.x + 1) / 2, (p.y + 1) / 2);
+            }
+        }
+
+        /* rings 个纬度带、2 * rings 个经度带的球，2 * segments * (rings - 1) 个三角形 */
+        void sphere(const vec3 &center, double radius, int rings) {
+            int segments = 2 * rings;
+            int first = int(verts.size());
+            for (int i = 0; i <= rings; ++i) {
+                double theta = M_PI * i / rings;
+                for (int j = 0; j <= segments; ++j) {
+                    double phi = 2 * M_PI * j / segments;
+                    vec3 n(sin(theta) * sin(phi), cos(theta), sin(theta) * cos(phi));
+                    vertex(center + n * radius, vec2(double(j) / segments, 1 - double(i) / rings), n);
+                }
+            }
+            // (i, j) 在上、左，两极的一圈只有一个三角形
+            for (int i = 0; i < rings; ++i)
+                for (int j = 0; j < segments; ++j) {
+                    int a = first + i * (segments + 1) + j, b = a + 1;
+                    int c = a + segments + 1, d = c + 1;
+                    if (i != rings - 1) triangle(a, c, d);
+                    if (i != 0) triangle(a, d, b);
+                }
+        }
+
+        Model build() {
+            return Model(move(verts), move(uvs), move(norms), move(facet_vrt), move(facet_tex), move(facet_nrm));
+        }
+    };
+}
+
+
+Model SceneGenerator::sphere(int triangles) {
+    MeshBuilder builder;
+    builder.sphere(vec3(0, 0, 0), 1, max(2, int(round(sqrt(max(triangles, 0) / 4.)))));
+    return builder.build();
+}
+
+Model SceneGenerator::grid(int instances) {
+    MeshBuilder builder;
+    int n = max(instances, 1);
+    int k = int(ceil(sqrt(double(n))));
+    double spacing = 2. / k;
+    for (int i = 0; i < n; ++i) {
+        vec3 center(-1 + (i % k + 0.5) * spacing, 1 - (i / k + 0.5) * spacing, 0);
+        builder.sphere(center, 0.4 * spacing, 12);
+    }
+    return builder.build();
+}
+
+Model SceneGenerator::planes(int layers) {
+    MeshBuilder builder;
+    int n = max(layers, 1);
+    for (int i = 0; i < n; ++i) {
+        // 在 z = -1 处也比视口大
+        double z = n == 1 ? 0 : -1 + 2. * i / (n - 1);
+        vec3 normal(0, 0, 1);
+        int a = builder.vertex(vec3(-2, -2, z), vec2(0, 0), normal);
+        int b = builder.vertex(vec3(2, -2, z), vec2(1, 0), normal);
+        int c = builder.vertex(vec3(2, 2, z), vec2(1, 1), normal);
+        int d = builder.vertex(vec3(-2, 2, z), vec2(0, 1), normal);
+        builder.triangle(a, b, c);
+        builder.triangle(a, c, d);
+    }
+    return builder.build();
+}
+
+Model SceneGenerator::slivers(int triangles) {
+    MeshBuilder builder;
+    uniform_real_distribution<double> unit(-1, 1);
+    for (int i = 0; i < triangles; ++i) {
+        vec3 p, q;
+        do {
+            p = vec3(unit(rng_), unit(rng_), 0);
+            q = vec3(unit(rng_), unit(rng_), 0);
+        } while ((q - p).norm2() < 1);
+        double z = unit(rng_);
+        p.z = q.z = z;
+        vec3 d = (q - p).normalize();
+        builder.flat_triangle(p, q, p + vec3(-d.y, d.x, 0) * 0.002);
+    }
+    return builder.build();
+}
+
+Model SceneGenerator::cloud(int triangles) {
+    MeshBuilder builder;
+    uniform_real_distribution<double> unit(-1, 1);
+    for (int i = 0; i < triangles; ++i) {
+        vec3 center(unit(rng_), unit(rng_), unit(rng_));
+        vec3 corners[3];
+        for (vec3 &c : corners)
+            c = center + vec3(unit(rng_), unit(rng_), unit(rng_)) * 0.001;
+        builder.flat_triangle(corners[0], corners[1], corners[2]);
+    }
+    return builder.build();
+}
+
+Model SceneGenerator::fullscreen(int triangles) {
+    MeshBuilder builder;
+    uniform_real_distribution<double> angle(0, 2 * M_PI);
+    int n = max(triangles, 1);
+    for (int i = 0; i < n; ++i) {
+        // 内切圆半径为 4 的正三角形，随机旋转后仍然覆盖整个视口
+        double z = n == 1 ? 0 : -1 + 2. * i / (n - 1);
+        double a = angle(rng_);
+        vec3 corners[3];
+        for (int j = 0; j < 3; ++j)
+            corners[j] = vec3(8 * cos(a + j * 2 * M_PI / 3), 8 * sin(a + j * 2 * M_PI / 3), z);
+        builder.flat_triangle(corners[0], corners[1], corners[2]);
+    }
+    return builder.build();
+}
+
+bool SceneGenerator::generate(const string &name, int size, Model &model) {
+    if (name == "sphere") model = sphere(size);
+    else if (name == "grid") model = grid(size);
+    else if (name == "planes") model = planes(size);
+    else if (name == "slivers") model = slivers(size);
+    else if (name == "cloud") model = cloud(size);
+    else if (name == "fullscreen") model = fullscreen(size);
+    else return false;
+    return true;
+}
+
+const vector<string> &SceneGenerator::names() {
+    static const vector<string> res = {"sphere", "grid", "planes", "slivers", "cloud", "fullscreen"};
+    return res;
+}
+
+void SceneGenerator::set_default_textures(Model &model) {
+    const int size = 256, cell = 32;
+    TGAImage diffuse(size, size, TGAImage::RGB);
+    TGAImage normal(size, size, TGAImage::RGB);
+    TGAImage specular(size, size, TGAImage::GRAYSCALE);
+    for (int y = 0; y < size; ++y)
+        for (int x = 0; x < size; ++x) {
+            bool dark = (x / cell + y / cell) % 2;
+            diffuse.set(x, y, dark ? TGAColor(90, 100, 120) : TGAColor(220, 210, 190));
+            normal.set(x, y, TGAColor(128, 128, 255));
+            specular.set(x, y, TGAColor(dark ? 5 : 20));
+        }
+    model.set_textures(move(diffuse), move(normal), move(specular));
+}
+
+bool SceneGenerator::write(const Model &model, const string &filename) {
+    if (!model.write_obj(filename)) return false;
+    const pair<const TGAImage *, const char *> maps[] = {{&model.diffuse_map(), "_diffuse.tga"},
+                                                         {&model.normal_map(), "_nm_tangent.tga"},
+                                                         {&model.specular_map(), "_spec.tga"}};
+    // 和自带的贴图一样按左下角为原点写出：read_tga_file 读回时翻转一次，Model::load_texture 再翻转一次，
+    // 得到的行顺序和内存中的贴图相同（第 0 行是 v = 0）。只改成左上角原点的话读回的贴图会上下颠倒
+    for (const auto &map : maps) {
+        string texture = Model::texture_filename(filename, map.second);
+        if (texture.empty() || map.first->get_width() == 0) continue;
+        if (!map.first->write_tga_file(texture, true)) {
+            cerr << "can't write " << texture << endl;
+            return false;
+        }
+    }
+    return true;
+}
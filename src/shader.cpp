@@ -2,6 +2,339 @@
 
 #include "shader.h"
 
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 using namespace std;
 
 
+namespace {
+    /* 和 vec 的点积相同的求和顺序，保证和逐像素的结果一致 */
+    inline double dot3(double ax, double ay, double az, double bx, double by, double bz) {
+        return az * bz + ay * by + ax * bx;
+    }
+
+    /* 直接读取纹素，越界或者贴图为空时和 TGAImage::get 一样返回 0 */
+    inline const std::uint8_t *texel(const TGAImage &image, const vec2 &uv) {
+        static const std::uint8_t zero[4] = {0, 0, 0, 0};
+        int x = int(uv.x * image.get_width()), y = int(uv.y * image.get_height());
+        if (x < 0 || y < 0 || x >= image.get_width() || y >= image.get_height()) return zero;
+        return image.buffer() + (size_t(y) * image.get_width() + x) * image.get_bytespp();
+    }
+
+    inline void normalize3(double &x, double &y, double &z) {
+        double norm = std::sqrt(dot3(x, y, z, x, y, z));
+        x /= norm;
+        y /= norm;
+        z /= norm;
+    }
+
+#if defined(__AVX__)
+    /* quad 的 4 个 lane 放在一个 AVX 寄存器中 */
+    struct Lanes {
+        __m256d v;
+
+        static Lanes load(const double *p) { return {_mm256_loadu_pd(p)}; }
+        static Lanes broadcast(double a) { return {_mm256_set1_pd(a)}; }
+        void store(double *p) const { _mm256_storeu_pd(p, v); }
+    };
+
+    inline Lanes operator+(Lanes a, Lanes b) { return {_mm256_add_pd(a.v, b.v)}; }
+    inline Lanes operator-(Lanes a, Lanes b) { return {_mm256_sub_pd(a.v, b.v)}; }
+    inline Lanes operator*(Lanes a, Lanes b) { return {_mm256_mul_pd(a.v, b.v)}; }
+    inline Lanes operator/(Lanes a, Lanes b) { return {_mm256_div_pd(a.v, b.v)}; }
+    inline Lanes sqrt(Lanes a) { return {_mm256_sqrt_pd(a.v)}; }
+
+    // std::max(0., a)：a 不大于 0 或者是 NaN 时取 +0
+    inline Lanes max0(Lanes a) { return {_mm256_max_pd(a.v, _mm256_setzero_pd())}; }
+
+    // a < 0 ? -1 : 1
+    inline Lanes sign_of(Lanes a) {
+        __m256d negative = _mm256_cmp_pd(a.v, _mm256_setzero_pd(), _CMP_LT_OQ);
+        return {_mm256_or_pd(_mm256_set1_pd(1.), _mm256_and_pd(negative, _mm256_set1_pd(-0.)))};
+    }
+
+    // 截断成 4 个 int，和 int(a) 相同
+    inline __m128i truncate(Lanes a) { return _mm256_cvttpd_epi32(a.v); }
+#elif defined(__SSE2__)
+    /* quad 的 4 个 lane 放在两个 SSE2 寄存器中 */
+    struct Lanes {
+        __m128d lo, hi;
+
+        static Lanes load(const double *p) { return {_mm_loadu_pd(p), _mm_loadu_pd(p + 2)}; }
+        static Lanes broadcast(double a) { return {_mm_set1_pd(a), _mm_set1_pd(a)}; }
+        void store(double *p) const {
+            _mm_storeu_pd(p, lo);
+            _mm_storeu_pd(p + 2, hi);
+        }
+    };
+
+    inline Lanes operator+(Lanes a, Lanes b) { return {_mm_add_pd(a.lo, b.lo), _mm_add_pd(a.hi, b.hi)}; }
+    inline Lanes operator-(Lanes a, Lanes b) { return {_mm_sub_pd(a.lo, b.lo), _mm_sub_pd(a.hi, b.hi)}; }
+    inline Lanes operator*(Lanes a, Lanes b) { return {_mm_mul_pd(a.lo, b.lo), _mm_mul_pd(a.hi, b.hi)}; }
+    inline Lanes operator/(Lanes a, Lanes b) { return {_mm_div_pd(a.lo, b.lo), _mm_div_pd(a.hi, b.hi)}; }
+    inline Lanes sqrt(Lanes a) { return {_mm_sqrt_pd(a.lo), _mm_sqrt_pd(a.hi)}; }
+
+    // std::max(0., a)：a 不大于 0 或者是 NaN 时取 +0
+    inline Lanes max0(Lanes a) { return {_mm_max_pd(a.lo, _mm_setzero_pd()), _mm_max_pd(a.hi, _mm_setzero_pd())}; }
+
+    // a < 0 ? -1 : 1
+    inline __m128d sign_of(__m128d a) {
+        __m128d negative = _mm_cmplt_pd(a, _mm_setzero_pd());
+        return _mm_or_pd(_mm_set1_pd(1.), _mm_and_pd(negative, _mm_set1_pd(-0.)));
+    }
+
+    inline Lanes sign_of(Lanes a) { return {sign_of(a.lo), sign_of(a.hi)}; }
+
+    // 截断成 4 个 int，和 int(a) 相同
+    inline __m128i truncate(Lanes a) { return _mm_unpacklo_epi64(_mm_cvttpd_epi32(a.lo), _mm_cvttpd_epi32(a.hi)); }
+#endif
+
+#ifdef __SSE2__
+    /* 只用逐元素的加减乘除和开方，求和顺序和标量的 dot3 相同，不会收缩成 FMA，结果逐位相同 */
+    inline Lanes dot3(Lanes ax, Lanes ay, Lanes az, Lanes bx, Lanes by, Lanes bz) {
+        return az * bz + ay * by + ax * bx;
+    }
+
+    // 对 4 个 lane 用同一组系数插值，a 是三个顶点的属性
+    inline Lanes dot3(const vec3 &a, Lanes bx, Lanes by, Lanes bz) {
+        return dot3(Lanes::broadcast(a[0]), Lanes::broadcast(a[1]), Lanes::broadcast(a[2]), bx, by, bz);
+    }
+
+    inline void normalize3(Lanes &x, Lanes &y, Lanes &z) {
+        Lanes norm = sqrt(dot3(x, y, z, x, y, z));
+        x = x / norm;
+        y = y / norm;
+        z = z / norm;
+    }
+
+    /* 4 个 lane 的纹素：坐标截断和越界判断一起做，读取仍然逐 lane，
+       24 位的贴图用 32 位的 gather 会读到最后一个纹素之后 */
+    inline void texels(const TGAImage &image, const double u[4], const double v[4], const std::uint8_t *out[4]) {
+        static const std::uint8_t zero[4] = {0, 0, 0, 0};
+        int w = image.get_width(), h = image.get_height();
+        __m128i x = truncate(Lanes::load(u) * Lanes::broadcast(w));
+        __m128i y = truncate(Lanes::load(v) * Lanes::broadcast(h));
+        __m128i inside = _mm_and_si128(
+                _mm_and_si128(_mm_cmpgt_epi32(x, _mm_set1_epi32(-1)), _mm_cmpgt_epi32(y, _mm_set1_epi32(-1))),
+                _mm_and_si128(_mm_cmplt_epi32(x, _mm_set1_epi32(w)), _mm_cmplt_epi32(y, _mm_set1_epi32(h))));
+        alignas(16) int xs[4], ys[4];
+        _mm_store_si128(reinterpret_cast<__m128i *>(xs), x);
+        _mm_store_si128(reinterpret_cast<__m128i *>(ys), y);
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(inside));
+        for (int l = 0; l < 4; ++l)
+            out[l] = mask >> l & 1 ? image.buffer() + (size_t(ys[l]) * w + xs[l]) * image.get_bytespp() : zero;
+    }
+#else
+    inline void texels(const TGAImage &image, const double u[4], const double v[4], const std::uint8_t *out[4]) {
+        for (int l = 0; l < 4; ++l) out[l] = texel(image, vec2(u[l], v[l]));
+    }
+#endif
+}
+
+
+void PhongShader::fragment_quad(const FragmentQuad &quad, TGAColor colors[4]) {
+    // 重心坐标
+    double b0[4], b1[4], b2[4];
+    for (int l = 0; l < 4; ++l) {
+        b0[l] = quad.bary[l].x;
+        b1[l] = quad.bary[l].y;
+        b2[l] = quad.bary[l].z;
+    }
+
+    // 插值 uv、世界坐标、法线和切线；辅助像素也要计算，用来求导数
+    double u[4], v[4], px[4], py[4], pz[4], nx[4], ny[4], nz[4], tx[4], ty[4], tz[4];
+#ifdef __SSE2__
+    const Lanes b0_4 = Lanes::load(b0), b1_4 = Lanes::load(b1), b2_4 = Lanes::load(b2);
+    {
+        dot3(uvs[0], b0_4, b1_4, b2_4).store(u);
+        dot3(uvs[1], b0_4, b1_4, b2_4).store(v);
+        dot3(world_ps[0], b0_4, b1_4, b2_4).store(px);
+        dot3(world_ps[1], b0_4, b1_4, b2_4).store(py);
+        dot3(world_ps[2], b0_4, b1_4, b2_4).store(pz);
+        Lanes nx4 = dot3(world_ns[0], b0_4, b1_4, b2_4);
+        Lanes ny4 = dot3(world_ns[1], b0_4, b1_4, b2_4);
+        Lanes nz4 = dot3(world_ns[2], b0_4, b1_4, b2_4);
+        normalize3(nx4, ny4, nz4);
+
+        // 切线和法线正交化
+        Lanes tx4 = dot3(world_ts[0], b0_4, b1_4, b2_4);
+        Lanes ty4 = dot3(world_ts[1], b0_4, b1_4, b2_4);
+        Lanes tz4 = dot3(world_ts[2], b0_4, b1_4, b2_4);
+        Lanes n_dot_t = dot3(nx4, ny4, nz4, tx4, ty4, tz4);
+        tx4 = tx4 - nx4 * n_dot_t;
+        ty4 = ty4 - ny4 * n_dot_t;
+        tz4 = tz4 - nz4 * n_dot_t;
+        normalize3(tx4, ty4, tz4);
+
+        nx4.store(nx);
+        ny4.store(ny);
+        nz4.store(nz);
+        tx4.store(tx);
+        ty4.store(ty);
+        tz4.store(tz);
+    }
+#else
+#pragma omp simd
+    for (int l = 0; l < 4; ++l) {
+        u[l] = dot3(uvs[0][0], uvs[0][1], uvs[0][2], b0[l], b1[l], b2[l]);
+        v[l] = dot3(uvs[1][0], uvs[1][1], uvs[1][2], b0[l], b1[l], b2[l]);
+        px[l] = dot3(world_ps[0][0], world_ps[0][1], world_ps[0][2], b0[l], b1[l], b2[l]);
+        py[l] = dot3(world_ps[1][0], world_ps[1][1], world_ps[1][2], b0[l], b1[l], b2[l]);
+        pz[l] = dot3(world_ps[2][0], world_ps[2][1], world_ps[2][2], b0[l], b1[l], b2[l]);
+        nx[l] = dot3(world_ns[0][0], world_ns[0][1], world_ns[0][2], b0[l], b1[l], b2[l]);
+        ny[l] = dot3(world_ns[1][0], world_ns[1][1], world_ns[1][2], b0[l], b1[l], b2[l]);
+        nz[l] = dot3(world_ns[2][0], world_ns[2][1], world_ns[2][2], b0[l], b1[l], b2[l]);
+        normalize3(nx[l], ny[l], nz[l]);
+
+        // 切线和法线正交化
+        tx[l] = dot3(world_ts[0][0], world_ts[0][1], world_ts[0][2], b0[l], b1[l], b2[l]);
+        ty[l] = dot3(world_ts[1][0], world_ts[1][1], world_ts[1][2], b0[l], b1[l], b2[l]);
+        tz[l] = dot3(world_ts[2][0], world_ts[2][1], world_ts[2][2], b0[l], b1[l], b2[l]);
+        double n_dot_t = dot3(nx[l], ny[l], nz[l], tx[l], ty[l], tz[l]);
+        tx[l] -= nx[l] * n_dot_t;
+        ty[l] -= ny[l] * n_dot_t;
+        tz[l] -= nz[l] * n_dot_t;
+        normalize3(tx[l], ty[l], tz[l]);
+    }
+#endif
+
+    // 由 quad 中相邻像素的 uv 差选择 mipmap 层级
+    double lod = 0;
+    if (diffuse_mipmap)
+        lod = diffuse_mipmap->lod(vec2(FragmentQuad::ddx(u), FragmentQuad::ddx(v)),
+                                  vec2(FragmentQuad::ddy(u), FragmentQuad::ddy(v)));
+
+    // 纹理采样：4 个 lane 一起算纹素地址，再逐 lane 读取
+    double diffuse_c[3][4], tnx[4], tny[4], tnz[4], spec_intens[4];
+    const std::uint8_t *diffuse_texels[4], *normal_texels[4], *specular_texels[4];
+    if (!diffuse_mipmap) texels(*diffuse_texture, u, v, diffuse_texels);
+    texels(*normal_texture, u, v, normal_texels);
+    texels(*specular_texture, u, v, specular_texels);
+    for (int l = 0; l < 4; ++l) {
+        if (diffuse_mipmap) {
+            TGAColor c = diffuse_mipmap->sample(vec2(u[l], v[l]), lod);
+            for (int i = 0; i < 3; ++i) diffuse_c[i][l] = c[i];
+        } else {
+            for (int i = 0; i < 3; ++i) diffuse_c[i][l] = diffuse_texels[l][i];
+        }
+        const std::uint8_t *nc = normal_texels[l];
+        tnx[l] = nc[2] / 255. * 2 - 1;
+        tny[l] = nc[1] / 255. * 2 - 1;
+        tnz[l] = nc[0] / 255. * 2 - 1;
+        spec_intens[l] = specular_texels[l][0];
+    }
+
+    // 法线贴图解码到世界坐标，漫反射和高光的几何项
+    double diffuse[4], spec_base[4];
+    double fnx[4], fny[4], fnz[4], cxs[4], cys[4], czs[4];
+#ifdef __SSE2__
+    {
+        const Lanes nx4 = Lanes::load(nx), ny4 = Lanes::load(ny), nz4 = Lanes::load(nz);
+        const Lanes tx4 = Lanes::load(tx), ty4 = Lanes::load(ty), tz4 = Lanes::load(tz);
+        const Lanes px4 = Lanes::load(px), py4 = Lanes::load(py), pz4 = Lanes::load(pz);
+        const Lanes tnx4 = Lanes::load(tnx), tny4 = Lanes::load(tny), tnz4 = Lanes::load(tnz);
+
+        // 副切线 sign * cross(n, t)，sign 取插值后的符号，和 shade 相同
+        Lanes sign = sign_of(dot3(tangent_signs, b0_4, b1_4, b2_4));
+        Lanes bx = (ny4 * tz4 - nz4 * ty4) * sign;
+        Lanes by = (nz4 * tx4 - nx4 * tz4) * sign;
+        Lanes bz = (nx4 * ty4 - ny4 * tx4) * sign;
+        Lanes n_x = dot3(tx4, bx, nx4, tnx4, tny4, tnz4);
+        Lanes n_y = dot3(ty4, by, ny4, tnx4, tny4, tnz4);
+        Lanes n_z = dot3(tz4, bz, nz4, tnx4, tny4, tnz4);
+        normalize3(n_x, n_y, n_z);
+
+        Lanes lx = px4 - Lanes::broadcast(light_pos.x);
+        Lanes ly = py4 - Lanes::broadcast(light_pos.y);
+        Lanes lz = pz4 - Lanes::broadcast(light_pos.z);
+        normalize3(lx, ly, lz);
+
+        const Lanes minus_one = Lanes::broadcast(-1), two = Lanes::broadcast(2);
+        Lanes n_dot_l = dot3(n_x, n_y, n_z, lx, ly, lz);
+        max0(dot3(minus_one * n_x, minus_one * n_y, minus_one * n_z, lx, ly, lz)).store(diffuse);
+
+        Lanes rx = lx - two * n_x * n_dot_l, ry = ly - two * n_y * n_dot_l, rz = lz - two * n_z * n_dot_l;
+        Lanes cx = Lanes::broadcast(camera_pos.x) - px4;
+        Lanes cy = Lanes::broadcast(camera_pos.y) - py4;
+        Lanes cz = Lanes::broadcast(camera_pos.z) - pz4;
+        normalize3(cx, cy, cz);
+        max0(dot3(cx, cy, cz, rx, ry, rz)).store(spec_base);
+
+        n_x.store(fnx);
+        n_y.store(fny);
+        n_z.store(fnz);
+        cx.store(cxs);
+        cy.store(cys);
+        cz.store(czs);
+    }
+#else
+#pragma omp simd
+    for (int l = 0; l < 4; ++l) {
+        // 副切线 sign * cross(n, t)，sign 取插值后的符号，和 shade 相同
+        double sign = dot3(tangent_signs[0], tangent_signs[1], tangent_signs[2], b0[l], b1[l], b2[l]) < 0 ? -1. : 1.;
+        double bx = (ny[l] * tz[l] - nz[l] * ty[l]) * sign;
+        double by = (nz[l] * tx[l] - nx[l] * tz[l]) * sign;
+        double bz = (nx[l] * ty[l] - ny[l] * tx[l]) * sign;
+        double n_x = dot3(tx[l], bx, nx[l], tnx[l], tny[l], tnz[l]);
+        double n_y = dot3(ty[l], by, ny[l], tnx[l], tny[l], tnz[l]);
+        double n_z = dot3(tz[l], bz, nz[l], tnx[l], tny[l], tnz[l]);
+        normalize3(n_x, n_y, n_z);
+
+        double lx = px[l] - light_pos.x, ly = py[l] - light_pos.y, lz = pz[l] - light_pos.z;
+        normalize3(lx, ly, lz);
+
+        double n_dot_l = dot3(n_x, n_y, n_z, lx, ly, lz);
+        diffuse[l] = std::max(0., dot3(-1 * n_x, -1 * n_y, -1 * n_z, lx, ly, lz));
+
+        double rx = lx - 2 * n_x * n_dot_l, ry = ly - 2 * n_y * n_dot_l, rz = lz - 2 * n_z * n_dot_l;
+        double cx = camera_pos.x - px[l], cy = camera_pos.y - py[l], cz = camera_pos.z - pz[l];
+        normalize3(cx, cy, cz);
+        spec_base[l] = std::max(0., dot3(cx, cy, cz, rx, ry, rz));
+
+        fnx[l] = n_x;
+        fny[l] = n_y;
+        fnz[l] = n_z;
+        cxs[l] = cx;
+        cys[l] = cy;
+        czs[l] = cz;
+    }
+#endif
+
+    // 点光源：只遍历 quad 所在块的光源
+    double point[3][4] = {};
+    if (light_grid) {
+        int n_lights;
+        const int *lights = light_grid->tile_lights(quad.x, quad.y, n_lights);
+        for (int l = 0; l < 4; ++l) {
+            if (!(quad.mask >> l & 1)) continue;
+            double sum[3] = {0, 0, 0};
+            vec3 pos(px[l], py[l], pz[l]), n(fnx[l], fny[l], fnz[l]), pos2camera(cxs[l], cys[l], czs[l]);
+            for (int k = 0; k < n_lights; ++k)
+                add_point_light(light_grid->lights()[lights[k]], pos, n, pos2camera, spec_intens[l], sum);
+            for (int i = 0; i < 3; ++i) point[i][l] = sum[i];
+        }
+    }
+
+    // phong 光照的参数
+    double ambient = 5.;
+    double diffuse_coeff = 1.0;
+    double spec_coeff = 0.2;
+
+    for (int l = 0; l < 4; ++l) {
+        if (!(quad.mask >> l & 1)) continue;
+        double specular = pow(spec_base[l], spec_intens[l]);
+        double shadow_coeff, occlusion;
+        shadowing(vec3(px[l], py[l], pz[l]), shadow_coeff, occlusion);
+
+        TGAColor &color = colors[l];
+        color = TGAColor(0, 0, 0);
+        for (int i = 0; i < 3; ++i)
+            color[i] = std::min(255., occlusion * (ambient + diffuse_c[i][l] * shadow_coeff
+                                                               * (diffuse_coeff * diffuse[l] + spec_coeff * specular)
+                                                   + diffuse_c[i][l] * point[i][l]));
+    }
+}
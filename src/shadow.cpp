@@ -0,0 +1,130 @@
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include "shadow.h"
+#include "hash.h"
+
+using namespace std;
+
+
+ShadowMap::ShadowMap(int width, int height)
+        : width(width), height(height), light_matrix(mat<4, 4>::identity()), depth(width * height, 1.f) {
+    assert(width > 0 && height > 0);
+}
+
+void ShadowMap::set_light(const mat<4, 4> &view_matrix, const mat<4, 4> &projection_matrix) {
+    // 标准化设备坐标到阴影贴图屏幕坐标，深度映射到 [0, 1]
+    mat<4, 4> view_port = mat<4, 4>::identity();
+    view_port[0][0] = width / 2.;
+    view_port[0][3] = width / 2.;
+    view_port[1][1] = height / 2.;
+    view_port[1][3] = height / 2.;
+    view_port[2][2] = 0.5;
+    view_port[2][3] = 0.5;
+
+    light_matrix = view_port * projection_matrix * view_matrix;
+}
+
+void ShadowMap::clear() {
+    std::fill(depth.begin(), depth.end(), 1.f);
+}
+
+double ShadowMap::lit(const vec3 &world_pos, int pcf_radius, double bias) const {
+    vec4 p = light_matrix * embed<4>(world_pos);
+    if (p[3] == 0) return 1.;
+    p = p / p[3];
+
+    int cx = int(std::floor(p.data[0]));
+    int cy = int(std::floor(p.data[1]));
+    double z = p.data[2] - bias;
+
+    // 阴影贴图之外的点认为是被照亮的
+    int n_lit = 0;
+    int n_total = 0;
+    for (int y = cy - pcf_radius; y <= cy + pcf_radius; ++y) {
+        for (int x = cx - pcf_radius; x <= cx + pcf_radius; ++x) {
+            ++n_total;
+            if (x < 0 || y < 0 || x >= width || y >= height || z <= get(x, y))
+                ++n_lit;
+        }
+    }
+    return double(n_lit) / n_total;
+}
+
+std::uint64_t ShadowMap::content_hash() const {
+    Hasher h;
+    h << width << height << light_matrix;
+    h.bytes(depth.data(), depth.size() * sizeof(float));
+    return h.value();
+}
+
+
+void render_depth(ShadowMap &shadow_map, const Model &model, const mat<4, 4> &model_matrix, FrameArena *arena) {
+    struct ScreenVert {
+        float x, y, z;
+        bool valid;
+    };
+
+    // 所有顶点只变换一次，变换后的顶点放在帧内存中
+    FrameArena local_arena(size_t(model.nverts()) * sizeof(ScreenVert) + 64);
+    ScreenVert *verts = (arena ? arena : &local_arena)->alloc<ScreenVert>(model.nverts());
+    mat<4, 4> m = shadow_map.light_matrix * model_matrix;
+    for (int i = 0; i < model.nverts(); ++i) {
+        vec4 p = m * embed<4>(model.vert(i));
+        if (p[3] == 0) {
+            verts[i].valid = false;
+            continue;
+        }
+        verts[i] = {float(p[0] / p[3]), float(p[1] / p[3]), float(p[2] / p[3]), true};
+    }
+
+    const int width = shadow_map.width;
+    const int height = shadow_map.height;
+    float *depth = shadow_map.depth.data();
+
+    for (int f = 0; f < model.nfaces(); ++f) {
+        const ScreenVert &a = verts[model.facet_vert(f, 0)];
+        const ScreenVert &b = verts[model.facet_vert(f, 1)];
+        const ScreenVert &c = verts[model.facet_vert(f, 2)];
+        if (!a.valid || !b.valid || !c.valid) continue;
+
+        float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+        if (std::abs(area) < 1e-8f) continue;
+        float inv_area = 1.f / area;
+
+        // 包围盒，采样点在像素中心
+        int x0 = max(0, int(std::floor(min({a.x, b.x, c.x}))));
+        int y0 = max(0, int(std::floor(min({a.y, b.y, c.y}))));
+        int x1 = min(width - 1, int(std::ceil(max({a.x, b.x, c.x}))));
+        int y1 = min(height - 1, int(std::ceil(max({a.y, b.y, c.y}))));
+        if (x0 > x1 || y0 > y1) continue;
+
+        // 归一化的边函数 w0 w1 w2 是重心坐标，沿 x 方向增量计算
+        float dw0_dx = (b.y - c.y) * inv_area, dw0_dy = (c.x - b.x) * inv_area;
+        float dw1_dx = (c.y - a.y) * inv_area, dw1_dy = (a.x - c.x) * inv_area;
+        float dw2_dx = (a.y - b.y) * inv_area, dw2_dy = (b.x - a.x) * inv_area;
+        float px = x0 + 0.5f, py = y0 + 0.5f;
+        float w0_row = ((b.x - px) * (c.y - py) - (b.y - py) * (c.x - px)) * inv_area;
+        float w1_row = ((c.x - px) * (a.y - py) - (c.y - py) * (a.x - px)) * inv_area;
+        float w2_row = 1.f - w0_row - w1_row;
+
+        for (int y = y0; y <= y1; ++y) {
+            float w0 = w0_row, w1 = w1_row, w2 = w2_row;
+            float *row = depth + y * width;
+            for (int x = x0; x <= x1; ++x) {
+                if (w0 >= 0 && w1 >= 0 && w2 >= 0) {
+                    float z = w0 * a.z + w1 * b.z + w2 * c.z;
+                    if (z >= 0 && z < row[x]) row[x] = z;
+                }
+                w0 += dw0_dx;
+                w1 += dw1_dx;
+                w2 += dw2_dx;
+            }
+            w0_row += dw0_dy;
+            w1_row += dw1_dy;
+            w2_row += dw2_dy;
+        }
+    }
+}
@@ -0,0 +1,81 @@
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "shared_memory.h"
+
+using namespace std;
+
+
+bool SharedMemory::create(const string &name, size_t size) {
+    close();
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        cerr << "can't create shared memory " << name << ": " << strerror(errno) << endl;
+        return false;
+    }
+    if (ftruncate(fd, off_t(size)) != 0) {
+        cerr << "can't resize shared memory " << name << ": " << strerror(errno) << endl;
+        ::close(fd);
+        shm_unlink(name.c_str());
+        return false;
+    }
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        cerr << "can't map shared memory " << name << ": " << strerror(errno) << endl;
+        shm_unlink(name.c_str());
+        return false;
+    }
+    name_ = name;
+    data_ = p;
+    size_ = size;
+    return true;
+}
+
+bool SharedMemory::open(const string &name, bool writable) {
+    close();
+    int fd = shm_open(name.c_str(), writable ? O_RDWR : O_RDONLY, 0);
+    if (fd < 0) {
+        cerr << "can't open shared memory " << name << ": " << strerror(errno) << endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        cerr << "bad shared memory " << name << endl;
+        ::close(fd);
+        return false;
+    }
+    void *p = mmap(nullptr, size_t(st.st_size), writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        cerr << "can't map shared memory " << name << ": " << strerror(errno) << endl;
+        return false;
+    }
+    name_ = name;
+    data_ = p;
+    size_ = size_t(st.st_size);
+    return true;
+}
+
+bool SharedMemory::exists(const string &name) {
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) return false;
+    ::close(fd);
+    return true;
+}
+
+void SharedMemory::close() {
+    if (data_) munmap(data_, size_);
+    data_ = nullptr;
+    size_ = 0;
+}
+
+void SharedMemory::unlink() {
+    if (!name_.empty()) shm_unlink(name_.c_str());
+}
@@ -0,0 +1,304 @@
+
+#include <cassert>
+#include <chrono>
+#include "task_scheduler.h"
+
+using namespace std;
+
+
+struct TaskScheduler::Task {
+    TaskScheduler *owner = nullptr;
+    function<void()> fn;
+    // handle、后继列表和队列各持有一个引用，为 0 时回到空闲列表
+    atomic<int> refs{0};
+    // 没有完成的依赖数，加上提交过程本身的 1
+    atomic<int> pending{0};
+    atomic<bool> finished{false};
+    // 保护 successors，以及 finished 和 successors 之间的一致性
+    mutex lock;
+    vector<Task *> successors;
+};
+
+/* 一个线程的双端队列：环形缓冲，容量只增不减，稳定状态下不分配内存 */
+struct TaskScheduler::Queue {
+    mutex lock;
+    vector<Task *> ring = vector<Task *>(64);
+    size_t head = 0;
+    size_t count = 0;
+
+    void push_back(Task *task) {
+        lock_guard<mutex> guard(lock);
+        if (count == ring.size()) {
+            vector<Task *> bigger(ring.size() * 2);
+            for (size_t i = 0; i < count; ++i)
+                bigger[i] = ring[(head + i) % ring.size()];
+            ring.swap(bigger);
+            head = 0;
+        }
+        ring[(head + count++) % ring.size()] = task;
+    }
+
+    Task *pop_back() {
+        lock_guard<mutex> guard(lock);
+        if (count == 0) return nullptr;
+        return ring[(head + --count) % ring.size()];
+    }
+
+    Task *pop_front() {
+        lock_guard<mutex> guard(lock);
+        if (count == 0) return nullptr;
+        Task *task = ring[head];
+        head = (head + 1) % ring.size();
+        --count;
+        return task;
+    }
+};
+
+
+static thread_local const TaskScheduler *tls_scheduler = nullptr;
+static thread_local int tls_index = 0;
+// 当前线程上正在执行的任务的嵌套层数，等待时执行的任务的时间已经算在外层任务中
+static thread_local int tls_depth = 0;
+
+static int global_threads = 0;
+
+
+TaskScheduler::TaskHandle::TaskHandle(Task *task) : task_(task) {
+    if (task_) task_->refs.fetch_add(1, memory_order_relaxed);
+}
+
+TaskScheduler::TaskHandle::TaskHandle(const TaskHandle &other) : TaskHandle(other.task_) {}
+
+TaskScheduler::TaskHandle &TaskScheduler::TaskHandle::operator=(const TaskHandle &other) {
+    if (other.task_) other.task_->refs.fetch_add(1, memory_order_relaxed);
+    if (task_) release(task_);
+    task_ = other.task_;
+    return *this;
+}
+
+TaskScheduler::TaskHandle::~TaskHandle() {
+    if (task_) release(task_);
+}
+
+bool TaskScheduler::TaskHandle::done() const {
+    return !task_ || task_->finished.load(memory_order_acquire);
+}
+
+
+TaskScheduler::TaskScheduler(int n_threads) : pending_(0), sleeping_(0) {
+    if (n_threads <= 0)
+        n_threads = int(max(1u, thread::hardware_concurrency()));
+    n_threads_ = n_threads;
+    for (int i = 0; i < n_threads_; ++i)
+        queues_.emplace_back(new Queue());
+    counters_.reset(new Counters[n_threads_]);
+    reset_stats();
+    // 下标 0 留给外部线程
+    for (int i = 1; i < n_threads_; ++i)
+        workers_.emplace_back([this, i]() { worker_loop(i); });
+}
+
+TaskScheduler::~TaskScheduler() {
+    {
+        lock_guard<mutex> guard(sleep_mutex_);
+        stop_ = true;
+    }
+    sleep_cond_.notify_all();
+    for (auto &t : workers_)
+        t.join();
+}
+
+TaskScheduler &TaskScheduler::global() {
+    static TaskScheduler scheduler(global_threads);
+    return scheduler;
+}
+
+void TaskScheduler::set_global_threads(int n_threads) {
+    global_threads = n_threads;
+}
+
+int TaskScheduler::thread_index() const {
+    return tls_scheduler == this ? tls_index : 0;
+}
+
+TaskScheduler::Task *TaskScheduler::acquire_task() {
+    Task *task;
+    {
+        lock_guard<mutex> guard(free_mutex_);
+        if (free_.empty()) {
+            all_.emplace_back(new Task());
+            all_.back()->owner = this;
+            // 流水线中的帧之间也有依赖，任务被重复使用时后继的个数不同，预留几个，稳定状态下不再增长
+            all_.back()->successors.reserve(4);
+            // 预留空闲列表的容量，回收时不会分配
+            free_.reserve(all_.size());
+            task = all_.back().get();
+        } else {
+            task = free_.back();
+            free_.pop_back();
+        }
+    }
+    task->finished.store(false, memory_order_relaxed);
+    task->pending.store(1, memory_order_relaxed);
+    task->refs.store(1, memory_order_relaxed);
+    return task;
+}
+
+void TaskScheduler::release(Task *task) {
+    if (task->refs.fetch_sub(1, memory_order_acq_rel) != 1) return;
+    // 闭包捕获的对象在这里析构
+    task->fn = nullptr;
+    task->successors.clear();
+    TaskScheduler *owner = task->owner;
+    lock_guard<mutex> guard(owner->free_mutex_);
+    owner->free_.push_back(task);
+}
+
+TaskScheduler::TaskHandle TaskScheduler::submit(function<void()> fn, const TaskHandle *deps, size_t n_deps) {
+    Task *task = acquire_task();
+    task->fn = move(fn);
+    TaskHandle handle(task);
+
+    // 还没有完成的依赖把任务加入自己的后继列表，完成时减少 pending
+    for (size_t i = 0; i < n_deps; ++i) {
+        const TaskHandle &dep = deps[i];
+        if (!dep.task_) continue;
+        lock_guard<mutex> guard(dep.task_->lock);
+        if (dep.task_->finished.load(memory_order_relaxed)) continue;
+        task->pending.fetch_add(1, memory_order_relaxed);
+        task->refs.fetch_add(1, memory_order_relaxed);
+        dep.task_->successors.push_back(task);
+    }
+    if (task->pending.fetch_sub(1, memory_order_acq_rel) == 1)
+        schedule(task);
+    else
+        release(task);
+    return handle;
+}
+
+void TaskScheduler::spawn(function<void()> fn) {
+    Task *task = acquire_task();
+    task->fn = move(fn);
+    task->pending.store(0, memory_order_relaxed);
+    schedule(task);
+}
+
+void TaskScheduler::schedule(Task *task) {
+    // 队列持有 acquire_task 或者后继列表转交的引用
+    queues_[thread_index()]->push_back(task);
+    pending_.fetch_add(1, memory_order_seq_cst);
+    if (sleeping_.load(memory_order_seq_cst) > 0)
+        wake(false);
+}
+
+void TaskScheduler::wake(bool all) {
+    // 加锁之后再通知，避免在睡眠的线程检查条件和开始等待之间通知而丢失
+    { lock_guard<mutex> guard(sleep_mutex_); }
+    if (all) sleep_cond_.notify_all();
+    else sleep_cond_.notify_one();
+}
+
+void TaskScheduler::finish(Task *task) {
+    {
+        lock_guard<mutex> guard(task->lock);
+        task->finished.store(true);
+        for (Task *next : task->successors)
+            if (next->pending.fetch_sub(1, memory_order_acq_rel) == 1)
+                schedule(next);
+            else
+                release(next);
+        task->successors.clear();
+    }
+    // 可能有线程在等待这个任务。完成标记和 sleeping_ 都是顺序一致的访问，
+    // 等待的线程先增加 sleeping_ 再检查条件，两边至少有一边能看到对方
+    if (sleeping_.load(memory_order_seq_cst) > 0)
+        wake(true);
+    release(task);
+}
+
+TaskScheduler::Task *TaskScheduler::find_task(int index, bool &stolen) {
+    stolen = false;
+    if (Task *task = queues_[index]->pop_back())
+        return task;
+    for (int i = 1; i < n_threads_; ++i) {
+        if (Task *task = queues_[(index + i) % n_threads_]->pop_front()) {
+            stolen = true;
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+void TaskScheduler::run(Task *task, int index, bool stolen) {
+    pending_.fetch_sub(1, memory_order_relaxed);
+    bool outermost = tls_depth++ == 0;
+    auto start = chrono::steady_clock::now();
+    task->fn();
+    --tls_depth;
+    Counters &c = counters_[index];
+    c.tasks.fetch_add(1, memory_order_relaxed);
+    if (stolen) c.steals.fetch_add(1, memory_order_relaxed);
+    if (outermost) {
+        auto ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        c.busy_ns.fetch_add(uint64_t(ns), memory_order_relaxed);
+    }
+    finish(task);
+}
+
+void TaskScheduler::help_until(const function<bool()> &done) {
+    int index = thread_index();
+    while (!done()) {
+        bool stolen;
+        if (Task *task = find_task(index, stolen)) {
+            run(task, index, stolen);
+            continue;
+        }
+        // 没有可以执行的任务：等待的任务正在其他线程上执行，睡眠到有新任务或者有任务完成
+        unique_lock<mutex> guard(sleep_mutex_);
+        sleeping_.fetch_add(1, memory_order_seq_cst);
+        sleep_cond_.wait(guard, [&]() { return pending_.load(memory_order_seq_cst) > 0 || done(); });
+        sleeping_.fetch_sub(1, memory_order_seq_cst);
+    }
+}
+
+void TaskScheduler::wait(const TaskHandle &task) {
+    if (!task.task_) return;
+    Task *t = task.task_;
+    help_until([t]() { return t->finished.load(); });
+}
+
+void TaskScheduler::worker_loop(int index) {
+    tls_scheduler = this;
+    tls_index = index;
+    for (;;) {
+        bool stolen;
+        if (Task *task = find_task(index, stolen)) {
+            run(task, index, stolen);
+            continue;
+        }
+        unique_lock<mutex> guard(sleep_mutex_);
+        sleeping_.fetch_add(1, memory_order_seq_cst);
+        sleep_cond_.wait(guard, [this]() { return stop_ || pending_.load(memory_order_seq_cst) > 0; });
+        sleeping_.fetch_sub(1, memory_order_seq_cst);
+        // 退出前把队列中剩余的任务执行完
+        if (stop_ && pending_.load() == 0) return;
+    }
+}
+
+vector<TaskScheduler::WorkerStats> TaskScheduler::stats() const {
+    vector<WorkerStats> res(n_threads_);
+    for (int i = 0; i < n_threads_; ++i) {
+        res[i].tasks = counters_[i].tasks.load(memory_order_relaxed);
+        res[i].steals = counters_[i].steals.load(memory_order_relaxed);
+        res[i].busy_ms = counters_[i].busy_ns.load(memory_order_relaxed) / 1e6;
+    }
+    return res;
+}
+
+void TaskScheduler::reset_stats() {
+    for (int i = 0; i < n_threads_; ++i) {
+        counters_[i].tasks.store(0, memory_order_relaxed);
+        counters_[i].steals.store(0, memory_order_relaxed);
+        counters_[i].busy_ns.store(0, memory_order_relaxed);
+    }
+}
@@ -1,7 +1,10 @@
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <cstring>
 #include "tgaimage.h"
+#include "hash.h"
+#include "resample.h"
 
 TGAImage::TGAImage() : data(), width(0), height(0), bytespp(0) {}
 TGAImage::TGAImage(const int w, const int h, const int bpp) : data(w*h*bpp, 0), width(w), height(h), bytespp(bpp) {}
@@ -217,7 +220,7 @@ void TGAImage::set(int x, int y, const TGAColor &c) {
     memcpy(data.data()+(x+y*width)*bytespp, c.bgra, bytespp);
 }
 
-int TGAImage::get_bytespp() {
+int TGAImage::get_bytespp() const {
     return bytespp;
 }
 
@@ -260,42 +263,25 @@ std::uint8_t *TGAImage::buffer() {
     return data.data();
 }
 
+const std::uint8_t *TGAImage::buffer() const {
+    return data.data();
+}
+
+std::uint64_t TGAImage::content_hash() const {
+    Hasher h;
+    h << width << height << bytespp;
+    h.bytes(data.data(), data.size());
+    return h.value();
+}
+
 void TGAImage::clear() {
-    data = std::vector<std::uint8_t>(width*height*bytespp, 0);
+    std::fill(data.begin(), data.end(), 0);
 }
 
 void TGAImage::scale(int w, int h) {
     if (w<=0 || h<=0 || !data.size()) return;
-    std::vector<std::uint8_t> tdata(w*h*bytespp, 0);
-    int nscanline = 0;
-    int oscanline = 0;
-    int erry = 0;
-    size_t nlinebytes = w*bytespp;
-    size_t olinebytes = width*bytespp;
-    for (int j=0; j<height; j++) {
-        int errx = width-w;
-        int nx   = -bytespp;
-        int ox   = -bytespp;
-        for (int i=0; i<width; i++) {
-            ox += bytespp;
-            errx += w;
-            while (errx>=(int)width) {
-                errx -= width;
-                nx += bytespp;
-                memcpy(tdata.data()+nscanline+nx, data.data()+oscanline+ox, bytespp);
-            }
-        }
-        erry += h;
-        oscanline += olinebytes;
-        while (erry>=(int)height) {
-            if (erry>=(int)height<<1) // it means we jump over a scanline
-                memcpy(tdata.data()+nscanline+nlinebytes, tdata.data()+nscanline, nlinebytes);
-            erry -= height;
-            nscanline += nlinebytes;
-        }
-    }
-    data = tdata;
-    width = w;
-    height = h;
+    TGAImage res;
+    Resampler().resample(*this, res, w, h);
+    *this = std::move(res);
 }
 
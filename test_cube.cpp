@@ -59,15 +59,14 @@ void test_cube() {
 
     const char *tga_filename = "../test_cube.tga";
 
-    // image
-    TGAImage image(width, height, TGAImage::RGB);
-    auto z_buffer = vector<vector<z_buffer_t>>(height, vector<z_buffer_t>(width, Z_BUFFER_MAX));
+    // 渲染上下文
+    RenderContext context(width, height);
 
     // 初始化 gl
     vec3 camera_pos(0, 0, 0);
     vec3 camera_target(0, 0, -1);
     vec3 camera_up(0, 1, 0);
-    view_port(0, 0, width, width);
+    context.view_port(0, 0, width, width);
     mat<4, 4> projection_matrix = projection(120, 120, 100, 400);
     mat<4, 4> view_matrix = lookat(camera_pos, camera_target, camera_up);
 
@@ -83,10 +82,11 @@ void test_cube() {
 
     // 渲染三角形
     for (const auto &face: model) {
-        triangle(image, z_buffer, random_shader, face);
+        context.triangle(random_shader, face);
     }
+    context.resolve();
 
-    image.write_tga_file(tga_filename);
+    context.image().write_tga_file(tga_filename);
 }
 
 